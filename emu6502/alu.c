@@ -0,0 +1,9 @@
+
+// Decimal mode ADC and SBC results for every A, operand and carry,
+// generated by codegen (see generateAluTable).
+
+#include "em.h"
+
+const word_t ALU_TABLE[ALU_OP_COUNT][2][256][256] = {
+#include "aludef.inc"
+};
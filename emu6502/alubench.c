@@ -0,0 +1,90 @@
+
+// Micro-benchmark for ADC, SBC and CMP: the aluADC family in em.h, which
+// works binary mode out and looks decimal mode up in ALU_TABLE, against the
+// way the interpreter did it before, which had no decimal mode. Each run
+// feeds the same operands through a chain of instructions that depend on A
+// and the carry, like a multi-byte addition does. "make bench_alu" builds it
+// optimized and runs it.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "em.h"
+
+#define OPERAND_COUNT 0xC000 // a multiple of 3
+#define DEFAULT_PASSES 2000
+
+static byte_t operands[OPERAND_COUNT];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The interpreter's add() before the table.
+static void computedAdd(Registers* r, byte_t regVal, byte_t memVal, bool isCmp) {
+  word_t diff = regVal + memVal;
+  if (isCmp || (r->p & FLAG_C))
+    diff++;
+  byte_t b = diff;
+  r->p = (r->p & ~(FLAG_N | FLAG_Z | FLAG_C)) | (b & FLAG_N) | (b ? 0 : FLAG_Z)
+      | (diff & 0x100 ? FLAG_C : 0);
+  if (!isCmp) {
+    bool overflow = (regVal ^ b) & (memVal ^ b) & 0x80;
+    r->p = (r->p & ~FLAG_V) | (overflow ? FLAG_V : 0);
+    r->a = b;
+  }
+}
+
+// ADC, SBC and CMP on each operand in turn.
+static void runComputed(Registers* r, unsigned passes) {
+  for (unsigned pass=0; pass < passes; pass++) {
+    for (unsigned i=0; i < OPERAND_COUNT; i += 3) {
+      computedAdd(r, r->a, operands[i], false);
+      computedAdd(r, r->a, ~operands[i+1], false);
+      computedAdd(r, r->a, ~operands[i+2], true);
+    }
+  }
+}
+
+static void runAlu(Registers* r, unsigned passes) {
+  for (unsigned pass=0; pass < passes; pass++) {
+    for (unsigned i=0; i < OPERAND_COUNT; i += 3) {
+      aluADC(r, operands[i]);
+      aluSBC(r, operands[i+1]);
+      aluCompare(r, r->a, operands[i+2]);
+    }
+  }
+}
+
+static void report(const char* name, void (*run)(Registers*, unsigned), byte_t p,
+    unsigned passes) {
+  Registers r = { .p = p };
+  double start = now();
+  run(&r, passes);
+  double elapsed = now() - start;
+  double ops = (double)passes * OPERAND_COUNT;
+  // A and P are printed so the work can't be optimized away.
+  printf("%-16s %7.1f million/s  (A=%02X P=%02X)\n", name, ops / elapsed / 1e6, r.a, r.p);
+}
+
+int main(int argc, char** argv) {
+  unsigned passes = DEFAULT_PASSES;
+  if (argc > 1)
+    passes = strtoul(argv[1], NULL, 0);
+  // Random operands, the same every run.
+  uint32_t seed = 1;
+  for (unsigned i=0; i < OPERAND_COUNT; i++) {
+    seed = seed * 1103515245 + 12345;
+    operands[i] = seed >> 16;
+  }
+  report("old binary", runComputed, 0, passes);
+  report("aluADC binary", runAlu, 0, passes);
+  report("aluADC decimal", runAlu, FLAG_D, passes);
+  return 0;
+}
@@ -1,4 +1,6 @@
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -9,6 +11,7 @@
 #include <ctype.h>
 
 #include "em.h"
+#include "emtrace.h"
 
 #define FILE_BLOCK_SIZE 256
 
@@ -35,8 +38,9 @@ word_t parseAddr(const char* s) {
 
 //#pragma GCC diagnostic ignored "-Wunused-variable"
 
+// Files are mapped rather than read, since the emulator only reads them.
 buf_t* readFileOrFail(const char* path, const char* fileDescr) {
-  buf_t* file = readFile(path);
+  buf_t* file = mapFile(path);
   if (!file) {
     fprintf(stderr, "Unable to load %s file: %s\n", fileDescr, path);
     exit(2);
@@ -44,24 +48,163 @@ buf_t* readFileOrFail(const char* path, const char* fileDescr) {
   return file;
 }
 
+// Add the disk swaps listed in C64_DISK_SWAP. Each swap is DEVICE:TRIGGER:PATH,
+// where TRIGGER is pc=ADDR (hex), ic=COUNT or missing, and swaps are separated
+// by spaces. A drive takes its swaps in the order they're listed, and mounts
+// them the same way as its first disk.
+//   C64_DISK_SWAP="8:missing:disk2.d64 8:pc=C000:disk3.d64"
+static bool addDiskSwaps(Emu* m, const char* list) {
+  // The drives keep the paths, so the copy isn't freed.
+  char* copy = strdup(list);
+  if (!copy)
+    return false;
+  for (char* item = strtok(copy, " "); item; item = strtok(NULL, " ")) {
+    char* trigger = strchr(item, ':');
+    char* path = trigger ? strchr(trigger + 1, ':') : NULL;
+    if (!path) {
+      fprintf(stderr, "Invalid disk swap (DEVICE:TRIGGER:PATH): %s\n", item);
+      return false;
+    }
+    *trigger++ = 0;
+    *path++ = 0;
+    int triggerID;
+    uint64_t value = 0;
+    if (!strncmp(trigger, "pc=", 3)) {
+      triggerID = DISK_SWAP_AT_PC;
+      value = parseAddr(trigger + 3);
+    } else if (!strncmp(trigger, "ic=", 3)) {
+      triggerID = DISK_SWAP_AT_IC;
+      value = strtoull(trigger + 3, NULL, 10);
+    } else if (!strcmp(trigger, "missing")) {
+      triggerID = DISK_SWAP_ON_MISSING;
+    } else {
+      fprintf(stderr, "Invalid disk swap trigger (pc=ADDR, ic=COUNT or missing): %s\n",
+          trigger);
+      return false;
+    }
+    buf_t* diskFile = readFileOrFail(path, "disk");
+    if ((!isG64(diskFile) && !checkDiskSize(m, diskFile))
+        || !addDiskSwap(m, atoi(item), triggerID, value, path, diskFile)) {
+      fprintf(stderr, "%s\n", m->fault.message);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool writeDiskLogFiles(Emu* m, const char* prefix) {
+  size_t pathSize = strlen(prefix) + 16;
+  char* path = malloc(pathSize);
+  char* ppmPath = malloc(pathSize);
+  bool ok = path && ppmPath;
+  if (!ok)
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory.");
+  if (ok) {
+    snprintf(path, pathSize, "%s.csv", prefix);
+    ok = writeDiskLog(m, path);
+  }
+  for (int i=0; ok && i < DISKDRIVE_COUNT; i++) {
+    unsigned device = DISKDRIVE_FIRST_DEVICE + i;
+    snprintf(path, pathSize, "%s-%u.csv", prefix, device);
+    snprintf(ppmPath, pathSize, "%s-%u.ppm", prefix, device);
+    ok = writeDiskHeatmap(m, device, path, ppmPath);
+  }
+  free(path);
+  free(ppmPath);
+  return ok;
+}
+
 int main(int argc, char** argv) {
+  // The ROMs are built in, but can be replaced with ROM files from a directory
+  // (containing files named chargen, basic and kernal).
+  const char* romDir = getenv("C64_ROM_DIR");
+  if (romDir && !loadSharedROM(romDir)) {
+    fprintf(stderr, "Unable to load ROMs from: %s\n", romDir);
+    return 2;
+  }
   emu_t* m = createEmulator(stdout);
+  if (!m) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  const char* diskLogPrefix = NULL;
   if (argc > 1 && !strcmp("state", argv[1])) {
     // process a state file
-    if (argc != 5) {
-      fprintf(stderr, "State file usage:\n  c64emulator state REG_PATH RAM_PATH DISK_PATH\n");
+    // Disks go in drives 8, 9, 10 and 11 in the order given.
+    if (argc < 5 || argc > 4 + DISKDRIVE_COUNT) {
+      fprintf(stderr, "State file usage:\n"
+          "  c64emulator state REG_PATH RAM_PATH DISK_PATH [DISK_PATH...]\n");
       return 2;
     }
     const char* regPath = argv[2];
     const char* ramPath = argv[3];
-    const char* diskPath = argv[4];
     buf_t* regFile = readFileOrFail(regPath, "register");
     buf_t* ramFile = readFileOrFail(ramPath, "RAM");
-    buf_t* diskFile = readFileOrFail(diskPath, "disk");
-    loadRegisters(m, regFile);
-    loadRAM(m, ramFile);
-    mountDisk(m, diskPath, diskFile);
+    // C64_DISK_WRITE picks what happens to disk writes (see DISK_WRITE_*).
+    // By default the disk is write protected.
+    int writeMode = DISK_WRITE_PROTECTED;
+    const char* writeModeName = getenv("C64_DISK_WRITE");
+    if (writeModeName) {
+      for (writeMode=0; writeMode < DISK_WRITE_MODE_COUNT; writeMode++) {
+        if (!strcmp(writeModeName, DISK_WRITE_MODE_NAMES[writeMode]))
+          break;
+      }
+      if (writeMode == DISK_WRITE_MODE_COUNT) {
+        fprintf(stderr, "Invalid C64_DISK_WRITE (protected, discard, close or exit): %s\n",
+            writeModeName);
+        return 2;
+      }
+    }
+    if (!loadRegisters(m, regFile) || !loadRAMCopyOnWrite(m, ramFile)) {
+      fprintf(stderr, "%s\n", m->fault.message);
+      return 2;
+    }
+    for (int i=4; i < argc; i++) {
+      buf_t* diskFile = readFileOrFail(argv[i], "disk");
+      if (!mountDiskWritable(m, DISKDRIVE_FIRST_DEVICE + i - 4, argv[i], diskFile, writeMode)) {
+        fprintf(stderr, "%s\n", m->fault.message);
+        return 2;
+      }
+    }
+    // With the 1541 ROM in C64_DRIVE_ROM, the drives also run the code that
+    // the C64 sends them (M-E and B-E).
+    const char* driveRomPath = getenv("C64_DRIVE_ROM");
+    if (driveRomPath) {
+      buf_t* driveRom = readFileOrFail(driveRomPath, "drive ROM");
+      for (int i=4; i < argc; i++) {
+        if (!attachDriveCPU(m, DISKDRIVE_FIRST_DEVICE + i - 4, driveRom)) {
+          fprintf(stderr, "%s\n", m->fault.message);
+          return 2;
+        }
+      }
+    }
+    const char* swapList = getenv("C64_DISK_SWAP");
+    if (swapList && !addDiskSwaps(m, swapList))
+      return 2;
+    // C64_DISK_LOG=PREFIX logs disk reads to PREFIX.csv, with a heatmap of
+    // reads per sector for each drive in PREFIX-DEVICE.csv and .ppm.
+    diskLogPrefix = getenv("C64_DISK_LOG");
+    if (diskLogPrefix && !enableDiskLog(m)) {
+      fprintf(stderr, "%s\n", m->fault.message);
+      return 2;
+    }
+#if TRACE_ON
+    // The loader hooks only trace, and hooks run in every build.
     ecaLoaderRegisterHooks(m);
+#endif
+    // C64_ACS_NATIVE=1 runs the ACS loader's bytecodes natively, and =verify
+    // also checks each run against the 6502 code (see ecaloader.c).
+    const char* acsNative = getenv("C64_ACS_NATIVE");
+    if (acsNative && strcmp(acsNative, "0") && strcmp(acsNative, "1")
+        && strcmp(acsNative, "verify")) {
+      fprintf(stderr, "C64_ACS_NATIVE must be 0, 1 or verify: %s\n", acsNative);
+      return 2;
+    }
+    if (acsNative && strcmp(acsNative, "0")
+        && !ecaLoaderEnableNative(m, !strcmp(acsNative, "verify"))) {
+      fprintf(stderr, "%s\n", m->fault.message);
+      return 2;
+    }
     printf("Loaded state: reg='%s', RAM='%s', PC=%04X\n", regPath, ramPath, m->reg.pc);
   } else {
     // process a PRG file
@@ -80,17 +223,82 @@ int main(int argc, char** argv) {
       fprintf(stderr, "Too many arguments.\n");
       exit(1);
     }
-    buf_t* prg = readFile(path);
-    word_t fileAddr = loadPRG(m, prg);
+    buf_t* prg = readFileOrFail(path, "PRG");
+    int fileAddr = loadPRG(m, prg);
+    if (fileAddr < 0) {
+      fprintf(stderr, "%s\n", m->fault.message);
+      return 2;
+    }
     if (useFileAddress)
       m->reg.pc = fileAddr;
     else
       m->reg.pc = overrideAddr;
     printf("Loaded file '%s', starting at $%04X\n", path, m->reg.pc);
   }
-  interp(m);
+  // C64_SCREEN_LOG=PATH saves the text printed on the screen as it's printed,
+  // and C64_SCREEN=PATH saves what's on the screen at the end.
+  const char* screenLogPath = getenv("C64_SCREEN_LOG");
+  if (screenLogPath) {
+    m->screenLog = fopen(screenLogPath, "w");
+    if (!m->screenLog) {
+      fprintf(stderr, "Unable to write screen log: %s\n", screenLogPath);
+      return 2;
+    }
+  }
+  // C64_KEYS types keys from an input script (see emkeys.c), or C64_KEYS_FILE
+  // from a script file.
+  const char* keys = getenv("C64_KEYS");
+  const char* keysPath = getenv("C64_KEYS_FILE");
+  if (keysPath) {
+    buf_t* keysFile = readFileOrFail(keysPath, "input script");
+    if (!setKeyScript(m, (const char*)keysFile->data, keysFile->len)) {
+      fprintf(stderr, "%s\n", m->fault.message);
+      return 2;
+    }
+  } else if (keys && !setKeyScript(m, keys, strlen(keys))) {
+    fprintf(stderr, "%s\n", m->fault.message);
+    return 2;
+  }
+  // C64_CYCLE_LIMIT stops after that many clock cycles.
+  const char* cycleLimit = getenv("C64_CYCLE_LIMIT");
+  if (cycleLimit)
+    m->cycleLimit = strtoull(cycleLimit, NULL, 10);
+  int faultCode = interp(m);
+  if (faultCode != FAULT_NONE) {
+    EmuFault* f = &m->fault;
+    fprintf(stderr, "Fault %s at PC=%04X, IC=" IC_FMT ": %s\n",
+        FAULT_NAMES[f->code], f->pc, f->ic, f->message);
+  }
   int million = m->reg.ic / 1000000;
   printf("Exit: PC=%X, IC="IC_FMT" (%d million)\n", m->reg.pc, m->reg.ic, million);
-  dumpRam(m, "ramdump.bin");
+  printf("Cycles: %" PRIu64 " (%.2f s on a PAL C64)\n", m->reg.cycles,
+      m->reg.cycles / (double)C64_PAL_CLOCK_HZ);
+  if (m->idle.skipped)
+    printf("Idle loops: skipped %" PRIu64 " instructions\n", m->idle.skipped);
+  if (!dumpRam(m, "ramdump.bin"))
+    fprintf(stderr, "%s\n", m->fault.message);
+  if (diskLogPrefix && !writeDiskLogFiles(m, diskLogPrefix))
+    fprintf(stderr, "%s\n", m->fault.message);
+  const char* screenPath = getenv("C64_SCREEN");
+  if (screenPath && !writeScreenText(m, screenPath))
+    fprintf(stderr, "%s\n", m->fault.message);
+  if (m->screenLog)
+    fclose(m->screenLog);
+  // C64_ROM_CALLS=PATH writes how many times each ROM routine was called.
+  const char* romCallsPath = getenv("C64_ROM_CALLS");
+  if (romCallsPath && !writeRomCallCounts(m, romCallsPath))
+    fprintf(stderr, "%s\n", m->fault.message);
+  // Stop the drive CPUs before their disks go.
+  bool unmounted = true;
+  for (int i=0; i < DISKDRIVE_COUNT; i++) {
+    detachDriveCPU(m, DISKDRIVE_FIRST_DEVICE + i);
+    if (!unmountDisk(m, DISKDRIVE_FIRST_DEVICE + i)) {
+      fprintf(stderr, "%s\n", m->fault.message);
+      unmounted = false;
+    }
+  }
+  if (!unmounted)
+    return 1;
+  return faultCode == FAULT_NONE ? 0 : 1;
 }
 
@@ -9,6 +9,8 @@
 
 const char* USAGE =
 "USAGE: codegen instruction_set <source_file> <output_file>\n"
+"       codegen binary_array <source_file> <output_file> <size>\n"
+"       codegen alu_table <output_file>\n"
 ;
 
 void* my_malloc(size_t size) {
@@ -84,8 +86,11 @@ int readTableLine(FILE* src, int fieldCount, int fieldWidth, char* lineBuffer) {
   return fieldCount; // success
 }
 
+// Each line of the table is: opcode (hex), mnemonic, addressing mode and
+// cycles. The cycles may end in "*" for an extra cycle when indexing crosses
+// a page, or "**" for a branch (the interpreter adds its cycles when taken).
 void generateInstructionSet(const char* srcPath, const char* dstPath) {
-#define fieldCount 3
+#define fieldCount 4
 #define fieldWidth 10
   FILE* src = fopenSrc(srcPath);
   FILE* dst = fopenDst(dstPath);
@@ -93,6 +98,7 @@ void generateInstructionSet(const char* srcPath, const char* dstPath) {
   const char* f1 = line + 0 * fieldWidth;
   const char* f2 = line + 1 * fieldWidth;
   const char* f3 = line + 2 * fieldWidth;
+  const char* f4 = line + 3 * fieldWidth;
   char opcodeHex[17];
   int opcode = 0;
   for (;;) {
@@ -100,32 +106,178 @@ void generateInstructionSet(const char* srcPath, const char* dstPath) {
     if (result == -1) {
       break; // EOF
     }
+    if (result != fieldCount) {
+      fprintf(stderr, "Invalid instruction table line after opcode %02X.\n", opcode);
+      exit(1);
+    }
+    char* stars;
+    long cycles = strtol(f4, &stars, 10);
+    int pageCycles = !strcmp(stars, "*");
+    if (cycles < 2 || cycles > 7 || (*stars && strcmp(stars, "*") && strcmp(stars, "**"))) {
+      fprintf(stderr, "Invalid cycles for opcode %s: %s\n", f1, f4);
+      exit(1);
+    }
     for (;;) {
       sprintf(opcodeHex, "%02X", opcode);
       opcode++;
       if (!strcmp(opcodeHex, f1)) {
-        fprintf(dst, "/* %s */ { %s, AM_%s },\n", opcodeHex, f2, f3);
+        fprintf(dst, "/* %s */ { %s, AM_%s, %ld, %d },\n", opcodeHex, f2, f3, cycles, pageCycles);
         break;
       } else {
-        fprintf(dst, "/* %s */ { 0, 0 },\n", opcodeHex);
+        fprintf(dst, "/* %s */ { 0, 0, 0, 0 },\n", opcodeHex);
       }
     }
   }
   for (; opcode < 0x100; opcode++) {
-    fprintf(dst, "/* %02X */ { 0, 0 },\n", opcode);
+    fprintf(dst, "/* %02X */ { 0, 0, 0, 0 },\n", opcode);
   }
 #undef fieldCount
 #undef fieldWidth
 }
 
+// Writes the bytes of a binary file as the body of a C array initializer, so
+// that data files (such as ROM images) can be compiled into the executable.
+// The file must be exactly the expected size, otherwise the array would be
+// silently padded with zeros.
+void generateBinaryArray(const char* srcPath, const char* dstPath, const char* sizeArg) {
+  char* end;
+  long expectedSize = strtol(sizeArg, &end, 0);
+  if (*end != 0 || expectedSize <= 0) {
+    fprintf(stderr, "Invalid size: %s\n", sizeArg);
+    fprintf(stderr, USAGE);
+    exit(1);
+  }
+  FILE* src = fopenSrc(srcPath);
+  FILE* dst = fopenDst(dstPath);
+  long size = 0;
+  int ch;
+  while ((ch = getc(src)) != EOF) {
+    fprintf(dst, "0x%02X,", ch);
+    size++;
+    if (size % 16 == 0)
+      putc('\n', dst);
+  }
+  if (ferror(src)) {
+    fprintf(stderr, "Error reading source file: %s\n", srcPath);
+    exit(1);
+  }
+  if (size != expectedSize) {
+    fprintf(stderr, "Source file is %ld bytes, expected %ld: %s\n",
+        size, expectedSize, srcPath);
+    fclose(dst);
+    remove(dstPath);
+    exit(1);
+  }
+  fclose(src);
+  fclose(dst);
+}
+
+// The flags as they are in the 6502's status register.
+#define ALU_N 0x80
+#define ALU_V 0x40
+#define ALU_Z 0x02
+#define ALU_C 0x01
+
+// Binary ADC. SBC is the same with the operand inverted.
+unsigned aluAdd(unsigned a, unsigned b, unsigned c) {
+  unsigned sum = a + b + c;
+  unsigned r = sum & 0xFF;
+  unsigned flags = (r & ALU_N) | (r ? 0 : ALU_Z) | (sum > 0xFF ? ALU_C : 0);
+  if ((a ^ r) & (b ^ r) & 0x80)
+    flags |= ALU_V;
+  return flags << 8 | r;
+}
+
+// Decimal ADC the way the NMOS 6502 does it, including for digits over 9:
+// Z is from the binary sum, and N and V are from the sum after adjusting the
+// low digit but not the high one.
+unsigned aluAddDecimal(unsigned a, unsigned b, unsigned c) {
+  int lo = (a & 0x0F) + (b & 0x0F) + c;
+  if (lo >= 0x0A)
+    lo = ((lo + 0x06) & 0x0F) + 0x10;
+  int sum = (a & 0xF0) + (b & 0xF0) + lo;
+  int signedSum = (int8_t)(a & 0xF0) + (int8_t)(b & 0xF0) + lo;
+  unsigned flags = aluAdd(a, b, c) >> 8 & ALU_Z;
+  flags |= sum & ALU_N;
+  if (signedSum < -128 || signedSum > 127)
+    flags |= ALU_V;
+  if (sum >= 0xA0)
+    sum += 0x60;
+  if (sum > 0xFF)
+    flags |= ALU_C;
+  return flags << 8 | (sum & 0xFF);
+}
+
+// Decimal SBC on the NMOS 6502: the flags are all from binary SBC.
+unsigned aluSubDecimal(unsigned a, unsigned b, unsigned c) {
+  int lo = (a & 0x0F) - (b & 0x0F) + (int)c - 1;
+  if (lo < 0)
+    lo = ((lo - 0x06) & 0x0F) - 0x10;
+  int diff = (a & 0xF0) - (b & 0xF0) + lo;
+  if (diff < 0)
+    diff -= 0x60;
+  return (aluAdd(a, b ^ 0xFF, c) & 0xFF00) | (diff & 0xFF);
+}
+
+// Writes the body of the decimal mode ADC and SBC table, indexed by
+// operation (ADC, SBC), carry, A and the operand. Each entry has the result
+// in the low byte and the N, V, Z and C flags in the high byte. Binary mode
+// is quicker to work out than to look up.
+void generateAluTable(const char* dstPath) {
+  unsigned (*ops[])(unsigned, unsigned, unsigned) = {
+    aluAddDecimal, aluSubDecimal,
+  };
+  FILE* dst = fopenDst(dstPath);
+  for (unsigned op=0; op < sizeof(ops) / sizeof(ops[0]); op++) {
+    fprintf(dst, "{ // operation %u\n", op);
+    for (unsigned c=0; c < 2; c++) {
+      fprintf(dst, "{ // carry %u\n", c);
+      for (unsigned a=0; a < 0x100; a++) {
+        fprintf(dst, "{ // A=%02X\n", a);
+        for (unsigned b=0; b < 0x100; b++) {
+          fprintf(dst, "0x%04X,", ops[op](a, b, c));
+          if (b % 16 == 15)
+            putc('\n', dst);
+        }
+        fprintf(dst, "},\n");
+      }
+      fprintf(dst, "},\n");
+    }
+    fprintf(dst, "},\n");
+  }
+  if (fclose(dst) != 0) {
+    fprintf(stderr, "Error writing destination file: %s\n", dstPath);
+    exit(1);
+  }
+}
+
 int main(int argc, char** argv) {
-  if (argc != 4) {
+  if (argc < 2) {
     fprintf(stderr, "ERROR: Wrong number of arguments.\n");
     fprintf(stderr, USAGE);
     exit(1);
   }
   if (!strcmp(argv[1], "instruction_set")) {
+    if (argc != 4) {
+      fprintf(stderr, "ERROR: Wrong number of arguments.\n");
+      fprintf(stderr, USAGE);
+      exit(1);
+    }
     generateInstructionSet(argv[2], argv[3]);
+  } else if (!strcmp(argv[1], "binary_array")) {
+    if (argc != 5) {
+      fprintf(stderr, "ERROR: Wrong number of arguments.\n");
+      fprintf(stderr, USAGE);
+      exit(1);
+    }
+    generateBinaryArray(argv[2], argv[3], argv[4]);
+  } else if (!strcmp(argv[1], "alu_table")) {
+    if (argc != 3) {
+      fprintf(stderr, "ERROR: Wrong number of arguments.\n");
+      fprintf(stderr, USAGE);
+      exit(1);
+    }
+    generateAluTable(argv[2]);
   } else {
     fprintf(stderr, "ERROR: Invalid command.\n");
     fprintf(stderr, USAGE);
@@ -0,0 +1,404 @@
+
+// d64catalog: list every file on every disk image in a collection.
+//
+// Usage: d64catalog [-j THREADS] CATALOG PATH...
+//
+// The paths are images or directories, which are searched for .d64, .d71,
+// .d81 and .g64 files. The catalog is a CSV file with a row for each file on
+// each image:
+//
+//   image,mtime,size,file,type,blocks,track,sector,bytes,hash
+//
+// mtime (in nanoseconds) and size are the image file's. hash is the 64-bit
+// FNV-1a hash of the file's data. An image with no files gets one row with
+// the file columns empty, and an image that can't be read gets one with the
+// type "invalid".
+//
+// If the catalog already exists, images whose mtime and size haven't changed
+// keep their rows from it and aren't read again. The others are read in
+// parallel, one thread per CPU unless -j says otherwise.
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700 // nftw
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "em.h"
+
+#define CATALOG_HEADER "image,mtime,size,file,type,blocks,track,sector,bytes,hash\n"
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ull
+#define FNV_PRIME 0x100000001B3ull
+#define MAX_THREADS 256
+
+typedef struct {
+  char* path;
+  int64_t mtime; // nanoseconds
+  int64_t size;
+  // The image's rows: from the old catalog if it hasn't changed, otherwise
+  // built by a worker.
+  const char* oldRows;
+  unsigned oldRowsLen;
+  buf_t* rows;
+} Image;
+
+typedef struct {
+  Image* images;
+  unsigned count;
+  unsigned cap;
+} ImageList;
+
+// nftw doesn't pass any context to its callback.
+static ImageList found;
+
+static void appendf(buf_t* buf, const char* fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void appendf(buf_t* buf, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  bufEnsureExtraCap(buf, len + 1);
+  va_start(ap, fmt);
+  vsnprintf((char*)buf->data + buf->len, len + 1, fmt, ap);
+  va_end(ap);
+  buf->len += len;
+}
+
+// Quote a CSV field. Bytes that aren't printable ASCII (filenames are
+// PETSCII) are written as \xNN, and backslashes are doubled.
+static void appendQuoted(buf_t* buf, const char* s) {
+  bufAppendChar(buf, '"');
+  for (const byte_t* p = (const byte_t*)s; *p; p++) {
+    if (*p == '"')
+      bufAppend(buf, "\"\"");
+    else if (*p == '\\')
+      bufAppend(buf, "\\\\");
+    else if (*p < 0x20 || *p >= 0x7F)
+      appendf(buf, "\\x%02X", *p);
+    else
+      bufAppendChar(buf, *p);
+  }
+  bufAppendChar(buf, '"');
+}
+
+static bool addImage(ImageList* list, const char* path, const struct stat* st) {
+  if (list->count == list->cap) {
+    unsigned cap = list->cap ? 2 * list->cap : 1024;
+    Image* images = realloc(list->images, cap * sizeof(Image));
+    if (!images)
+      return false;
+    list->images = images;
+    list->cap = cap;
+  }
+  Image* img = &list->images[list->count];
+  memset(img, 0, sizeof(Image));
+  img->path = strdup(path);
+  if (!img->path)
+    return false;
+  img->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+  img->size = st->st_size;
+  list->count++;
+  return true;
+}
+
+static bool isImagePath(const char* path) {
+  const char* ext = strrchr(path, '.');
+  return ext && (!strcasecmp(ext, ".d64") || !strcasecmp(ext, ".d71")
+      || !strcasecmp(ext, ".d81") || !strcasecmp(ext, ".g64"));
+}
+
+static int foundFile(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+  (void)ftw;
+  if (type == FTW_F && isImagePath(path) && !addImage(&found, path, st)) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+  return 0;
+}
+
+static int compareImages(const void* a, const void* b) {
+  return strcmp(((const Image*)a)->path, ((const Image*)b)->path);
+}
+
+// READING THE OLD CATALOG
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// Parse a CSV field at p, which is quoted if it starts with a quote. The
+// field's text is copied to out, with the escapes from appendQuoted undone.
+// Returns the character after the field.
+static const char* parseField(const char* p, const char* end, buf_t* out) {
+  out->len = 0;
+  if (p < end && *p == '"') {
+    for (p++; p < end; p++) {
+      if (*p == '"') {
+        if (p + 1 < end && p[1] == '"')
+          p++;
+        else {
+          p++;
+          break;
+        }
+      } else if (*p == '\\' && p + 1 < end && p[1] == '\\') {
+        p++;
+      } else if (*p == '\\' && p + 3 < end && p[1] == 'x'
+          && hexDigit(p[2]) >= 0 && hexDigit(p[3]) >= 0) {
+        bufAppendChar(out, hexDigit(p[2]) << 4 | hexDigit(p[3]));
+        p += 3;
+        continue;
+      }
+      bufAppendChar(out, *p);
+    }
+  } else {
+    while (p < end && *p != ',' && *p != '\n')
+      bufAppendChar(out, *p++);
+  }
+  bufAppendChar(out, 0);
+  return p;
+}
+
+// Attach rows from the old catalog to the images that haven't changed since.
+// Rows for an image are always together, so they're attached as one range.
+static unsigned reuseOldRows(const buf_t* catalog, ImageList* list) {
+  unsigned reused = 0;
+  const char* p = (const char*)catalog->data;
+  const char* end = p + catalog->len;
+  size_t headerLen = strlen(CATALOG_HEADER);
+  if ((size_t)(end - p) < headerLen || memcmp(p, CATALOG_HEADER, headerLen))
+    return 0; // not a catalog, or an old format
+  p += headerLen;
+  buf_t* field = bufCreate();
+  Image* current = NULL;
+  while (p < end) {
+    const char* row = p;
+    const char* rowEnd = memchr(p, '\n', end - p);
+    if (!rowEnd)
+      break; // cut short
+    rowEnd++;
+    p = parseField(p, rowEnd, field);
+    Image key = { .path = (char*)field->data };
+    Image* img = bsearch(&key, list->images, list->count, sizeof(Image), compareImages);
+    if (img && img != current) {
+      int64_t mtime = 0, size = 0;
+      if (sscanf(p, ",%" SCNd64 ",%" SCNd64 ",", &mtime, &size) == 2
+          && mtime == img->mtime && size == img->size && !img->oldRows) {
+        img->oldRows = row;
+        reused++;
+      }
+      current = img;
+    }
+    if (img && img->oldRows && img == current)
+      img->oldRowsLen = rowEnd - img->oldRows;
+    p = rowEnd;
+  }
+  bufDestroy(field);
+  return reused;
+}
+
+// CATALOGING AN IMAGE
+
+static void appendRowStart(buf_t* rows, const Image* img) {
+  appendQuoted(rows, img->path);
+  appendf(rows, ",%" PRId64 ",%" PRId64 ",", img->mtime, img->size);
+}
+
+static uint64_t hashFile(const buf_t* image, const DiskIndex* index, const DiskFileEntry* f) {
+  uint64_t h = FNV_OFFSET_BASIS;
+  for (unsigned i=0; i < f->chainLength; i++) {
+    const byte_t* d = diskSectorData(image, index->chains[f->chainStart + i]);
+    unsigned len = sectorDataLength(d);
+    for (unsigned j=0; j < len; j++) {
+      h ^= d[2 + j];
+      h *= FNV_PRIME;
+    }
+  }
+  return h;
+}
+
+static void catalogImage(Image* img) {
+  buf_t* rows = bufCreate();
+  img->rows = rows;
+  buf_t* file = mapFile(img->path);
+  G64Image* g64 = NULL;
+  const buf_t* image = file;
+  const DiskFormat* format = NULL;
+  if (file && isG64(file)) {
+    g64 = openG64(file);
+    if (g64) {
+      g64DecodeFiles(g64);
+      image = g64->image;
+      format = g64->format;
+    }
+  } else if (file) {
+    format = diskFormatForSize(file->len, NULL);
+  }
+  DiskIndex* index = format ? buildDiskIndex(image, format) : NULL;
+  if (!index) {
+    appendRowStart(rows, img);
+    bufAppend(rows, ",invalid,,,,,\n");
+  } else if (index->fileCount == 0) {
+    appendRowStart(rows, img);
+    bufAppend(rows, ",,,,,,\n");
+  }
+  for (unsigned i=0; index && i < index->fileCount; i++) {
+    const DiskFileEntry* f = &index->files[i];
+    appendRowStart(rows, img);
+    appendQuoted(rows, f->filename);
+    appendf(rows, ",%s%s%s,%u,%u,%u,%u,%016" PRIX64 "\n",
+        f->filetypeID < FILETYPE_COUNT ? FILETYPE_NAMES[f->filetypeID] : "???",
+        f->flags & DIRENTRY_FLAG_CLOSED ? "" : "*",
+        f->flags & DIRENTRY_FLAG_LOCKED ? "<" : "",
+        f->fileSizeInSectors, f->startTrack, f->startSector, f->byteLength,
+        hashFile(image, index, f));
+  }
+  if (index)
+    destroyDiskIndex(index);
+  closeG64(g64);
+  if (file)
+    bufDestroy(file);
+}
+
+// THREAD POOL
+
+typedef struct {
+  Image** todo;
+  unsigned count;
+  atomic_uint next;
+} Work;
+
+static void* worker(void* arg) {
+  Work* w = arg;
+  unsigned i;
+  while ((i = atomic_fetch_add(&w->next, 1)) < w->count)
+    catalogImage(w->todo[i]);
+  return NULL;
+}
+
+static void runWorkers(Work* w, unsigned threadCount) {
+  pthread_t threads[MAX_THREADS];
+  unsigned started = 0;
+  while (started < threadCount
+      && pthread_create(&threads[started], NULL, worker, w) == 0)
+    started++;
+  if (started == 0)
+    worker(w); // do it all on this thread
+  for (unsigned i=0; i < started; i++)
+    pthread_join(threads[i], NULL);
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: d64catalog [-j THREADS] CATALOG PATH...\n");
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+  int argi = 1;
+  if (argi + 1 < argc && !strcmp(argv[argi], "-j")) {
+    threadCount = atol(argv[argi + 1]);
+    argi += 2;
+  }
+  if (argc - argi < 2 || threadCount < 1)
+    usage();
+  if (threadCount > MAX_THREADS)
+    threadCount = MAX_THREADS;
+  const char* catalogPath = argv[argi++];
+
+  for (; argi < argc; argi++) {
+    struct stat st;
+    if (stat(argv[argi], &st) != 0) {
+      fprintf(stderr, "Unable to stat: %s\n", argv[argi]);
+      return 1;
+    }
+    // Images named on the command line don't need an image extension.
+    bool ok = S_ISDIR(st.st_mode)
+        ? nftw(argv[argi], foundFile, 64, FTW_PHYS) == 0
+        : addImage(&found, argv[argi], &st);
+    if (!ok) {
+      fprintf(stderr, "Unable to search: %s\n", argv[argi]);
+      return 1;
+    }
+  }
+  qsort(found.images, found.count, sizeof(Image), compareImages);
+  // The same image could be found twice.
+  unsigned n = 0;
+  for (unsigned i=0; i < found.count; i++) {
+    if (n > 0 && !strcmp(found.images[n-1].path, found.images[i].path))
+      free(found.images[i].path);
+    else
+      found.images[n++] = found.images[i];
+  }
+  found.count = n;
+
+  buf_t* oldCatalog = NULL;
+  unsigned reused = 0;
+  if (access(catalogPath, F_OK) == 0) {
+    oldCatalog = mapFile(catalogPath);
+    if (!oldCatalog)
+      return 1;
+    reused = reuseOldRows(oldCatalog, &found);
+  }
+
+  Work w = { .todo = malloc((found.count + 1) * sizeof(Image*)) };
+  if (!w.todo) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+  for (unsigned i=0; i < found.count; i++) {
+    if (!found.images[i].oldRows)
+      w.todo[w.count++] = &found.images[i];
+  }
+  atomic_init(&w.next, 0);
+  runWorkers(&w, threadCount);
+
+  // Write the new catalog next to the old one and swap it in, so an
+  // interrupted run leaves the old one as it was.
+  size_t tmpLen = strlen(catalogPath) + 5;
+  char* tmpPath = malloc(tmpLen);
+  if (!tmpPath) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+  snprintf(tmpPath, tmpLen, "%s.tmp", catalogPath);
+  FILE* out = fopen(tmpPath, "wb");
+  if (!out) {
+    fprintf(stderr, "Unable to write catalog: %s\n", tmpPath);
+    return 1;
+  }
+  fputs(CATALOG_HEADER, out);
+  unsigned long fileRows = 0;
+  for (unsigned i=0; i < found.count; i++) {
+    Image* img = &found.images[i];
+    const char* rows = img->rows ? (const char*)img->rows->data : img->oldRows;
+    unsigned len = img->rows ? img->rows->len : img->oldRowsLen;
+    fwrite(rows, 1, len, out);
+    for (unsigned j=0; j < len; j++)
+      fileRows += rows[j] == '\n';
+  }
+  if (fclose(out) != 0 || rename(tmpPath, catalogPath) != 0) {
+    fprintf(stderr, "Unable to write catalog: %s\n", catalogPath);
+    return 1;
+  }
+  fprintf(stderr, "%u images (%u read, %u unchanged), %lu rows\n",
+      found.count, w.count, reused, fileRows);
+  return 0;
+}
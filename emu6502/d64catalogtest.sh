@@ -0,0 +1,18 @@
+#!/bin/sh
+# d64catalog round trip: images whose names need escaping in the catalog (a
+# non-ASCII name and one with a backslash) must be found again in it on the
+# next run, and not read again.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+for name in 'Bärbel.d64' 'back\slash.d64' 'plain.d64'; do
+  head -c 174848 /dev/zero > "$dir/$name"
+done
+./d64catalog "$dir/catalog.csv" "$dir" 2> "$dir/first"
+./d64catalog "$dir/catalog.csv" "$dir" 2> "$dir/second"
+if grep -q '(0 read, 3 unchanged)' "$dir/second"; then
+  echo "d64catalog round trip: ok"
+else
+  echo "d64catalog round trip: FAILED: $(cat "$dir/second")"
+  exit 1
+fi
@@ -0,0 +1,256 @@
+
+// Disk write test: files are written to blank D64 images through the KERNAL
+// calls a program would make (SETLFS, SETNAM, OPEN, CHKOUT, BSOUT, CLRCHN and
+// CLOSE), and the images are checked with the disk index. It covers BAM
+// allocation, a second directory sector, replacing with "@", appending, DISK
+// FULL and WRITE PROTECT ON, and that a mount writing back on CLOSE leaves
+// the same files in the image file. "make test" builds and runs it.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "em.h"
+
+#define D64_SECTORS 683
+#define CALL_ADDR 0xC000 // JSR to the KERNAL, then to where interp stops
+#define NAME_ADDR 0xC100
+#define FILE_LFN 2
+
+static unsigned failures;
+
+static void check(bool ok, const char* what) {
+  if (!ok) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+// Call a KERNAL routine with A, X and Y. A fault ends the test.
+static void kernal(Emu* m, word_t routine, byte_t a, byte_t x, byte_t y) {
+  const byte_t code[] = {
+    0x20, toLo(routine), toHi(routine), // JSR routine
+    0x4C, 0x25, 0x09,                   // JMP $0925
+  };
+  memcpy(m->ram + CALL_ADDR, code, sizeof(code));
+  m->reg.a = a;
+  m->reg.x = x;
+  m->reg.y = y;
+  m->reg.pc = CALL_ADDR;
+  if (interp(m) != FAULT_NONE) {
+    printf("Fault: %s\n", m->fault.message);
+    exit(1);
+  }
+}
+
+// Write a file on drive 8, as OPEN 2,8,2,name: PRINT#2 ...: CLOSE 2 would.
+static void writeFile(Emu* m, const char* name, const byte_t* data, unsigned len) {
+  unsigned nameLen = strlen(name);
+  memcpy(m->ram + NAME_ADDR, name, nameLen);
+  kernal(m, C64_ROM_CALL_SETNAM, nameLen, toLo(NAME_ADDR), toHi(NAME_ADDR));
+  kernal(m, C64_ROM_CALL_SETLFS, FILE_LFN, DISKDRIVE_FIRST_DEVICE, FILE_LFN);
+  kernal(m, C64_ROM_CALL_OPEN, 0, 0, 0);
+  kernal(m, C64_ROM_CALL_CHKOUT, 0, FILE_LFN, 0);
+  for (unsigned i=0; i < len; i++)
+    kernal(m, C64_ROM_CALL_BSOUT, data[i], 0, 0);
+  kernal(m, C64_ROM_CALL_CLRCHN, 0, 0, 0);
+  kernal(m, C64_ROM_CALL_CLOSE, FILE_LFN, 0, 0);
+}
+
+// The drive's error channel starts with the error code.
+static bool driveStatusIs(Emu* m, const char* code) {
+  const DiskDrive* d = m->diskdrives[0];
+  return d->statusLen >= 2 && !strncmp(d->status, code, 2);
+}
+
+static byte_t* sector(const buf_t* image, unsigned track, unsigned s) {
+  const DiskFormat* format = diskFormatForSize(image->len, NULL);
+  return image->data + (format->tracks[track].offsetInSectors + s) * SECTOR_SIZE;
+}
+
+// A track's BAM entry: the free count, then a bit for each sector.
+static byte_t* bamEntry(const buf_t* image, unsigned track) {
+  return sector(image, 18, 0) + 4 * track;
+}
+
+// Free sectors outside the directory track, as DOS counts "blocks free".
+static unsigned blocksFree(const buf_t* image) {
+  unsigned count = 0;
+  for (unsigned t=1; t <= 35; t++) {
+    if (t != 18)
+      count += bamEntry(image, t)[0];
+  }
+  return count;
+}
+
+static buf_t* blankImage(void) {
+  const DiskFormat* format = diskFormatForSize(D64_SECTORS * SECTOR_SIZE, NULL);
+  buf_t* image = bufCreate();
+  bufEnsureCap(image, D64_SECTORS * SECTOR_SIZE);
+  image->len = D64_SECTORS * SECTOR_SIZE;
+  memset(image->data, 0, image->len);
+  byte_t* bam = sector(image, 18, 0);
+  bam[0] = 18;
+  bam[1] = 1;
+  bam[2] = 0x41;
+  for (unsigned t=1; t <= 35; t++) {
+    unsigned bits = (1 << format->tracks[t].sectorCount) - 1;
+    if (t == 18)
+      bits &= ~3; // the BAM and the first directory sector
+    byte_t* e = bamEntry(image, t);
+    e[0] = format->tracks[t].sectorCount - (t == 18 ? 2 : 0);
+    e[1] = bits;
+    e[2] = bits >> 8;
+    e[3] = bits >> 16;
+  }
+  sector(image, 18, 1)[1] = 0xFF;
+  return image;
+}
+
+// The contents of a file on a mounted disk, or NULL if it isn't there.
+static buf_t* mountedFile(Emu* m, const char* name) {
+  const DiskDrive* d = m->diskdrives[0];
+  int i = findDiskFile(d->index, (const byte_t*)name, strlen(name));
+  return i < 0 ? NULL : readDiskFile(d->mountedImageData, d->index, i);
+}
+
+static bool fileIs(Emu* m, const char* name, const byte_t* data, unsigned len) {
+  buf_t* f = mountedFile(m, name);
+  bool same = f && f->len == len && !memcmp(f->data, data, len);
+  if (f)
+    bufDestroy(f);
+  return same;
+}
+
+static Emu* createTestEmulator(void) {
+  Emu* m = createEmulator(NULL);
+  if (!m) {
+    printf("Out of memory\n");
+    exit(1);
+  }
+  return m;
+}
+
+// Files on a writable mount that writes back on CLOSE.
+static void testWrites(const char* path) {
+  buf_t* blank = blankImage();
+  FILE* f = fopen(path, "wb");
+  bool written = f && fwrite(blank->data, 1, blank->len, f) == blank->len;
+  if (f && fclose(f) != 0)
+    written = false;
+  if (!written) {
+    printf("Unable to write %s\n", path);
+    exit(1);
+  }
+  Emu* m = createTestEmulator();
+  if (!mountDiskWritable(m, DISKDRIVE_FIRST_DEVICE, path, blank, DISK_WRITE_ON_CLOSE)) {
+    printf("%s\n", m->fault.message);
+    exit(1);
+  }
+  const DiskDrive* d = m->diskdrives[0];
+  unsigned freeBefore = blocksFree(d->mountedImageData);
+  byte_t data[300];
+  for (unsigned i=0; i < sizeof(data); i++)
+    data[i] = i;
+
+  // 300 bytes take two sectors.
+  writeFile(m, "ONE,S,W", data, sizeof(data));
+  check(fileIs(m, "ONE", data, sizeof(data)), "write a file");
+  check(blocksFree(d->mountedImageData) == freeBefore - 2, "BAM allocation");
+
+  // The ninth file needs a second directory sector.
+  for (unsigned i=2; i <= 9; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "F%u,S,W", i);
+    writeFile(m, name, data, 1);
+  }
+  check(d->index->fileCount == 9 && fileIs(m, "F9", data, 1), "ninth file");
+  check(sector(d->mountedImageData, 18, 1)[0] == 18, "directory sector link");
+  check(bamEntry(d->mountedImageData, 18)[0] == 16, "directory sector allocation");
+
+  // Without "@" an existing file is left alone.
+  writeFile(m, "ONE,S,W", data + 1, 10);
+  check(fileIs(m, "ONE", data, sizeof(data)), "write existing file");
+  writeFile(m, "@0:ONE,S,W", data + 1, 10);
+  check(fileIs(m, "ONE", data + 1, 10), "replace with @");
+  check(blocksFree(d->mountedImageData) == freeBefore - 9, "replaced file's sectors freed");
+
+  writeFile(m, "ONE,S,A", data + 11, 5);
+  check(fileIs(m, "ONE", data + 1, 15), "append");
+  check(d->index->fileCount == 9, "append keeps one entry");
+
+  // Each CLOSE wrote the changed sectors back to the file.
+  buf_t* image = readFile(path);
+  DiskIndex* index = image ? buildDiskIndex(image, d->index->format) : NULL;
+  int one = index ? findDiskFile(index, (const byte_t*)"ONE", 3) : -1;
+  check(index && index->fileCount == 9 && one >= 0 && index->files[one].byteLength == 15,
+      "write back on CLOSE");
+  check(d->dirtyCount == 0, "no sectors left to write back");
+  destroyDiskIndex(index);
+  if (image)
+    bufDestroy(image);
+  destroyEmulator(m);
+  bufDestroy(blank);
+}
+
+// A disk with two free sectors. A file that needs more isn't written.
+static void testDiskFull(void) {
+  buf_t* image = blankImage();
+  for (unsigned t=1; t <= 35; t++) {
+    if (t != 18)
+      memset(bamEntry(image, t), 0, 4);
+  }
+  memcpy(bamEntry(image, 1), (const byte_t[]){ 2, 0x03, 0, 0 }, 4);
+  Emu* m = createTestEmulator();
+  if (!mountDiskWritable(m, DISKDRIVE_FIRST_DEVICE, "full.d64", image, DISK_WRITE_DISCARD)) {
+    printf("%s\n", m->fault.message);
+    exit(1);
+  }
+  const DiskDrive* d = m->diskdrives[0];
+  byte_t data[3 * (SECTOR_SIZE - 2)] = { 0 };
+  writeFile(m, "BIG,S,W", data, sizeof(data));
+  check(driveStatusIs(m, "72"), "DISK FULL reported");
+  check(d->index->fileCount == 0 && blocksFree(d->mountedImageData) == 2, "DISK FULL writes nothing");
+  writeFile(m, "FITS,S,W", data, 2 * (SECTOR_SIZE - 2));
+  check(d->statusLen == 0 && fileIs(m, "FITS", data, 2 * (SECTOR_SIZE - 2)), "file filling the disk");
+  check(blocksFree(d->mountedImageData) == 0, "disk full after filling it");
+  destroyEmulator(m);
+  bufDestroy(image);
+}
+
+static void testWriteProtect(void) {
+  buf_t* image = blankImage();
+  Emu* m = createTestEmulator();
+  if (!mountDisk(m, "protected.d64", image)) {
+    printf("%s\n", m->fault.message);
+    exit(1);
+  }
+  byte_t data[10] = { 0 };
+  writeFile(m, "ONE,S,W", data, sizeof(data));
+  check(driveStatusIs(m, "26"), "WRITE PROTECT ON reported");
+  check(m->diskdrives[0]->index->fileCount == 0, "protected disk unchanged");
+  destroyEmulator(m);
+  bufDestroy(image);
+}
+
+int main(void) {
+  const char* tmpDir = getenv("TMPDIR");
+  char path[FILENAME_MAX];
+  snprintf(path, sizeof(path), "%s/disktest.XXXXXX", tmpDir ? tmpDir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    printf("Unable to create %s\n", path);
+    return 1;
+  }
+  close(fd);
+  testWrites(path);
+  unlink(path);
+  testDiskFull();
+  testWriteProtect();
+  printf("Disk writes: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
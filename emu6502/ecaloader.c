@@ -363,3 +363,398 @@ void ecaLoaderRegisterHooks(Emu* m) {
 };
 
 
+
+//| NATIVE BYTECODE ENGINE |
+//|------------------------|
+
+// With ecaLoaderEnableNative, a hook at the dispatch loop runs the bytecodes
+// in C instead of in the 6502 code that interprets them. It leaves memory,
+// the IP and the registers as the 6502 code would: X as the dispatch loop
+// or the handler's LDX #0 left it, and C and V from the handler's ADC or
+// ASL. Then it hands back at the dispatch loop for the bytecodes that need
+// the 6502 code: the native calls and jumps, and GOSUB and RETURN, whose
+// stack frame isn't worked out yet. The other loader hooks don't see
+// bytecodes that run natively.
+//
+// The IP is kept the way the 6502 code keeps it: a base at $26:27 and an
+// offset in the Y register, with a carry out of Y going to $27.
+
+#define RAM_WORD_OPERAND 0x22 // the last word operand, decoded
+#define RAM_IP 0x26
+#define RAM_VM_A 0x28
+#define RAM_VM_C 0x2C
+#define RAM_VM_X 0xC6C1
+#define RAM_VM_Y 0xC6C2
+#define RAM_JUMP_DEST (INTERP_BYTECODE_PREJUMP + 1)
+
+#define BYTE_OPERAND_KEY 0x6B
+#define WORD_OPERAND_KEY_LO 0x2D
+#define WORD_OPERAND_KEY_HI 0x29
+
+// Roughly what a bytecode takes on the 6502: the dispatch loop, reading
+// the operand and the handler.
+#define BYTECODE_INSTRUCTIONS 27
+#define BYTECODE_CYCLES 87
+
+// The most instructions the 6502 code can take for a bytecode, when
+// verifying.
+#define VERIFY_BYTECODE_INSTRUCTIONS 1000
+
+enum { OPERAND_NONE, OPERAND_BYTE, OPERAND_WORD };
+
+static const struct {
+  word_t handler; // where the dispatch loop jumps to
+  byte_t operand; // OPERAND_*
+  bool native; // run by runBytecodes
+} BYTECODES[INSTRUCTION_COUNT] = {
+  { 0xC547, OPERAND_WORD, true },  // GOTO
+  { 0xC583, OPERAND_BYTE, true },  // AND
+  { 0xC5D9, OPERAND_WORD, false }, // GOSUB
+  { 0xC586, OPERAND_WORD, false }, // FUNCALL_NATIVE
+  { 0xC5AE, OPERAND_BYTE, true },  // LDA imm
+  { 0xC5BC, OPERAND_WORD, true },  // LDA var
+  { 0xC5A4, OPERAND_WORD, true },  // GOTOZ
+  { 0xC672, OPERAND_WORD, true },  // STA
+  { 0xC60D, OPERAND_BYTE, true },  // SUB imm
+  { 0xC59E, OPERAND_WORD, false }, // GOTO NATIVE
+  { 0xC5F1, OPERAND_NONE, false }, // RETURN
+  { 0xC5C8, OPERAND_WORD, true },  // ARR
+  { 0xC608, OPERAND_NONE, true },  // ASL
+  { 0xC622, OPERAND_WORD, true },  // INC
+  { 0xC625, OPERAND_WORD, true },  // ADD
+  { 0xC628, OPERAND_NONE, true },  // XOR_pC_A
+  { 0xC62B, OPERAND_WORD, true },  // GOTONZ
+  { 0xC62E, OPERAND_WORD, true },  // SUB var
+  { 0xC631, OPERAND_WORD, true },  // GOTOGE
+  { 0xC634, OPERAND_WORD, true },  // LDXY
+};
+
+typedef struct {
+  Emu* shadow; // runs the same bytecodes on the 6502 code
+  Emu* m;
+  uint64_t arrivals; // at the dispatch loop since the shadow started
+  uint64_t target; // the arrival to compare at
+  word_t startIP;
+  bool reached;
+  bool matched;
+  uint64_t hash, shadowHash;
+  Registers shadowReg; // at the target arrival
+} NativeVerify;
+
+typedef struct {
+  uint64_t runs;
+  uint64_t bytecodes; // run natively
+  uint64_t verified; // runs that matched the 6502 code
+  NativeVerify* verify; // NULL unless verifying
+} NativeEngine;
+
+static void advanceIP(Emu* m, unsigned n) {
+  unsigned y = Y + n;
+  Y = y;
+  if (y > 0xFF)
+    RAM[RAM_IP + 1]++;
+}
+
+static void gotoIP(Emu* m, word_t ip) {
+  RAM[RAM_IP] = toLo(ip);
+  RAM[RAM_IP + 1] = toHi(ip);
+  Y = 0;
+}
+
+// An ADC in a handler, of a and operand with the given carry. The handler
+// leaves its C and V in P; N and Z don't last past the dispatch loop.
+static byte_t handlerADC(Emu* m, byte_t a, byte_t operand, bool carry) {
+  Registers r = { .a = a, .p = (m->reg.p & ~FLAG_C) | (carry ? FLAG_C : 0) };
+  aluADC(&r, operand);
+  m->reg.p = r.p;
+  return r.a;
+}
+
+// Whether the bytecode at the IP runs natively.
+static bool nativeAt(Emu* m) {
+  byte_t bytecode = load(m, toWord(RAM[RAM_IP], RAM[RAM_IP + 1]) + Y);
+  return bytecode < INSTRUCTION_COUNT && BYTECODES[bytecode].native;
+}
+
+// Run bytecodes from the IP until one that needs the 6502 code, stopping
+// early for the next timed event. Returns how many ran.
+static uint64_t runBytecodes(Emu* m) {
+  uint64_t count = 0;
+  while (m->reg.ic + BYTECODE_INSTRUCTIONS < m->nextEventIC) {
+    if (!nativeAt(m))
+      break;
+    word_t ip = toWord(RAM[RAM_IP], RAM[RAM_IP + 1]) + Y;
+    byte_t bytecode = load(m, ip);
+    byte_t b = 0;
+    word_t w = 0;
+    switch (BYTECODES[bytecode].operand) {
+      case OPERAND_BYTE:
+        b = load(m, ip + 1) ^ BYTE_OPERAND_KEY;
+        advanceIP(m, 2);
+        break;
+      case OPERAND_WORD:
+        RAM[RAM_WORD_OPERAND] = load(m, ip + 1) ^ WORD_OPERAND_KEY_LO;
+        RAM[RAM_WORD_OPERAND + 1] = load(m, ip + 2) ^ WORD_OPERAND_KEY_HI;
+        w = toWord(RAM[RAM_WORD_OPERAND], RAM[RAM_WORD_OPERAND + 1]);
+        advanceIP(m, 3);
+        break;
+      default:
+        advanceIP(m, 1);
+        break;
+    }
+    byte_t* a = &RAM[RAM_VM_A];
+    X = bytecode; // the dispatch loop indexes the handler table with it
+    switch (bytecode) {
+      case 0x00: // GOTO
+        gotoIP(m, w);
+        break;
+      case 0x01: // AND
+        *a &= b;
+        break;
+      case 0x04: // LDA imm
+        *a = b;
+        break;
+      case 0x05: // LDA var
+        X = 0;
+        *a = load(m, w);
+        break;
+      case 0x06: // GOTOZ
+        if (*a == 0)
+          gotoIP(m, w);
+        break;
+      case 0x07: // STA
+        X = 0;
+        store(m, *a, w);
+        break;
+      case 0x08: // SUB imm: EOR #$FF, SEC, ADC A
+        *a = handlerADC(m, ~b, *a, true);
+        break;
+      case 0x0B: // ARR
+        *a = load(m, w + *a);
+        break;
+      case 0x0C: // ASL
+        setFlag(m, FLAG_C, *a & 0x80);
+        *a <<= 1;
+        break;
+      case 0x0D: // INC: CLC, ADC #1
+        X = 0;
+        *a = store(m, handlerADC(m, load(m, w), 1, false), w);
+        break;
+      case 0x0E: // ADD: CLC, ADC A
+        X = 0;
+        *a = handlerADC(m, load(m, w), *a, false);
+        break;
+      case 0x0F: { // XOR_pC_A
+        // The first increment of C doesn't carry into the high byte.
+        byte_t* c = &RAM[RAM_VM_C];
+        word_t addr = toWord(c[0], c[1]);
+        store(m, load(m, addr) ^ *a, addr);
+        c[0]++;
+        addr = toWord(c[0], c[1]);
+        store(m, load(m, addr) ^ *a, addr);
+        if (++c[0] == 0)
+          c[1]++;
+        *a = c[1] ^ 0x7F;
+        break;
+      }
+      case 0x10: // GOTONZ
+        if (*a != 0)
+          gotoIP(m, w);
+        break;
+      case 0x11: // SUB var: EOR #$FF, SEC, ADC A
+        X = 0;
+        *a = handlerADC(m, ~load(m, w), *a, true);
+        break;
+      case 0x12: // GOTOGE
+        if (!(*a & 0x80))
+          gotoIP(m, w);
+        break;
+      case 0x13: // LDXY
+        store(m, toLo(w), RAM_VM_X);
+        store(m, toHi(w), RAM_VM_Y);
+        break;
+    }
+    RAM[RAM_JUMP_DEST] = toLo(BYTECODES[bytecode].handler);
+    RAM[RAM_JUMP_DEST + 1] = toHi(BYTECODES[bytecode].handler);
+    m->reg.ic += BYTECODE_INSTRUCTIONS;
+    m->reg.cycles += BYTECODE_CYCLES;
+    count++;
+  }
+  // The VM's registers and IP are written directly.
+  if (count)
+    m->memWrites++;
+  // Back at the dispatch loop, with the next bytecode read into A.
+  A = load(m, toWord(RAM[RAM_IP], RAM[RAM_IP + 1]) + Y);
+  setFlag(m, FLAG_Z, A == 0);
+  setFlag(m, FLAG_N, A & 0x80);
+  return count;
+}
+
+// FNV-1a over RAM, leaving out the stack below S: the 6502 code's JSRs
+// leave return addresses there.
+static uint64_t ramHash(Emu* m) {
+  uint64_t hash = 0xCBF29CE484222325;
+  for (unsigned addr=0; addr < RAM_SIZE; addr++) {
+    if (addr == 0x100)
+      addr += m->reg.s + 1;
+    hash = (hash ^ RAM[addr]) * 0x100000001B3;
+  }
+  return hash;
+}
+
+// Bytecodes can store to I/O, which isn't in the RAM hash.
+static bool sameChips(Emu* m, Emu* shadow) {
+  for (int n=0; n < CIA_COUNT; n++) {
+    const Cia* a = &m->cias[n];
+    const Cia* b = &shadow->cias[n];
+    if (memcmp(a->regs, b->regs, sizeof(a->regs)) || a->flags != b->flags
+        || a->mask != b->mask)
+      return false;
+  }
+  return !memcmp(m->vic, shadow->vic, sizeof(m->vic))
+      && !memcmp(m->sid, shadow->sid, sizeof(m->sid))
+      && !memcmp(m->colorRam, shadow->colorRam, sizeof(m->colorRam));
+}
+
+// At each arrival of the shadow at the dispatch loop. At the target one,
+// the shadow has run the bytecodes that ran natively.
+static void verifyHook(Emu* shadow, int pc, ExecutionHook* hook) {
+  NativeVerify* v = hook->privateData;
+  if (v->arrivals++ < v->target)
+    return;
+  Emu* m = v->m;
+  v->reached = true;
+  v->hash = ramHash(m);
+  v->shadowHash = ramHash(shadow);
+  v->shadowReg = shadow->reg;
+  // The shadow's I flag was set to keep interrupts out.
+  v->matched = v->hash == v->shadowHash && sameChips(m, shadow)
+      && m->reg.a == shadow->reg.a && m->reg.x == shadow->reg.x
+      && m->reg.y == shadow->reg.y && m->reg.s == shadow->reg.s
+      && !((m->reg.p ^ shadow->reg.p) & ~FLAG_I);
+  shadow->icLimit = shadow->reg.ic;
+  shadow->nextEventIC = shadow->reg.ic;
+}
+
+// Start the shadow off where the native engine starts.
+static void verifyStart(NativeVerify* v) {
+  Emu* m = v->m;
+  Emu* shadow = v->shadow;
+  memcpy(shadow->ram, m->ram, RAM_SIZE);
+  memcpy(shadow->cias, m->cias, sizeof(m->cias));
+  memcpy(shadow->vic, m->vic, sizeof(m->vic));
+  memcpy(shadow->sid, m->sid, sizeof(m->sid));
+  memcpy(shadow->colorRam, m->colorRam, sizeof(m->colorRam));
+  shadow->sidNoise = m->sidNoise;
+  shadow->irq = m->irq;
+  shadow->nmi = m->nmi;
+  shadow->reg = m->reg;
+  shadow->reg.pc = INTERP_BYTECODE_POSTREAD;
+  shadow->reg.ic--; // the hook runs after the IC counts the instruction
+  shadow->reg.p |= FLAG_I;
+  v->startIP = toWord(m->ram[RAM_IP], m->ram[RAM_IP + 1]) + m->reg.y;
+}
+
+// Run the shadow through the same bytecodes and fault if it doesn't end up
+// the same.
+static void verifyRun(NativeVerify* v, uint64_t bytecodes) {
+  Emu* m = v->m;
+  Emu* shadow = v->shadow;
+  v->arrivals = 0;
+  v->target = bytecodes;
+  v->reached = false;
+  shadow->icLimit = shadow->reg.ic + (bytecodes + 1) * VERIFY_BYTECODE_INSTRUCTIONS;
+  int faultCode = interp(shadow);
+  if (faultCode != FAULT_NONE)
+    error(m, "ACS bytecode verify: 6502 code faulted: %s", shadow->fault.message);
+  if (!v->reached)
+    error(m, "ACS bytecode verify: 6502 code didn't get back to $%04X after %" PRIu64
+        " bytecodes", INTERP_BYTECODE_POSTREAD, bytecodes);
+  if (!v->matched)
+    error(m, "ACS bytecode verify: %" PRIu64 " bytecodes from $%04X differ:"
+        " RAM hash %016" PRIx64 "/%016" PRIx64 ", A=%02X/%02X, X=%02X/%02X,"
+        " Y=%02X/%02X, S=%02X/%02X, P=%02X/%02X",
+        bytecodes, v->startIP, v->hash, v->shadowHash, m->reg.a, v->shadowReg.a,
+        m->reg.x, v->shadowReg.x, m->reg.y, v->shadowReg.y, m->reg.s, v->shadowReg.s,
+        m->reg.p, v->shadowReg.p);
+}
+
+static void nativeHook(Emu* m, int pc, ExecutionHook* hook) {
+  NativeEngine* engine = hook->privateData;
+  if (!nativeAt(m))
+    return;
+  if (engine->verify)
+    verifyStart(engine->verify);
+  uint64_t count = runBytecodes(m);
+  if (count == 0)
+    return;
+  engine->runs++;
+  engine->bytecodes += count;
+  if (engine->verify) {
+    verifyRun(engine->verify, count);
+    engine->verified++;
+  }
+}
+
+static void reportNative(int exitCode, void* data) {
+  NativeEngine* engine = data;
+  printf("ACS bytecodes: %" PRIu64 " run natively in %" PRIu64 " runs", engine->bytecodes,
+      engine->runs);
+  if (engine->verify)
+    printf(", %" PRIu64 " verified", engine->verified);
+  printf("\n");
+}
+
+static void destroyEngine(NativeEngine* engine) {
+  if (engine->verify && engine->verify->shadow)
+    destroyEmulator(engine->verify->shadow);
+  free(engine->verify);
+  free(engine);
+}
+
+// Run the loader's bytecodes natively. With verify, each run is checked
+// against running the same bytecodes on the 6502 code, in a shadow
+// emulator, and a difference is a fault.
+bool ecaLoaderEnableNative(Emu* m, bool verify) {
+  NativeEngine* engine = calloc(1, sizeof(NativeEngine));
+  if (!engine) {
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory for the bytecode engine.");
+    return false;
+  }
+  if (verify) {
+    engine->verify = calloc(1, sizeof(NativeVerify));
+    if (engine->verify)
+      engine->verify->shadow = createEmulator(NULL);
+    if (!engine->verify || !engine->verify->shadow) {
+      destroyEngine(engine);
+      setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory for the bytecode engine.");
+      return false;
+    }
+    engine->verify->m = m;
+    ExecutionHook hook = {
+      .pcHookAddress = INTERP_BYTECODE_POSTREAD,
+      .hookType = HOOKTYPE_EXEC,
+      .name = "ACS bytecode verify",
+      .callback = verifyHook,
+      .privateData = engine->verify,
+    };
+    if (!registerHook(engine->verify->shadow, &hook)) {
+      setFault(m, FAULT_HOOK, "%s", engine->verify->shadow->fault.message);
+      destroyEngine(engine);
+      return false;
+    }
+  }
+  ExecutionHook hook = {
+    .pcHookAddress = INTERP_BYTECODE_POSTREAD,
+    .hookType = HOOKTYPE_EXEC,
+    .name = "ACS bytecode engine",
+    .callback = nativeHook,
+    .privateData = engine,
+  };
+  if (!registerHook(m, &hook)) {
+    destroyEngine(engine);
+    return false;
+  }
+  on_exit(reportNative, engine);
+  return true;
+}
@@ -1,8 +1,10 @@
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <setjmp.h>
 
 // 64K
 #define RAM_SIZE 0x10000
@@ -10,6 +12,7 @@
 // Constants related to the disk drive
 #define SECTOR_SIZE 256
 #define DISKDRIVE_BUFFER_COUNT 4
+#define DISKDRIVE_STATUS_SIZE 40
 #define DISKDRIVE_COMMAND_BUFFER_SIZE 0x2A
 
 // Limit number of instructions executed when logging, so that we don't
@@ -23,14 +26,17 @@ typedef uint16_t word_t;
 #define IC_FMT "%09" PRIX64
 #define EXPECTED_IC_SIZE 8
 
+// The counts come first so that they're naturally aligned and the byte
+// registers pack together after them without padding.
 typedef struct {
+  uint64_t ic; // instruction count
+  uint64_t cycles; // clock cycles, from the instruction table
+  word_t pc; // program counter
+  word_t s;  // stack pointer
   byte_t a;   // A
   byte_t x;   // X
   byte_t y;   // Y
   byte_t p;   // flags register
-  word_t s;  // stack pointer
-  word_t pc; // program counter
-  uint64_t ic; // instruction count
 } Registers;
 
 enum {
@@ -48,8 +54,23 @@ typedef struct {
   unsigned cap;
   unsigned len;
   byte_t* data;
+  bool mapped; // data is a read-only file mapping (see mapFile)
+  int fd; // file that data is mapped from, or -1
 } buf_t;
 
+// Drives on the serial bus have consecutive device numbers from 8.
+#define DISKDRIVE_FIRST_DEVICE 8
+#define DISKDRIVE_COUNT 4
+#define IS_DISK_DEVICE(device) \
+  ((device) >= DISKDRIVE_FIRST_DEVICE && (device) < DISKDRIVE_FIRST_DEVICE + DISKDRIVE_COUNT)
+
+// Serial bus lines, as bits that are set while a line is pulled low.
+enum { IEC_ATN = 1 << 0, IEC_CLK = 1 << 1, IEC_DATA = 1 << 2 };
+
+// The 1541 CPU, when it's emulated (see emdrive.c).
+#define DRIVE_ROM_SIZE 0x4000 // $C000-$FFFF
+typedef struct DriveCPU_struct DriveCPU;
+
 #define DISKDRIVE_COMMSTATE_TALKING   (1 << 0)
 #define DISKDRIVE_COMMSTATE_LISTENING (1 << 1)
 
@@ -77,22 +98,240 @@ typedef struct {
 700-7FF: BAM buffer
 */
 
+#define DISK_FILENAME_LEN 16
+
+#define DIRENTRY_FLAG_LOCKED 0x40
+#define DIRENTRY_FLAG_CLOSED 0x80
+
+enum {
+  FILETYPE_DEL = 0,
+  FILETYPE_SEQ,
+  FILETYPE_PRG,
+  FILETYPE_USR,
+  FILETYPE_REL,
+  FILETYPE_COUNT,
+};
+
+extern const char* FILETYPE_NAMES[];
+
+// Result of following a sector chain (a file or the directory).
+enum {
+  DISK_CHAIN_OK = 0,
+  DISK_CHAIN_BAD_LINK,    // links to a track/sector that isn't on the disk
+  DISK_CHAIN_LOOP,        // links back to one of its own sectors
+  DISK_CHAIN_CROSSLINKED, // runs into a sector that belongs to another file
+};
+
+extern const char* DISK_CHAIN_STATUS_NAMES[];
+
+// Values in DiskIndex.sectorOwner for sectors that don't belong to a file.
+#define DISK_SECTOR_UNUSED (-1)
+#define DISK_SECTOR_DIRECTORY (-2)
+
+typedef struct trackinfo_s {
+  unsigned trackNumber;
+  unsigned sectorCount;
+  unsigned offsetInSectors;
+  unsigned offsetInBytes;
+} trackinfo_t;
+
+// How the BAM (block availability map) is laid out.
+enum {
+  DISK_BAM_1541, // 18/0
+  DISK_BAM_1571, // 18/0 for side 1, 18/0 and 53/0 for side 2
+  DISK_BAM_1581, // 40/1 and 40/2
+};
+
+// Geometry and layout of a disk image format.
+typedef struct {
+  const char* name;
+  unsigned trackCount;
+  unsigned sectorCount;
+  const trackinfo_t* tracks; // indexed by track number, from 1
+  byte_t dirTrack;     // directory track, which also holds the BAM
+  byte_t dirSector;    // first directory sector
+  byte_t bamKind;      // DISK_BAM_*
+  byte_t fileInterleave;
+  byte_t dirInterleave;
+} DiskFormat;
+
+enum {
+  DISK_FORMAT_D64,
+  DISK_FORMAT_D64_40, // 40 tracks
+  DISK_FORMAT_D71,
+  DISK_FORMAT_D81,
+  DISK_FORMAT_COUNT,
+};
+
+extern const DiskFormat DISK_FORMATS[];
+
+// Sectors are identified by their linear number, i.e. their offset in the
+// image divided by SECTOR_SIZE.
+typedef struct {
+  byte_t filetypeID;  // FILETYPE_*
+  byte_t flags;       // DIRENTRY_FLAG_*
+  byte_t startTrack;
+  byte_t startSector;
+  word_t fileSizeInSectors; // block count stored in the directory entry
+  byte_t relSideTrack;
+  byte_t relSideSector;
+  byte_t relRecordLen;
+  byte_t chainStatus; // DISK_CHAIN_*
+  byte_t name[DISK_FILENAME_LEN]; // raw PETSCII, padded with $A0
+  char filename[DISK_FILENAME_LEN+1]; // padding removed, null terminated
+  word_t dirSector;   // directory sector holding the entry
+  byte_t dirEntry;    // entry number within that sector (0-7)
+  unsigned chainStart;  // first sector of the file in DiskIndex.chains
+  unsigned chainLength; // number of sectors in the chain
+  unsigned byteLength;  // number of data bytes in the file
+} DiskFileEntry;
+
+// Everything in a disk image's directory, resolved once when it's mounted so
+// that lookups don't have to walk the disk. The chains of all files are
+// stored back to back in one array; each sector can belong to at most one
+// file so the array never needs more entries than there are sectors.
+typedef struct {
+  const DiskFormat* format;
+  unsigned sectorCount;
+  bool hasErrorBytes; // the image ends with an error code for each sector
+  unsigned fileCount;
+  DiskFileEntry* files;
+  word_t* chains;
+  int16_t* sectorOwner; // file index for each sector, or DISK_SECTOR_*
+  byte_t directoryStatus; // DISK_CHAIN_*
+} DiskIndex;
+
+// How writes to a mounted disk image are handled.
+enum {
+  DISK_WRITE_PROTECTED = 0, // writing is an error
+  DISK_WRITE_DISCARD,       // changes are kept in memory and thrown away
+  DISK_WRITE_ON_CLOSE,      // changed sectors are written to the file on CLOSE
+  DISK_WRITE_AT_EXIT,       // the file is replaced in one step on unmount
+  DISK_WRITE_MODE_COUNT,
+};
+
+extern const char* DISK_WRITE_MODE_NAMES[];
+
+// A file being written on a channel. The data is collected here and put on
+// the disk in one go when the channel is closed.
+typedef struct {
+  buf_t* data;
+  byte_t name[DISK_FILENAME_LEN];
+  byte_t nameLen;
+  byte_t filetypeID;
+  bool replace; // "@:" prefix: replace the file if it exists
+  bool append;  // ",A" mode: add to the end of an existing file
+} DiskWriteFile;
+
+// A mounted G64 image. Its tracks are decoded into a D64 image (with an error
+// table) when they're first read.
+#define G64_MAX_TRACK 40 // tracks 41 and 42 have no place in a D64
+typedef struct {
+  const buf_t* file;
+  unsigned halfTrackCount;
+  const DiskFormat* format; // of the decoded image
+  buf_t* image;
+  bool decoded[G64_MAX_TRACK+1]; // by track number
+} G64Image;
+
+// What makes a drive swap in the next disk from its list.
+enum {
+  DISK_SWAP_AT_PC,      // execution reaches an address
+  DISK_SWAP_AT_IC,      // the instruction count reaches a value
+  DISK_SWAP_ON_MISSING, // a file or sector isn't on the disk (or there's no disk)
+  DISK_SWAP_TRIGGER_COUNT,
+};
+
+extern const char* DISK_SWAP_TRIGGER_NAMES[];
+
+typedef struct {
+  int trigger;    // DISK_SWAP_*
+  uint64_t value; // the PC or IC to swap at
+  const char* path;
+  buf_t* data;
+} DiskSwap;
+
+// Marks a drive buffer that isn't assigned to a channel.
+#define DISK_CHANNEL_NONE 0xFF
+// Values in DiskDrive.diskBufferFiles for buffers not reading a file.
+#define DISK_FILE_NONE (-1)
+#define DISK_FILE_NOT_FOUND (-2)
+
 typedef struct {
   const char* mountedImagePath; // path to d64 file
   const buf_t* mountedImageData; // contents of d64 file
+  DiskIndex* index; // built when the image is mounted
+  G64Image* g64; // set if the image is a G64
+  unsigned mountCount; // disks mounted so far, the current one's number
+  // Disks to swap in, in order, and the next one to swap in.
+  DiskSwap* swaps;
+  unsigned swapCount;
+  unsigned nextSwap;
+  // Writable mounts work on a private copy of the image, and flag the
+  // sectors that have changed since they were last written back.
+  int writeMode; // DISK_WRITE_*
+  buf_t* writableImage;
+  byte_t* dirtySectors;
+  unsigned dirtyCount;
   // Command buffer
   byte_t commandBuffer[DISKDRIVE_COMMAND_BUFFER_SIZE+1]; // extra space for null term
   byte_t commandBufferPointer;
   byte_t commandRecv;
+  // The error channel: the status read from channel 15 after a drive error.
+  // Empty when there's nothing to report, and read once.
+  char status[DISKDRIVE_STATUS_SIZE];
+  byte_t statusLen;
+  byte_t statusPos;
   // The 1541 drive has 4 buffers.
   byte_t diskBuffers[DISKDRIVE_BUFFER_COUNT][SECTOR_SIZE];
   byte_t diskBufferPointers[DISKDRIVE_BUFFER_COUNT];
   byte_t diskBufferChannels[DISKDRIVE_BUFFER_COUNT];
+  // Buffers of files opened by name: the file's index and the position of
+  // the buffered sector in its chain.
+  int16_t diskBufferFiles[DISKDRIVE_BUFFER_COUNT];
+  word_t diskBufferChainPos[DISKDRIVE_BUFFER_COUNT];
+  byte_t diskBufferDataEnd[DISKDRIVE_BUFFER_COUNT]; // last data byte
+  // Linear sector last read into each buffer by U1 or B-R, or -1.
+  int16_t diskBufferSectors[DISKDRIVE_BUFFER_COUNT];
+  DiskWriteFile* diskBufferWrites[DISKDRIVE_BUFFER_COUNT]; // NULL if not writing
   // Serial comm state
   unsigned commState;
   unsigned secondAddress;
+  DriveCPU* cpu; // NULL unless the drive runs drive code
 } DiskDrive;
 
+// What read a sector, in the disk activity log.
+enum {
+  DISK_ACCESS_U1,
+  DISK_ACCESS_BLOCK_READ, // B-R
+  DISK_ACCESS_LOAD,
+  DISK_ACCESS_CHANNEL,    // bytes read from a channel (ACPTR)
+  DISK_ACCESS_KIND_COUNT,
+};
+
+extern const char* DISK_ACCESS_KIND_NAMES[];
+
+// Marks a disk access that didn't go through a drive buffer.
+#define DISK_BUFFER_NONE 0xFF
+
+typedef struct {
+  uint64_t ic;
+  word_t pc;      // where the KERNAL call returns to
+  byte_t device;
+  byte_t kind;    // DISK_ACCESS_*
+  byte_t track;
+  byte_t sector;
+  byte_t buffer;  // or DISK_BUFFER_NONE
+  word_t bytes;   // bytes of the sector that were read
+  unsigned mount; // the drive's mountCount, telling swapped disks apart
+} DiskAccess;
+
+typedef struct {
+  DiskAccess* records;
+  unsigned count;
+  unsigned cap;
+} DiskLog;
+
 
 struct Emu_struct;
 struct ExecutionHook_struct;
@@ -137,16 +376,222 @@ typedef struct {
   byte_t kernal[0x2000];
 } RomC64;
 
+// ROM images built into the executable (see romc64.c).
+extern const RomC64 ROM_C64_BUILTIN;
+
+// Emulation faults. An error while emulating stops the emulator and is
+// reported to the caller of interp() as one of these, instead of exiting, so
+// one bad job doesn't take down other emulators in the same process.
+enum {
+  FAULT_NONE = 0,
+  FAULT_ERROR,                // general emulation error
+  FAULT_ILLEGAL_INSTRUCTION,
+  FAULT_STACK,                // stack overflow or underflow
+  FAULT_UNSUPPORTED,          // something the emulator doesn't implement
+  FAULT_DISK,                 // disk drive command or disk image error
+  FAULT_HOOK,                 // invalid execution hook
+  FAULT_OUT_OF_MEMORY,
+  FAULT_COUNT
+};
+
+#define FAULT_MESSAGE_SIZE 256
+
+typedef struct {
+  int code;       // FAULT_* value
+  word_t pc;      // PC when the fault happened
+  uint64_t ic;    // instruction count when the fault happened
+  char message[FAULT_MESSAGE_SIZE];
+} EmuFault;
+
+extern const char* FAULT_NAMES[];
+
+#define CACHE_LINE_SIZE 64
+
+// Keyboard input script (see emkeys.c). Its keys are typed in steps, each
+// waiting for its trigger and for the steps before it.
+enum { KEY_STEP_NOW, KEY_STEP_AT_IC, KEY_STEP_AT_PC };
+
+typedef struct {
+  int trigger;    // KEY_STEP_*
+  uint64_t value; // the IC or PC to type the keys at
+  unsigned end;   // this step types the keys before here
+} KeyStep;
+
+#define KEY_LINE_MAX 88 // longest line BASIN reads from the keyboard
+
+typedef struct {
+  byte_t* keys; // PETSCII
+  unsigned keyCount;
+  KeyStep* steps;
+  unsigned stepCount;
+  unsigned nextStep;
+  unsigned typed;    // keys that their steps have typed
+  unsigned buffered; // keys moved into the keyboard buffer
+  // The line BASIN is returning, and the position in it, or -1.
+  byte_t line[KEY_LINE_MAX];
+  unsigned lineLen;
+  int linePos;
+  unsigned generation; // m->keyScriptCount when set, in its hooks' data
+} KeyScript;
+
+// The I/O area at $D000-$DFFF, a page at a time (see emio.c).
+#define IO_PAGE_COUNT 16
+
+typedef byte_t IoReadHandler(struct Emu_struct* m, word_t addr);
+typedef void IoWriteHandler(struct Emu_struct* m, word_t addr, byte_t value);
+
+typedef struct {
+  IoReadHandler* read;
+  IoWriteHandler* write;
+} IoPage;
+
+extern const IoPage IO_PAGES[IO_PAGE_COUNT];
+
+// Whether the banking bits (in RAM[1]) map I/O in at $D000-$DFFF.
+static inline bool ioVisible(byte_t banks) {
+  return (banks & 0b100) && (banks & 0b011);
+}
+
+// VIC and SID registers, and color RAM. They're kept in Emu, not in the RAM
+// under the I/O area.
+#define VIC_BASE 0xD000
+#define VIC_REGISTER_COUNT 0x2F
+#define SID_REGISTER_COUNT 0x19 // the ones below the paddles, all write only
+#define COLOR_RAM 0xD800
+#define COLOR_RAM_SIZE 0x400 // a nybble each
+
+enum {
+  VIC_CONTROL1 = 0x11, // bit 7 is bit 8 of the raster line
+  VIC_RASTER = 0x12,
+  VIC_CONTROL2 = 0x16,
+  VIC_MEMORY = 0x18, // bit 1 selects the lower case characters
+  VIC_IRQ_FLAGS = 0x19,
+  VIC_IRQ_MASK = 0x1A,
+  VIC_SPRITE_SPRITE = 0x1E, // collisions, cleared by reading
+  VIC_SPRITE_DATA = 0x1F,
+  VIC_BORDER = 0x20, // this and the rest are colors
+};
+
+// CIA timers (see emcia.c).
+#define CIA_COUNT 2
+#define CIA_REGISTER_COUNT 16
+
+typedef struct {
+  word_t latch;
+  word_t counter; // when stopped or counting timer A underflows
+  byte_t control; // CRA or CRB
+  uint64_t underflowCycle; // when running, or UINT64_MAX
+} CiaTimer;
+
+typedef struct {
+  CiaTimer timers[2]; // A and B
+  byte_t flags; // interrupt flags, cleared by reading the ICR
+  byte_t mask;  // enabled interrupts
+  bool nmiAsserted; // CIA 2 is pulling the NMI line
+  byte_t regs[CIA_REGISTER_COUNT]; // as written, for the ones that read back
+} Cia;
+
+#define CIA1_BASE 0xDC00
+#define CIA2_BASE 0xDD00
+
+// Registers, at the CIA's base address plus these, repeated every 16 bytes.
+enum {
+  CIA_PRA = 0x00,
+  CIA_PRB = 0x01,
+  CIA_DDRA = 0x02,
+  CIA_DDRB = 0x03,
+  CIA_TALO = 0x04,
+  CIA_TAHI = 0x05,
+  CIA_TBLO = 0x06,
+  CIA_TBHI = 0x07,
+  CIA_ICR = 0x0D,
+  CIA_CRA = 0x0E,
+  CIA_CRB = 0x0F,
+};
+
+// Control register bits
+#define CIA_CR_START 0x01
+#define CIA_CR_ONE_SHOT 0x08
+#define CIA_CR_LOAD 0x10 // strobe, reads as 0
+
+// Sources pulling the IRQ line
+#define IRQ_CIA1 0x01
+
+// The last backward jump, for finding loops that wait for an event (see
+// idleLoopCheck).
+#define IDLE_LOOP_MAX_BYTES 32
+
+typedef struct {
+  word_t from; // address after the instruction that jumped back
+  word_t to;
+  Registers reg; // at the start of the last pass
+  unsigned memWrites;
+  uint64_t skipped; // instructions skipped by fast-forwarding idle loops
+} IdleLoop;
+
+// Emulated ROM routines. A JSR or JMP to an address in romTrapIndex calls
+// the handler for it in ROM_TRAPS instead of running code.
+#define ROM_TRAP_MAX 64
+enum { ROM_TRAP_NONE, ROM_TRAP_UNSUPPORTED };
+
+typedef void RomTrapHandler(struct Emu_struct* m, word_t callAddr);
+
+typedef struct {
+  word_t addr;
+  const char* name;
+  RomTrapHandler* handler;
+} RomTrap;
+
+extern const RomTrap ROM_TRAPS[];
+extern byte_t romTrapIndex[RAM_SIZE]; // ROM_TRAPS index, or ROM_TRAP_NONE
+
+// The memory map an emulator's CPU sees.
+enum { MACHINE_C64, MACHINE_1541 };
+
 typedef struct Emu_struct {
-  FILE* traceFile;
+  // Hot state: everything the interpreter touches on every instruction. It
+  // fits in the first cache line of the struct, which is cache line aligned.
   Registers reg;
-  byte_t ram[RAM_SIZE];
-  RomC64 rom;
-  DiskDrive diskdrive;
+  // The loop stops to check for the IC limit and timed events when the
+  // instruction count gets here (see scheduleNextEvent).
+  uint64_t nextEventIC;
+  byte_t* ram; // RAM_SIZE bytes
+  byte_t* execHookMap; // a bit for each address with exec hooks, or NULL
+  FILE* traceFile;
+  unsigned memWrites; // counts stores and ROM calls that change memory
+  byte_t machine; // MACHINE_*
+  // Cold state: only used by ROM calls, disk I/O and hook setup.
+  const RomC64* rom; // shared by all instances, never written
+  uint64_t icLimit; // interp() returns when the instruction count gets here
+  uint64_t cycleLimit; // or when the cycle count gets here
+  bool ramMapped; // ram is a copy-on-write mapping (see loadRAMCopyOnWrite)
+  DiskDrive* diskdrives[DISKDRIVE_COUNT]; // devices 8-11
+  DiskDrive* diskdrive; // the drive addressed by the last disk call
   ExecutionHooks hooks;
   int romCallEmbeddingLevel;
   int serialBusActiveAddress;
-} Emu;
+  _Atomic byte_t iecOut; // serial bus lines the C64 pulls low (IEC_*)
+  uint64_t driveSyncIC; // when running drive CPUs next sync with this one
+  DriveCPU* driveCPU; // for MACHINE_1541, the drive this is the CPU of
+  DiskLog* diskLog; // NULL unless disk activity is being logged
+  uint64_t romTrapCalls[ROM_TRAP_MAX]; // calls of each ROM trap
+  FILE* screenLog; // gets the text printed on the screen, or NULL
+  KeyScript* keys; // NULL without an input script
+  unsigned keyScriptCount; // scripts set so far, numbering their hooks
+  IdleLoop idle;
+  Cia cias[CIA_COUNT]; // at $DC00 and $DD00
+  byte_t irq; // IRQ_* sources pulling the IRQ line
+  bool nmi; // an NMI is waiting to be taken
+  uint32_t sidNoise; // the SID's noise LFSR
+  byte_t vic[VIC_REGISTER_COUNT];
+  byte_t sid[SID_REGISTER_COUNT];
+  byte_t colorRam[COLOR_RAM_SIZE];
+  EmuFault fault; // last fault, code is FAULT_NONE if there wasn't one
+  jmp_buf* faultJump; // where fault() unwinds to while interp() is running
+} __attribute__((aligned(CACHE_LINE_SIZE))) Emu;
+
+_Static_assert(offsetof(Emu, machine) + sizeof(byte_t) <= CACHE_LINE_SIZE,
+    "Hot emulator state doesn't fit in a cache line.");
 
 #define emu_t Emu
 
@@ -201,42 +646,120 @@ typedef struct {
 
 extern AddrModeInfo addrModeInfo[];
 
+// Generated from instset.tbl by codegen.
 typedef struct instruction_s {
   byte_t instruction;
   byte_t addressingMode;
+  byte_t cycles; // without the extra cycles for pages and branches
+  byte_t pageCycles; // added when indexing crosses a page
 } instruction_t;
 
-typedef struct trackinfo_s {
-  unsigned trackNumber;
-  unsigned sectorCount;
-  unsigned offsetInSectors;
-  unsigned offsetInBytes;
-} trackinfo_t;
+#define MAX_INSTRUCTION_CYCLES 7
+#define C64_PAL_CLOCK_HZ 985248
+#define INTERRUPT_CYCLES 7
+
+// Decimal mode ADC and SBC, indexed by operation, carry, A and the operand
+// (see alu.c). Each entry is the result in the low byte and ALU_FLAGS in the
+// high byte.
+enum { ALU_ADD_DECIMAL, ALU_SUB_DECIMAL, ALU_OP_COUNT };
+#define ALU_FLAGS (FLAG_N | FLAG_V | FLAG_Z | FLAG_C)
+extern const word_t ALU_TABLE[ALU_OP_COUNT][2][256][256];
+
+static inline void aluDecimal(Registers* r, unsigned op, byte_t operand) {
+  word_t result = ALU_TABLE[op][r->p & FLAG_C][r->a][operand];
+  r->a = result;
+  r->p = (r->p & ~ALU_FLAGS) | (result >> 8 & ALU_FLAGS);
+}
+
+// Binary ADC, and SBC with the operand inverted. It's worked out, since
+// that's quicker than the table, which is only for decimal mode.
+static inline void aluAdd(Registers* r, byte_t operand) {
+  unsigned sum = r->a + operand + (r->p & FLAG_C);
+  byte_t b = sum;
+  bool overflow = (r->a ^ b) & (operand ^ b) & 0x80;
+  r->p = (r->p & ~ALU_FLAGS) | (b & FLAG_N) | (b ? 0 : FLAG_Z) | (sum >> 8)
+      | (overflow ? FLAG_V : 0);
+  r->a = b;
+}
+
+static inline void aluADC(Registers* r, byte_t operand) {
+  if (r->p & FLAG_D)
+    aluDecimal(r, ALU_ADD_DECIMAL, operand);
+  else
+    aluAdd(r, operand);
+}
+
+static inline void aluSBC(Registers* r, byte_t operand) {
+  if (r->p & FLAG_D)
+    aluDecimal(r, ALU_SUB_DECIMAL, operand);
+  else
+    aluAdd(r, ~operand);
+}
+
+// CMP, CPX and CPY: binary SBC with the carry set, only setting N, Z and C.
+static inline void aluCompare(Registers* r, byte_t regVal, byte_t operand) {
+  unsigned diff = regVal + (byte_t)~operand + 1;
+  byte_t b = diff;
+  r->p = (r->p & ~(FLAG_N | FLAG_Z | FLAG_C)) | (b & FLAG_N) | (b ? 0 : FLAG_Z)
+      | (diff >> 8);
+}
 
 extern const char* instructionMnemonics[];
 extern const char* addressModeNames[];
 extern instruction_t instructionSet[0x100];
 extern const char* c64RomErrors[];
 extern trackinfo_t TRACK_INFO[];
+extern trackinfo_t D71_TRACK_INFO[];
+extern trackinfo_t D81_TRACK_INFO[];
 
 // Public interface to the emulator
-Emu* createEmulator(FILE* traceFile);
-void registerHook(Emu* m, ExecutionHook* hook);
-void loadRegisters(Emu* m, buf_t* regFile);
-void loadROM(const char* path, byte_t* loadBuf, size_t size);
-void loadRAM(Emu* m, buf_t* ramFile);
-void mountDisk(Emu* m, const char* path, buf_t* diskData);
-word_t loadPRG(Emu* m, buf_t* prgFile);
-void interp(Emu* m);
+// Functions returning bool return false on failure, and the functions taking
+// an Emu record the reason in m->fault.
+Emu* createEmulator(FILE* traceFile); // NULL if out of memory
+void destroyEmulator(Emu* m);
+bool registerHook(Emu* m, ExecutionHook* hook);
+void scheduleNextEvent(Emu* m);
+bool loadRegisters(Emu* m, buf_t* regFile);
+bool loadROM(const char* path, byte_t* loadBuf, size_t size);
+bool loadSharedROM(const char* dir);
+bool loadRAM(Emu* m, const buf_t* ramFile);
+bool loadRAMCopyOnWrite(Emu* m, const buf_t* ramFile);
+bool mountDisk(Emu* m, const char* path, buf_t* diskData); // on device 8
+bool mountDiskWritable(Emu* m, unsigned device, const char* path, buf_t* diskData,
+    int writeMode);
+bool unmountDisk(Emu* m, unsigned device);
+bool addDiskSwap(Emu* m, unsigned device, int trigger, uint64_t value,
+    const char* path, buf_t* data);
+int loadPRG(Emu* m, buf_t* prgFile); // load address, or -1 on failure
+int interp(Emu* m); // FAULT_NONE, or the code of the fault that stopped it
 void ecaLoaderRegisterHooks(Emu* m);
-void dumpRam(Emu* m, const char* path);
+bool ecaLoaderEnableNative(Emu* m, bool verify);
+bool dumpRam(Emu* m, const char* path);
+bool enableDiskLog(Emu* m);
+bool writeDiskLog(Emu* m, const char* path);
+bool writeDiskHeatmap(Emu* m, unsigned device, const char* csvPath, const char* ppmPath);
+bool writeRomCallCounts(Emu* m, const char* path);
+bool writeScreenText(Emu* m, const char* path);
+bool setKeyScript(Emu* m, const char* script, size_t len);
 
 // Emulator internals shared across implementation files.
 
+// Stop emulation with a fault. Unwinds to interp() if it's running,
+// otherwise prints the message and exits.
+void fault(Emu* m, int code, const char* fmt, ...)
+  __attribute__((noreturn, format(printf, 3, 4)))
+;
+
+// Same as fault(m, FAULT_ERROR, ...).
 void error(Emu* m, const char* fmt, ...)
   __attribute__((noreturn, format(printf, 2, 3)))
 ;
 
+// Record a fault without unwinding, for functions that return failure.
+void setFault(Emu* m, int code, const char* fmt, ...)
+  __attribute__((format(printf, 3, 4)))
+;
+
 static inline bool getFlag(Emu* m, byte_t flag) {
   return (m->reg.p & flag);
 }
@@ -248,18 +771,104 @@ static inline void setFlag(Emu* m, byte_t flag, bool set) {
     m->reg.p &= ~flag;
 }
 
+byte_t load(Emu* m, word_t addr); // a CPU read, with banking
+byte_t store(Emu* m, byte_t value, word_t addr); // a CPU write, with banking
+void initRomTraps(void);
 void emulateC64ROM(Emu* m, word_t callAddr);
 void romError(Emu* m, int errorNumber);
-void checkDiskSize(Emu* m, const buf_t* disk);
+bool checkDiskSize(Emu* m, const buf_t* disk);
+void diskReset(DiskDrive* d);
+
+// Disk image index. These don't depend on an emulator so that tools can use
+// them on their own. buildDiskIndex returns NULL if it runs out of memory.
+const DiskFormat* diskFormatForSize(unsigned size, bool* hasErrorBytes);
+DiskIndex* buildDiskIndex(const buf_t* image, const DiskFormat* format);
+void destroyDiskIndex(DiskIndex* index);
+int findDiskFile(const DiskIndex* index, const byte_t* pattern, unsigned patternLen);
+const byte_t* diskSectorData(const buf_t* image, unsigned sector);
+unsigned sectorDataLength(const byte_t* d); // file bytes in a chain sector
+int diskSectorError(const buf_t* image, const DiskIndex* index, unsigned sector);
+bool isG64(const buf_t* file);
+G64Image* openG64(const buf_t* file); // NULL if it isn't a valid G64
+void closeG64(G64Image* g);
+void g64DecodeTrack(G64Image* g, unsigned track);
+void g64DecodeFiles(G64Image* g);
+buf_t* readDiskFile(const buf_t* image, const DiskIndex* index, unsigned fileIndex);
 
 byte_t diskACPTR(Emu* m);
 void diskOPEN(Emu* m);
+void diskLOAD(Emu* m);
+uint64_t diskNextSwapIC(Emu* m);
+void diskRunSwapsAtIC(Emu* m);
+void diskSAVE(Emu* m, word_t start, word_t end);
 void diskLISTEN(Emu* m);
 void diskSECOND(Emu* m, byte_t second);
 void diskCIOUT(Emu* m, byte_t data);
+unsigned diskACPTRBlock(Emu* m, byte_t* dest, unsigned len);
+void diskCIOUTBlock(Emu* m, const byte_t* src, unsigned len);
 void diskUNLSN(Emu* m);
 void diskTKSA(Emu* m, byte_t second);
 
+void diskLogAppend(Emu* m, int kind, unsigned sector, unsigned buffer, unsigned bytes);
+void destroyDiskLog(DiskLog* log);
+
+// Log a read of a linear sector of the current drive's disk, if logging is on.
+static inline void diskLogAccess(Emu* m, int kind, unsigned sector, unsigned buffer,
+    unsigned bytes) {
+  if (m->diskLog)
+    diskLogAppend(m, kind, sector, buffer, bytes);
+}
+
+// I/O chips and interrupts
+void ioReset(Emu* m);
+void ciaReset(Emu* m);
+byte_t ciaRead(Emu* m, word_t addr);
+void ciaWrite(Emu* m, word_t addr, byte_t value);
+uint64_t ciaNextIC(Emu* m);
+void ciaRunAtIC(Emu* m);
+void push(Emu* m, byte_t value);
+byte_t pull(Emu* m);
+byte_t pullFlags(Emu* m);
+
+// The first instruction count at which the cycle count can have got to
+// cycle, for scheduling events timed in cycles (see scheduleNextEvent). It's
+// early unless every instruction until then takes MAX_INSTRUCTION_CYCLES.
+static inline uint64_t icAtCycle(const Emu* m, uint64_t cycle) {
+  if (cycle == UINT64_MAX)
+    return UINT64_MAX;
+  if (cycle <= m->reg.cycles)
+    return m->reg.ic;
+  return m->reg.ic + (cycle - m->reg.cycles + MAX_INSTRUCTION_CYCLES - 1) / MAX_INSTRUCTION_CYCLES;
+}
+
+// Have the interpreter take a waiting interrupt before the next instruction.
+static inline void pollInterrupts(Emu* m) {
+  if (m->nmi || (m->irq && !(m->reg.p & FLAG_I)))
+    m->nextEventIC = m->reg.ic;
+}
+
+// Keyboard buffer and input script
+void destroyKeyScript(KeyScript* k);
+void keyboardRefill(Emu* m);
+int keyboardTake(Emu* m);
+bool keyboardHasLine(Emu* m);
+bool keyScriptPending(Emu* m);
+uint64_t keyScriptNextIC(Emu* m);
+void keyScriptRunAtIC(Emu* m);
+
+// Drive CPU. The drive functions taking the C64's Emu work on the drive that
+// the current disk call addressed.
+bool attachDriveCPU(Emu* m, unsigned device, const buf_t* rom);
+void detachDriveCPU(Emu* m, unsigned device);
+byte_t driveLoad(Emu* cpu, word_t addr);
+void driveStore(Emu* cpu, byte_t value, word_t addr);
+byte_t driveReadMemory(Emu* m, word_t addr);
+void driveWriteMemory(Emu* m, word_t addr, const byte_t* data, unsigned len);
+void driveExecute(Emu* m, word_t addr);
+void driveSyncAtIC(Emu* m);
+byte_t iecBusLines(Emu* m);
+void driveDiskChanged(DiskDrive* d);
+
 // Other functions
 buf_t* bufCreate(void);
 void bufEnsureCap(buf_t* buf, unsigned cap);
@@ -268,6 +877,9 @@ void bufDestroy(buf_t* buf);
 void bufAppendChar(buf_t* buf, int c);
 void bufAppend(buf_t* buf, const char* str);
 buf_t* readFile(const char* path);
+buf_t* mapFile(const char* path);
+byte_t* bufMapCopyOnWrite(const buf_t* buf);
+void bufUnmapCopyOnWrite(byte_t* data, unsigned len);
 
 // Known RAM locations used by C64 KERNAL
 
@@ -279,6 +891,11 @@ buf_t* readFile(const char* path);
 #define RAM_DFLTN 0x0099 // input device, normally 0
 #define RAM_DFLTO 0x009A // output CMD device, normally 3
 
+#define RAM_NDX  0x00C6 // keyboard buffer count
+#define RAM_KEYD 0x0277 // keyboard buffer
+#define RAM_XMAX 0x0289 // keyboard buffer size
+#define KEYBOARD_BUFFER_SIZE 10
+
 #define RAM_END_PROG 0x0AE
 #define RAM_STAL 0xC1
 #define RAM_MEMUSS 0xC3
@@ -289,6 +906,10 @@ buf_t* readFile(const char* path);
 #define RAM_FA 0xBA // SETLFS device number
 #define RAM_FNADR 0xBB // SETNAM filename address
 
+#define RAM_CINV  0x0314 // IRQ vector, the first of the KERNAL vectors
+#define RAM_CBINV 0x0316 // BRK vector
+#define RAM_NMINV 0x0318 // NMI vector
+
 #define RAM_LAT 0x0259 // LA table
 #define RAM_FAT 0x0263 // FA table
 #define RAM_SAT 0x026D // SA table
@@ -309,9 +930,18 @@ buf_t* readFile(const char* path);
 #define C64_ROM_CALL_BASIN  0xFFCF
 #define C64_ROM_CALL_BSOUT  0xFFD2
 #define C64_ROM_CALL_LOAD   0xFFD5
+#define C64_ROM_CALL_SAVE   0xFFD8
+#define C64_ROM_CALL_CHKOUT 0xFFC9
 #define C64_ROM_CALL_OPEN   0xFFC0
 #define C64_ROM_CALL_CLOSE  0xFFC3
 #define C64_ROM_CALL_CLALL  0xFFE7
+#define C64_ROM_CALL_SCNKEY 0xFF9F
+#define C64_ROM_CALL_UDTIM  0xFFEA
+#define C64_ROM_CALL_CLSR   0xE544
+
+// KERNAL interrupt entry, where the hardware vectors point
+#define C64_ROM_IRQ_ENTRY 0xFF48
+#define C64_ROM_NMI_ENTRY 0xFE43
 
 // BIT FIDDLING HELPERS
 
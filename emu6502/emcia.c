@@ -0,0 +1,249 @@
+
+// CIA timers and the interrupts they raise. CIA 1 ($DC00) pulls the IRQ line
+// and CIA 2 ($DD00) the NMI line. The timers and interrupt control registers
+// are emulated. CIA 2 port A drives the serial bus (see iecBusLines), and
+// the other port inputs read as if nothing pulls them low (no keys down, no
+// joystick). The other registers read back what was written, from Cia.regs.
+//
+// The timers count the cycles in Registers.cycles. A running timer keeps the
+// cycle at which it next underflows, and its counter is worked out from that
+// when it's read. Underflows are timed events (see
+// scheduleNextEvent), so there's nothing to do between them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "em.h"
+
+#define CIA_CRB_COUNT_TA 0x40 // timer B counts timer A underflows (with bit 5 clear)
+#define CIA_CRB_MODE 0x60
+
+#define CIA_ICR_IR 0x80 // an enabled interrupt flag is set
+
+// CIA 2 port A: the serial bus. Outputs pull a line low when set, and inputs
+// are 0 while a line is low.
+#define CIA2_ATN_OUT  0x08
+#define CIA2_CLK_OUT  0x10
+#define CIA2_DATA_OUT 0x20
+#define CIA2_CLK_IN   0x40
+#define CIA2_DATA_IN  0x80
+
+// Whether timer B counts timer A underflows instead of cycles.
+static bool countsUnderflows(const Cia* cia, int t) {
+  return t == 1 && (cia->timers[1].control & CIA_CRB_MODE) == CIA_CRB_COUNT_TA;
+}
+
+static word_t timerCounter(Emu* m, const Cia* cia, int t) {
+  const CiaTimer* timer = &cia->timers[t];
+  if (!(timer->control & CIA_CR_START) || countsUnderflows(cia, t))
+    return timer->counter;
+  uint64_t now = m->reg.cycles;
+  return timer->underflowCycle > now ? timer->underflowCycle - now - 1 : 0;
+}
+
+// Start a cycle count down from the counter.
+static void timerStart(Emu* m, Cia* cia, int t) {
+  CiaTimer* timer = &cia->timers[t];
+  timer->underflowCycle = countsUnderflows(cia, t) ? UINT64_MAX
+      : m->reg.cycles + timer->counter + 1;
+}
+
+static void ciaUpdateInterrupt(Emu* m, int n) {
+  Cia* cia = &m->cias[n];
+  bool asserted = cia->flags & cia->mask;
+  if (n == 0) {
+    if (asserted)
+      m->irq |= IRQ_CIA1;
+    else
+      m->irq &= ~IRQ_CIA1;
+  } else {
+    if (asserted && !cia->nmiAsserted)
+      m->nmi = true; // NMI is taken on the edge
+    cia->nmiAsserted = asserted;
+  }
+  pollInterrupts(m);
+}
+
+static void timerUnderflow(Emu* m, int n, int t);
+
+static void timerCountUnderflow(Emu* m, int n) {
+  CiaTimer* timer = &m->cias[n].timers[1];
+  if (!(timer->control & CIA_CR_START) || !countsUnderflows(&m->cias[n], 1))
+    return;
+  if (timer->counter == 0)
+    timerUnderflow(m, n, 1);
+  else
+    timer->counter--;
+}
+
+// A timer reached zero and is reloaded from its latch. The next underflow
+// is timed from when this one was due, not from when it was handled.
+static void timerUnderflow(Emu* m, int n, int t) {
+  Cia* cia = &m->cias[n];
+  CiaTimer* timer = &cia->timers[t];
+  timer->counter = timer->latch;
+  if (timer->control & CIA_CR_ONE_SHOT) {
+    timer->control &= ~CIA_CR_START;
+    timer->underflowCycle = UINT64_MAX;
+  } else if (!countsUnderflows(cia, t)) {
+    timer->underflowCycle += timer->latch + 1;
+  }
+  cia->flags |= 1 << t;
+  ciaUpdateInterrupt(m, n);
+  if (t == 0)
+    timerCountUnderflow(m, n);
+}
+
+uint64_t ciaNextIC(Emu* m) {
+  uint64_t next = UINT64_MAX;
+  for (int n=0; n < CIA_COUNT; n++) {
+    for (int t=0; t < 2; t++) {
+      uint64_t cycle = m->cias[n].timers[t].underflowCycle;
+      if (cycle < next)
+        next = cycle;
+    }
+  }
+  return icAtCycle(m, next);
+}
+
+void ciaRunAtIC(Emu* m) {
+  uint64_t now = m->reg.cycles;
+  for (int n=0; n < CIA_COUNT; n++) {
+    for (int t=0; t < 2; t++) {
+      CiaTimer* timer = &m->cias[n].timers[t];
+      while (timer->underflowCycle <= now)
+        timerUnderflow(m, n, t);
+    }
+  }
+}
+
+// Put CIA 2's serial bus outputs on the bus, for drive CPUs to see.
+static void ciaUpdateBus(Emu* m, const Cia* cia) {
+  byte_t out = cia->regs[CIA_PRA] & cia->regs[CIA_DDRA];
+  m->iecOut = (out & CIA2_ATN_OUT ? IEC_ATN : 0) | (out & CIA2_CLK_OUT ? IEC_CLK : 0)
+      | (out & CIA2_DATA_OUT ? IEC_DATA : 0);
+}
+
+// CIA 2 port A inputs: the serial bus lines, as pulled by anyone.
+static byte_t ciaBusInputs(Emu* m) {
+  // Drive CPUs change the lines, so a loop waiting on them isn't idle (see
+  // idleLoopCheck).
+  m->memWrites++;
+  byte_t lines = iecBusLines(m);
+  byte_t in = 0xFF;
+  if (lines & IEC_CLK)
+    in &= ~CIA2_CLK_IN;
+  if (lines & IEC_DATA)
+    in &= ~CIA2_DATA_IN;
+  return in;
+}
+
+byte_t ciaRead(Emu* m, word_t addr) {
+  int n = (addr >> 8) - 0xDC;
+  Cia* cia = &m->cias[n];
+  unsigned r = addr & 0x0F;
+  int t = r >= CIA_TBLO;
+  switch (r) {
+    case CIA_PRA:
+    case CIA_PRB: {
+      // Inputs are pulled up.
+      byte_t in = n == 1 && r == CIA_PRA ? ciaBusInputs(m) : 0xFF;
+      byte_t ddr = cia->regs[r + CIA_DDRA];
+      return (cia->regs[r] & ddr) | (in & ~ddr);
+    }
+    case CIA_TALO:
+    case CIA_TBLO:
+    case CIA_TAHI:
+    case CIA_TBHI:
+      // A loop reading a running timer isn't idle (see idleLoopCheck).
+      if (cia->timers[t].control & CIA_CR_START)
+        m->memWrites++;
+      if (addr & 1)
+        return toHi(timerCounter(m, cia, t));
+      return toLo(timerCounter(m, cia, t));
+    case CIA_ICR: {
+      // Reading the flags clears them, which lets go of the interrupt.
+      byte_t value = cia->flags;
+      if (cia->flags & cia->mask)
+        value |= CIA_ICR_IR;
+      if (cia->flags) {
+        cia->flags = 0;
+        m->memWrites++;
+        ciaUpdateInterrupt(m, n);
+      }
+      return value;
+    }
+    case CIA_CRA:
+    case CIA_CRB:
+      return cia->timers[r - CIA_CRA].control;
+    default:
+      return cia->regs[r];
+  }
+}
+
+void ciaWrite(Emu* m, word_t addr, byte_t value) {
+  int n = (addr >> 8) - 0xDC;
+  Cia* cia = &m->cias[n];
+  unsigned r = addr & 0x0F;
+  cia->regs[r] = value;
+  switch (r) {
+    case CIA_PRA:
+    case CIA_DDRA:
+      if (n == 1)
+        ciaUpdateBus(m, cia);
+      break;
+    case CIA_TALO:
+    case CIA_TBLO:
+    case CIA_TAHI:
+    case CIA_TBHI: {
+      int t = r >= CIA_TBLO;
+      CiaTimer* timer = &cia->timers[t];
+      if (addr & 1)
+        timer->latch = toWord(toLo(timer->latch), value);
+      else
+        timer->latch = toWord(value, toHi(timer->latch));
+      // Writing the high byte of a stopped timer loads it.
+      if ((addr & 1) && !(timer->control & CIA_CR_START))
+        timer->counter = timer->latch;
+      break;
+    }
+    case CIA_ICR:
+      if (value & 0x80)
+        cia->mask |= value & 0x1F;
+      else
+        cia->mask &= ~value;
+      ciaUpdateInterrupt(m, n);
+      break;
+    case CIA_CRA:
+    case CIA_CRB: {
+      int t = r - CIA_CRA;
+      CiaTimer* timer = &cia->timers[t];
+      timer->counter = timerCounter(m, cia, t);
+      timer->control = value & ~CIA_CR_LOAD;
+      if (value & CIA_CR_LOAD)
+        timer->counter = timer->latch;
+      if (value & CIA_CR_START)
+        timerStart(m, cia, t);
+      else
+        timer->underflowCycle = UINT64_MAX;
+      scheduleNextEvent(m);
+      break;
+    }
+  }
+}
+
+void ciaReset(Emu* m) {
+  memset(m->cias, 0, sizeof(m->cias));
+  for (int n=0; n < CIA_COUNT; n++) {
+    for (int t=0; t < 2; t++) {
+      m->cias[n].timers[t].latch = 0xFFFF;
+      m->cias[n].timers[t].counter = 0xFFFF;
+      m->cias[n].timers[t].underflowCycle = UINT64_MAX;
+    }
+  }
+  m->irq = 0;
+  m->nmi = false;
+  m->iecOut = 0;
+}
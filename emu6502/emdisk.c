@@ -1,4 +1,6 @@
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -8,26 +10,17 @@
 #include <string.h>
 #include <memory.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "em.h"
 #include "emtrace.h"
 
 #define DIRECTORY_ENTRY_SIZE 0x20
-#define MAX_DIRENTRY_COUNT 20 // real limit is 144+ but I won't need more
-#define D64_SIZE 0x2AB00
-#define MAX_TRACK_NUMBER 40
-
-#define DIRENTRY_FLAG_LOCKED 0x40
-#define DIRENTRY_FLAG_CLOSED 0x80
+#define DIRECTORY_ENTRIES_PER_SECTOR (SECTOR_SIZE / DIRECTORY_ENTRY_SIZE)
 
-enum {
-  FILETYPE_DEL = 0,
-  FILETYPE_SEQ,
-  FILETYPE_PRG,
-  FILETYPE_USR,
-  FILETYPE_REL,
-  FILETYPE_COUNT,
-};
+static bool swapOnMissing(emu_t* m);
 
 const char* FILETYPE_NAMES[] = {
   "DEL",
@@ -37,28 +30,89 @@ const char* FILETYPE_NAMES[] = {
   "REL",
 };
 
-static const char* getFiletypeName(emu_t* m, unsigned filetypeID) {
-  if (filetypeID >= FILETYPE_COUNT)
-    error(m, "Invalid filetype ID: %d", filetypeID);
-  return FILETYPE_NAMES[filetypeID];
+const char* DISK_CHAIN_STATUS_NAMES[] = {
+  "OK",
+  "BAD_LINK",
+  "LOOP",
+  "CROSSLINKED",
+};
+
+// Image formats. Each has a table of its tracks, so finding a sector is a
+// lookup whatever the format. Any format can also come with an error table:
+// one byte per sector appended to the image.
+const DiskFormat DISK_FORMATS[] = {
+  { "D64", 35, 683, TRACK_INFO, 18, 1, DISK_BAM_1541, 10, 3 },
+  { "D64 (40 tracks)", 40, 768, TRACK_INFO, 18, 1, DISK_BAM_1541, 10, 3 },
+  { "D71", 70, 1366, D71_TRACK_INFO, 18, 1, DISK_BAM_1571, 6, 3 },
+  { "D81", 80, 3200, D81_TRACK_INFO, 40, 3, DISK_BAM_1581, 1, 1 },
+};
+
+// Identify the format of an image from its size. Returns NULL if the size
+// doesn't match any format.
+const DiskFormat* diskFormatForSize(unsigned size, bool* hasErrorBytes) {
+  for (int i=0; i < DISK_FORMAT_COUNT; i++) {
+    const DiskFormat* format = &DISK_FORMATS[i];
+    bool errorBytes = size == format->sectorCount * (SECTOR_SIZE + 1);
+    if (size == format->sectorCount * SECTOR_SIZE || errorBytes) {
+      if (hasErrorBytes)
+        *hasErrorBytes = errorBytes;
+      return format;
+    }
+  }
+  return NULL;
 }
 
 // Compute the offset in bytes of the given track/sector relative to the start
 // of the disk image.
-static unsigned trackAndSectorAddr(unsigned track, unsigned sector) {
-  assert(track <= MAX_TRACK_NUMBER);
-  assert(sector < TRACK_INFO[track].sectorCount);
-  unsigned trackAddr = TRACK_INFO[track].offsetInBytes;
+static unsigned trackAndSectorAddr(const DiskFormat* format, unsigned track, unsigned sector) {
+  assert(track >= 1 && track <= format->trackCount);
+  assert(sector < format->tracks[track].sectorCount);
+  unsigned trackAddr = format->tracks[track].offsetInBytes;
   return trackAddr + sector * SECTOR_SIZE;
 }
 
-// Check that the disk image has an expected size.
-// In fact there might be different possible sizes but this is the size I
-// usually see so I won't change it unless I need to.
-void checkDiskSize(emu_t* m, const buf_t* disk) {
+// Convert a track/sector to a linear sector number. Returns -1 if there's no
+// such sector in the format.
+static int linearSector(const DiskFormat* format, unsigned track, unsigned sector) {
+  if (track == 0 || track > format->trackCount)
+    return -1;
+  if (sector >= format->tracks[track].sectorCount)
+    return -1;
+  return format->tracks[track].offsetInSectors + sector;
+}
+
+// Convert a linear sector number back to a track/sector.
+static void sectorTrackAndSector(const DiskFormat* format, unsigned n,
+    unsigned* track, unsigned* sector) {
+  unsigned t = 1;
+  while (t < format->trackCount && format->tracks[t+1].offsetInSectors <= n)
+    t++;
+  *track = t;
+  *sector = n - format->tracks[t].offsetInSectors;
+}
+
+const byte_t* diskSectorData(const buf_t* image, unsigned sector) {
+  assert((sector + 1) * SECTOR_SIZE <= image->len);
+  return image->data + sector * SECTOR_SIZE;
+}
+
+// The code in the image's error table for a sector, or 0 if it doesn't have
+// one. Codes 0 and 1 both mean there's no error.
+int diskSectorError(const buf_t* image, const DiskIndex* index, unsigned sector) {
+  if (!index->hasErrorBytes)
+    return 0;
+  return image->data[index->sectorCount * SECTOR_SIZE + sector];
+}
+
+// Check that the disk image has the size of one of the supported formats.
+bool checkDiskSize(emu_t* m, const buf_t* disk) {
   assert(disk);
-  if (disk->len != D64_SIZE)
-    error(m, "Attached disk image is wrong size.");
+  if (!diskFormatForSize(disk->len, NULL)) {
+    setFault(m, FAULT_DISK,
+        "Attached disk image is wrong size for D64, D71 or D81: %u bytes.", disk->len);
+    return false;
+  }
+  return true;
 }
 
 // Disk commands take args in different formats.
@@ -182,7 +236,7 @@ optionalDriveNumber:
   if (isdigit(b[1])) {
     int driveNumber = b[1] - '0';
     if (driveNumber != 0)
-      error(m, "Drive number %d specified in command, but only drive 0 is valid.", driveNumber);
+      fault(m, FAULT_DISK, "Drive number %d specified in command, but only drive 0 is valid.", driveNumber);
     (*argStartIndex)++;
   }
 
@@ -190,7 +244,7 @@ optionalDriveNumber:
 expectColon:
   nextChar = b[*argStartIndex];
   if (nextChar != 0 && nextChar != ':')
-    error(m, "Colon expected after drive command.");
+    fault(m, FAULT_DISK, "Colon expected after drive command.");
 
   return cmdID;
 }
@@ -216,7 +270,7 @@ static int parseDecimalArgs(emu_t* m, const byte_t* argStart, byte_t* args) {
       argValue = (10 * argValue) + (*p - '0');
     // We're assuming these args must be in range 0-255, check this.
     if (argValue > UINT8_MAX)
-      error(m, "Decimal argument out of range: %d", argValue);
+      fault(m, FAULT_DISK, "Decimal argument out of range: %d", argValue);
     args[argIndex] = argValue;
     argIndex++;
   }
@@ -254,18 +308,12 @@ static int parseDiskCmdArgs(
       return 0;
 
       // commands with string args
-
-      // There's probably no need to implement any of these commands so I won't
-      // bother parsing them. If I were going to do it I'd use the argument
-      // bytes as (offset1, length1, offset2, length2) to store the bounds of
-      // the argument strings.
+      // These are parsed by the commands themselves, from the argument text.
 
     case DISK_CMD_COPY:
-      error(m, "Disk command COPY not implemented.");
     case DISK_CMD_RENAME:
-      error(m, "Disk command RENAME not implemented.");
     case DISK_CMD_SCRATCH:
-      error(m, "Disk command SCRATCH not implemented.");
+      return 0;
 
       // commands with decimal args
 
@@ -299,11 +347,11 @@ static int parseDiskCmdArgs(
       // The third argument is the expected length of the trailing data,
       // validate this against what was actually sent.
       if (argEnd - argStart - 3 != args[2])
-        error(m, "MEMORY-WRITE has incorrect data length.");
+        fault(m, FAULT_DISK, "MEMORY-WRITE has incorrect data length.");
       return 3;
 
     default:
-      error(m, "Unimplemented disk command: ID %d", diskCmd);
+      fault(m, FAULT_DISK, "Unimplemented disk command: ID %d", diskCmd);
   }
 }
 
@@ -324,14 +372,77 @@ void renderPetscii(char* buf, int bufSize, const byte_t* src, int srcLen) {
   buf[i] = 0;
 }
 
-unsigned getChannelBufferID(emu_t* m, unsigned channel) {
-  unsigned bufferID;
-  for (bufferID=0; bufferID < DISKDRIVE_BUFFER_COUNT; bufferID++) {
-    if (channel == m->diskdrive.diskBufferChannels[bufferID])
-      break;
+// Put the drive in its power-on state, apart from the mounted disk.
+void diskReset(DiskDrive* d) {
+  d->commandBufferPointer = 0;
+  d->statusLen = 0;
+  for (int i=0; i < DISKDRIVE_BUFFER_COUNT; i++) {
+    d->diskBufferPointers[i] = 0;
+    d->diskBufferChannels[i] = DISK_CHANNEL_NONE;
+    d->diskBufferFiles[i] = DISK_FILE_NONE;
+    d->diskBufferSectors[i] = -1;
+  }
+  d->commState = 0;
+  d->secondAddress = 0;
+}
+
+// Returns the buffer assigned to a channel, or -1.
+static int findChannelBuffer(DiskDrive* d, unsigned channel) {
+  for (int bufferID=0; bufferID < DISKDRIVE_BUFFER_COUNT; bufferID++) {
+    if (channel == d->diskBufferChannels[bufferID])
+      return bufferID;
   }
-  if (bufferID == DISKDRIVE_BUFFER_COUNT)
-    error(m, "Channel not mapped to a buffer: %d", channel);
+  return -1;
+}
+
+unsigned getChannelBufferID(emu_t* m, unsigned channel) {
+  int bufferID = findChannelBuffer(m->diskdrive, channel);
+  if (bufferID < 0)
+    fault(m, FAULT_DISK, "Channel not mapped to a buffer: %d", channel);
+  return bufferID;
+}
+
+// Disk writing commands (see WRITING below).
+static void diskScratch(emu_t* m, const byte_t* args, unsigned len);
+static void diskRename(emu_t* m, const byte_t* args, unsigned len);
+static void diskCopy(emu_t* m, const byte_t* args, unsigned len);
+static void diskWriteBlock(emu_t* m, unsigned channel, unsigned drive,
+    unsigned track, unsigned sector, bool storePointer);
+static void diskAllocateBlock(emu_t* m, unsigned drive, unsigned track,
+    unsigned sector, bool setFree);
+
+// Read a sector into a channel's buffer (U1 or B-R). Returns the buffer.
+static unsigned diskReadBlock(emu_t* m, int accessKind, unsigned channel,
+    unsigned drive, unsigned track, unsigned sector) {
+  // TODO: Associate channel with buffer in OPEN command.
+  unsigned bufferID = getChannelBufferID(m, channel);
+  if (drive != 0)
+    fault(m, FAULT_DISK, "Only one drive is supported.");
+  // Fill the buffer.
+  if (m->diskdrive->mountedImageData == NULL && !swapOnMissing(m))
+    fault(m, FAULT_DISK, "Disk is not ready to read.");
+  int n = linearSector(m->diskdrive->index->format, track, sector);
+  while (n < 0 && swapOnMissing(m))
+    n = linearSector(m->diskdrive->index->format, track, sector);
+  if (n < 0)
+    fault(m, FAULT_DISK, "Track/sector out of range: %d/%d", track, sector);
+  const DiskIndex* index = m->diskdrive->index;
+  unsigned sectorAddr = trackAndSectorAddr(index->format, track, sector);
+  if (m->diskdrive->g64)
+    g64DecodeTrack(m->diskdrive->g64, track);
+  // The drive can't emulate read errors, but they're worth knowing
+  // about since copy protection checks for them.
+  int sectorError = diskSectorError(m->diskdrive->mountedImageData, index, n);
+  if (sectorError > 1)
+    romTrace(m, "ROM/disk: U1 TS $%02X:%02X has error code %d in the image.",
+        track, sector, sectorError);
+  memcpy(m->diskdrive->diskBuffers[bufferID],
+      diskSectorData(m->diskdrive->mountedImageData, n),
+      SECTOR_SIZE);
+  m->diskdrive->diskBufferPointers[bufferID] = 0xFF;
+  m->diskdrive->diskBufferSectors[bufferID] = n;
+  diskLogAccess(m, accessKind, n, bufferID, SECTOR_SIZE);
+  romTrace(m, "ROM/disk: U1 read TS $%02X:%02X [%X] into buffer %d.", track, sector, sectorAddr, bufferID);
   return bufferID;
 }
 
@@ -347,33 +458,38 @@ static void execDiskCmd(emu_t* m, int cmd, byte_t* args, byte_t* argStart, unsig
       // The mounted image shouldn't be reset (that represents physically
       // inserting the disk into the drive) and the buffer contents don't need
       // to be cleared.
-      {
-        DiskDrive* d = &m->diskdrive;
-        d->commandBufferPointer = 0;
-        for (int i=0; i < DISKDRIVE_BUFFER_COUNT; i++) {
-          d->diskBufferPointers[i] = 0;
-          d->diskBufferChannels[i] = 0;
-        }
-        d->commState = 0;
-        d->secondAddress = 0;
-      }
+      diskReset(m->diskdrive);
       romTrace(m, "ROM/disk: drive init");
       break;
 
     case DISK_CMD_BLOCK_ALLOCATE:  // drive; track; block
-      error(m, "Disk command BLOCK-ALLOCATE not implemented.");
+      diskAllocateBlock(m, args[0], args[1], args[2], false);
       break;
     case DISK_CMD_BLOCK_EXECUTE:   // channel; drive; track; block
-      error(m, "Disk command BLOCK-EXECUTE not implemented.");
+      {
+        // Like U1, then the drive runs the buffer. Buffers are from $0300 in
+        // drive memory.
+        unsigned bufferID = diskReadBlock(m, DISK_ACCESS_U1, args[0], args[1], args[2], args[3]);
+        word_t addr = 0x0300 + bufferID * SECTOR_SIZE;
+        romTrace(m, "BLOCK-EXECUTE(addr=%04X)", addr);
+        driveWriteMemory(m, addr, m->diskdrive->diskBuffers[bufferID], SECTOR_SIZE);
+        driveExecute(m, addr);
+      }
       break;
     case DISK_CMD_BLOCK_FREE:      // drive; track; block
-      error(m, "Disk command BLOCK-FREE not implemented.");
+      diskAllocateBlock(m, args[0], args[1], args[2], true);
       break;
     case DISK_CMD_BLOCK_READ:      // channel; drive; track; block
-      error(m, "Disk command BLOCK-READ not implemented.");
+      {
+        // Like U1, but the first byte is the number of bytes to read (see
+        // B-W), so reading starts after it.
+        unsigned bufferID = diskReadBlock(m, DISK_ACCESS_BLOCK_READ,
+            args[0], args[1], args[2], args[3]);
+        m->diskdrive->diskBufferPointers[bufferID] = 1;
+      }
       break;
     case DISK_CMD_BLOCK_WRITE:     // channel; drive; track; block
-      error(m, "Disk command BLOCK-WRITE not implemented.");
+      diskWriteBlock(m, args[0], args[1], args[2], args[3], true);
       break;
 
     case DISK_CMD_BUFFER_POINTER:  // B-P: channel; location
@@ -382,7 +498,7 @@ static void execDiskCmd(emu_t* m, int cmd, byte_t* args, byte_t* argStart, unsig
         int channel = args[0];
         int location = args[1];
         int bufferID = getChannelBufferID(m, channel);
-        m->diskdrive.diskBufferPointers[bufferID] = location;
+        m->diskdrive->diskBufferPointers[bufferID] = location;
       }
       break;
 
@@ -390,24 +506,25 @@ static void execDiskCmd(emu_t* m, int cmd, byte_t* args, byte_t* argStart, unsig
       {
         word_t addr = toWord(args[0], args[1]);
         romTrace(m, "MEMORY-EXECUTE(addr=%04X)", addr);
-        error(m, "MEMORY-EXECUTE not implemented.");
+        driveExecute(m, addr);
       }
       break;
 
     case DISK_CMD_MEMORY_READ:     // M-R: addr lo byte; hi byte
       {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-variable"
         // Optional 3rd argument specifies data length, default is 1.
         word_t addr = toWord(args[0], args[1]);
         unsigned len = argLen == 3 ? args[2] : 1;
         romTrace(m, "ROM/disk: MEMORY-READ(addr=%04X,len=%02X)", addr, len);
         if (len > 1)
-          error(m, "ROM/disk: MEMORY-READ only supports length=1");
-        // XXX: The value that ACS is expecting is in C6C4 so we give it what
-        // it wants. This behavior is seen in the loader bytecode.
-        m->diskdrive.commandRecv = RAM[0xC6C4];
-#pragma GCC diagnostic pop
+          fault(m, FAULT_DISK, "ROM/disk: MEMORY-READ only supports length=1");
+        if (m->diskdrive->cpu) {
+          m->diskdrive->commandRecv = driveReadMemory(m, addr);
+        } else {
+          // XXX: The value that ACS is expecting is in C6C4 so we give it
+          // what it wants. This behavior is seen in the loader bytecode.
+          m->diskdrive->commandRecv = RAM[0xC6C4];
+        }
       }
       break;
 
@@ -424,48 +541,41 @@ static void execDiskCmd(emu_t* m, int cmd, byte_t* args, byte_t* argStart, unsig
         } else {
           romTrace(m, "ROM/disk: MEMORY-WRITE(addr=%04X,len=%02X,data=%02X)", addr, len, data[0]);
         }
-        // XXX: Most of the time it won't make sense to actually write here
-        // because the locations are ROM variables and we're not using the ROM.
-        // I might have to implement some of these with special handling.
+        // Without the drive CPU there's no drive memory to write. Most of the
+        // time the locations are ROM variables anyway.
+        if (m->diskdrive->cpu)
+          driveWriteMemory(m, addr, data, len);
       }
       break;
 
     case DISK_CMD_U1: // channel; drive; track; block
-      {
-        // TODO: Associate channel with buffer in OPEN command.
-        unsigned channel = args[0];
-        unsigned drive = args[1];
-        unsigned track = args[2];
-        unsigned sector = args[3];
-        unsigned bufferID = getChannelBufferID(m, channel);
-        if (drive != 0)
-          error(m, "Only one drive is supported.");
-        // Fill the buffer.
-        if (m->diskdrive.mountedImageData == NULL)
-          error(m, "Disk is not ready to read.");
-        unsigned sectorAddr = trackAndSectorAddr(track, sector);
-        assert(sectorAddr + SECTOR_SIZE <= D64_SIZE);
-        memcpy(m->diskdrive.diskBuffers[bufferID],
-            m->diskdrive.mountedImageData->data + sectorAddr,
-            SECTOR_SIZE);
-        m->diskdrive.diskBufferPointers[bufferID] = 0xFF;
-        romTrace(m, "ROM/disk: U1 read TS $%02X:%02X [%X] into buffer %d.", track, sector, sectorAddr, bufferID);
-      } 
+      diskReadBlock(m, DISK_ACCESS_U1, args[0], args[1], args[2], args[3]);
       break;
 
     case DISK_CMD_U2: // channel; drive; track; block
-      error(m, "U2 not implemented.");
+      diskWriteBlock(m, args[0], args[1], args[2], args[3], false);
+      break;
+
+    case DISK_CMD_SCRATCH:
+      diskScratch(m, argStart, argLen);
+      break;
+    case DISK_CMD_RENAME:
+      diskRename(m, argStart, argLen);
+      break;
+    case DISK_CMD_COPY:
+      diskCopy(m, argStart, argLen);
       break;
 
     default:
-      error(m, "Invalid disk command ID: %d", cmd);
+      fault(m, FAULT_DISK, "Invalid disk command ID: %d", cmd);
   }
 }
 
 static void diskCommand(emu_t* m) {
   // TODO: Return error codes instead of crashing on errors.
-  byte_t* b = m->diskdrive.commandBuffer;
-  int len = m->diskdrive.commandBufferPointer;
+  m->diskdrive->statusLen = 0; // a new command clears the last error
+  byte_t* b = m->diskdrive->commandBuffer;
+  int len = m->diskdrive->commandBufferPointer;
   byte_t* e = b + len;
   *e = 0;
   int argStartIndex;
@@ -473,213 +583,1447 @@ static void diskCommand(emu_t* m) {
   assert(diskCmdID < DISK_CMD_COUNT);
   const char* diskCmdName = DiskCommandNames[diskCmdID];
   if (diskCmdID == 0)
-    error(m, "Invalid disk command: %s", b);
+    fault(m, FAULT_DISK, "Invalid disk command: %s", b);
   romTrace(m, "ROM/disk: COMMAND [%s] \"%s\"", diskCmdName, b);
   byte_t args[DISK_CMD_MAX_ARG_COUNT];
   int argCount = parseDiskCmdArgs(m, diskCmdID, b + argStartIndex, e, args);
   if (argCount < 0)
-    error(m, "Invalid disk command arguments: %s", b);
+    fault(m, FAULT_DISK, "Invalid disk command arguments: %s", b);
   char buf[DISKDRIVE_COMMAND_BUFFER_SIZE+1];
   renderPetscii(buf, DISKDRIVE_COMMAND_BUFFER_SIZE+1, b, len);
   romTrace(m, "ROM/disk: %s", buf);
   execDiskCmd(m, diskCmdID, args, b + argStartIndex, e - (b + argStartIndex));
 }
 
-#define DISK_DIRECTORY_FILENAME_LEN 16
+// Number of file data bytes in a sector of a chain. The track/sector of the
+// next sector in the chain is stored in the first two bytes of each sector.
+// In the last sector the "sector number" is really the index of the last
+// byte that's part of the file.
+unsigned sectorDataLength(const byte_t* d) {
+  if (d[0] != 0)
+    return SECTOR_SIZE - 2;
+  return d[1] >= 2 ? d[1] - 1 : 0;
+}
 
-typedef struct {
-  byte_t filetypeID;
-  byte_t flags;
-  byte_t startTrack;
-  byte_t startSector;
-  word_t fileSizeInSectors;
-  char filetypeName[4];
-  byte_t relSideTrack;
-  byte_t relSideSector;
-  byte_t relRecordLen;
-  char filename[DISK_DIRECTORY_FILENAME_LEN+1]; // extra space for null terminator
-} direntry_t;
+// Add a directory entry to the index. Returns false if out of memory.
+static bool indexAddEntry(DiskIndex* index, unsigned* cap, const byte_t* ent,
+    unsigned dirSector, unsigned dirEntry) {
+  if (index->fileCount == *cap) {
+    unsigned newCap = *cap ? *cap * 2 : DIRECTORY_ENTRIES_PER_SECTOR;
+    DiskFileEntry* files = realloc(index->files, newCap * sizeof(DiskFileEntry));
+    if (!files)
+      return false;
+    index->files = files;
+    *cap = newCap;
+  }
+  DiskFileEntry* f = &index->files[index->fileCount++];
+  memset(f, 0, sizeof(DiskFileEntry));
+  unsigned filetypeByte = ent[2];
+  f->filetypeID = filetypeByte & 7; // 3 low bits
+  f->flags = filetypeByte & (~7); // remove filetypeID
+  f->startTrack = ent[3];
+  f->startSector = ent[4];
+  // The filename is a 16-byte fixed-width field, and empty bytes are filled
+  // with 0xA0 (called a "shifted space", 0x20 | 0x80). The raw name is kept
+  // for matching; the C version stops at the padding.
+  memcpy(f->name, ent + 5, DISK_FILENAME_LEN);
+  for (int i=0; i < DISK_FILENAME_LEN && ent[5+i] != 0xA0; i++)
+    f->filename[i] = (char)ent[5+i];
+  f->fileSizeInSectors = toWord(ent[0x1E], ent[0x1E + 1]);
+  if (f->filetypeID == FILETYPE_REL) {
+    f->relSideTrack = ent[0x15];
+    f->relSideSector = ent[0x15+1];
+    f->relRecordLen = ent[0x17];
+  }
+  f->dirSector = dirSector;
+  f->dirEntry = dirEntry;
+  return true;
+}
+
+// Follow the chain of one file, appending its sectors to index->chains.
+// Chains are appended in file order, so each one starts where the previous
+// file's ended.
+static void indexFileChain(const buf_t* image, DiskIndex* index, unsigned fileIndex) {
+  DiskFileEntry* f = &index->files[fileIndex];
+  unsigned track = f->startTrack;
+  unsigned sector = f->startSector;
+  f->chainStart = fileIndex == 0 ? 0 : index->files[fileIndex-1].chainStart
+    + index->files[fileIndex-1].chainLength;
+  f->chainStatus = DISK_CHAIN_OK;
+  while (track != 0) {
+    int n = linearSector(index->format, track, sector);
+    if (n < 0) {
+      f->chainStatus = DISK_CHAIN_BAD_LINK;
+      break;
+    }
+    int owner = index->sectorOwner[n];
+    if (owner != DISK_SECTOR_UNUSED) {
+      f->chainStatus = owner == (int)fileIndex ? DISK_CHAIN_LOOP : DISK_CHAIN_CROSSLINKED;
+      break;
+    }
+    index->sectorOwner[n] = fileIndex;
+    index->chains[f->chainStart + f->chainLength++] = n;
+    const byte_t* d = diskSectorData(image, n);
+    f->byteLength += sectorDataLength(d);
+    track = d[0];
+    sector = d[1];
+  }
+}
+
+// Index the directory and the sector chains of all files on a disk image.
+// The image must have the size of the format (see diskFormatForSize).
+DiskIndex* buildDiskIndex(const buf_t* image, const DiskFormat* format) {
+  bool hasErrorBytes = false;
+  if (diskFormatForSize(image->len, &hasErrorBytes) != format)
+    return NULL;
+  DiskIndex* index = calloc(1, sizeof(DiskIndex));
+  if (!index)
+    return NULL;
+  unsigned sectorCount = format->sectorCount;
+  index->format = format;
+  index->sectorCount = sectorCount;
+  index->hasErrorBytes = hasErrorBytes;
+  index->chains = malloc(sectorCount * sizeof(word_t));
+  index->sectorOwner = malloc(sectorCount * sizeof(int16_t));
+  if (!index->chains || !index->sectorOwner)
+    goto outOfMemory;
+  for (unsigned i=0; i < sectorCount; i++)
+    index->sectorOwner[i] = DISK_SECTOR_UNUSED;
 
+  // Walk the directory. The header sector contains a "next track/sector"
+  // notation but it's ignored.
+  unsigned cap = 0;
+  unsigned track = format->dirTrack;
+  unsigned sector = format->dirSector;
+  index->directoryStatus = DISK_CHAIN_OK;
+  while (track != 0) {
+    int n = linearSector(format, track, sector);
+    if (n < 0) {
+      index->directoryStatus = DISK_CHAIN_BAD_LINK;
+      break;
+    }
+    if (index->sectorOwner[n] == DISK_SECTOR_DIRECTORY) {
+      index->directoryStatus = DISK_CHAIN_LOOP;
+      break;
+    }
+    index->sectorOwner[n] = DISK_SECTOR_DIRECTORY;
+    const byte_t* d = diskSectorData(image, n);
+    for (unsigned e=0; e < DIRECTORY_ENTRIES_PER_SECTOR; e++) {
+      const byte_t* ent = d + e * DIRECTORY_ENTRY_SIZE;
+      if (ent[2] == 0) // scratched or never used
+        continue;
+      if (!indexAddEntry(index, &cap, ent, n, e))
+        goto outOfMemory;
+    }
+    track = d[0];
+    sector = d[1];
+  }
+
+  for (unsigned i=0; i < index->fileCount; i++)
+    indexFileChain(image, index, i);
+  return index;
+
+outOfMemory:
+  destroyDiskIndex(index);
+  return NULL;
+}
+
+void destroyDiskIndex(DiskIndex* index) {
+  if (!index)
+    return;
+  free(index->files);
+  free(index->chains);
+  free(index->sectorOwner);
+  free(index);
+}
+
+// Match a filename against a pattern the way the drive does: '?' matches any
+// character and '*' matches the rest of the name.
+static bool matchFilename(const byte_t* name, const byte_t* pattern, unsigned patternLen) {
+  unsigned i;
+  for (i=0; i < patternLen; i++) {
+    if (pattern[i] == '*')
+      return true;
+    if (i == DISK_FILENAME_LEN || name[i] == 0xA0)
+      return false;
+    if (pattern[i] != '?' && pattern[i] != name[i])
+      return false;
+  }
+  return i == DISK_FILENAME_LEN || name[i] == 0xA0;
+}
+
+// Returns the index of the first file matching the pattern, or -1.
+int findDiskFile(const DiskIndex* index, const byte_t* pattern, unsigned patternLen) {
+  for (unsigned i=0; i < index->fileCount; i++) {
+    if (matchFilename(index->files[i].name, pattern, patternLen))
+      return i;
+  }
+  return -1;
+}
+
+buf_t* readDiskFile(const buf_t* image, const DiskIndex* index, unsigned fileIndex) {
+  assert(fileIndex < index->fileCount);
+  const DiskFileEntry* f = &index->files[fileIndex];
+  buf_t* file = bufCreate();
+  bufEnsureCap(file, f->byteLength);
+  for (unsigned i=0; i < f->chainLength; i++) {
+    const byte_t* d = diskSectorData(image, index->chains[f->chainStart + i]);
+    unsigned len = sectorDataLength(d);
+    memcpy(file->data + file->len, d + 2, len);
+    file->len += len;
+  }
+  assert(file->len == f->byteLength);
+  return file;
+}
+
+// WRITING
+//
+// Writes go to a private copy of the image (see mountDiskWritable). Every
+// sector that's changed is flagged, so that only those need to be written back
+// to the file. The index is rebuilt after anything that can change the
+// directory or a chain.
+
+const char* DISK_WRITE_MODE_NAMES[] = {
+  "protected",
+  "discard",
+  "close",
+  "exit",
+};
+
+// DOS error codes, as the drive reports them on the error channel.
+enum {
+  DOS_WRITE_PROTECT_ON = 26,
+  DOS_DISK_FULL = 72,
+};
+
+// A drive error that isn't the emulator's problem: the drive reports it on
+// the error channel and carries on. The KERNAL sees the byte it was sending
+// as not taken (write timeout in ST).
+static void driveError(emu_t* m, int code) {
+  DiskDrive* d = m->diskdrive;
+  const char* text = code == DOS_WRITE_PROTECT_ON ? "WRITE PROTECT ON" : "DISK FULL";
+  d->statusLen = snprintf(d->status, DISKDRIVE_STATUS_SIZE, "%02d,%s,00,00\r", code, text);
+  d->statusPos = 0;
+  RAM[RAM_STATUS] |= 0x01;
+  romTrace(m, "ROM/disk: error %02d, %s", code, text);
+}
+
+// Report WRITE PROTECT ON if the disk can't be written.
+static bool checkWritable(emu_t* m) {
+  if (m->diskdrive->writableImage != NULL)
+    return true;
+  driveError(m, DOS_WRITE_PROTECT_ON);
+  return false;
+}
+
+// Find the part of a filename that names the file, without the drive prefix
+// ("0:") or the type and mode suffix (",S,R").
+static void parseFilename(const byte_t* b, unsigned len, unsigned* start, unsigned* end) {
+  *start = 0;
+  if (len >= 2 && isdigit(b[0]) && b[1] == ':')
+    *start = 2;
+  else if (len >= 1 && b[0] == ':')
+    *start = 1;
+  *end = *start;
+  while (*end < len && b[*end] != ',')
+    (*end)++;
+}
+
+static DiskIndex* getDiskIndex(emu_t* m) {
+  if (m->diskdrive->index == NULL && !swapOnMissing(m))
+    fault(m, FAULT_DISK, "No disk mounted.");
+  return m->diskdrive->index;
+}
+
+// Get a sector to modify, and flag it as changed. Callers check the disk is
+// writable first (see checkWritable).
+static byte_t* writableSector(emu_t* m, unsigned sector) {
+  DiskDrive* d = m->diskdrive;
+  if (d->writableImage == NULL)
+    fault(m, FAULT_DISK, "Write to a write protected disk.");
+  assert(sector < d->index->sectorCount);
+  if (!d->dirtySectors[sector]) {
+    d->dirtySectors[sector] = 1;
+    d->dirtyCount++;
+  }
+  return d->writableImage->data + sector * SECTOR_SIZE;
+}
+
+// Where a track's entry is in the BAM: its free sector count, and a bitmap
+// in which set bits are free sectors. The count and bitmap aren't always next
+// to each other.
 typedef struct {
-  unsigned entryCount;
-  direntry_t entries[MAX_DIRENTRY_COUNT];
-} directory_t;
-
-void readFileDirectory(emu_t* m, int deviceNumber, directory_t* dir) {
-  // Check state.
-  if (deviceNumber != 8)
-    error(m, "Only one drive is supported.");
-  if (m->diskdrive.mountedImagePath == NULL)
-    error(m, "No disk mounted.");
-  if (m->diskdrive.mountedImageData == NULL)
-    m->diskdrive.mountedImageData = readFile(m->diskdrive.mountedImagePath);
-  checkDiskSize(m, m->diskdrive.mountedImageData);
-  // Initial setup.
-  const byte_t* d64 = m->diskdrive.mountedImageData->data;
-  // Sector 0 contains a "next track/sector" notation but it's ignored.
-  unsigned nextTrack = 18; 
-  unsigned nextSector = 1;
-  // Iterate over entries.
-  dir->entryCount = 0;
+  unsigned countSector;
+  unsigned countOffset;
+  unsigned mapSector;
+  unsigned mapOffset;
+} BamEntry;
+
+// Returns false if the track isn't in the BAM. That's the case for tracks
+// 36-40 of 40-track D64s, whose BAM extensions vary between DOS versions.
+static bool bamLocate(const DiskFormat* format, unsigned track, BamEntry* e) {
+  const trackinfo_t* tracks = format->tracks;
+  switch (format->bamKind) {
+    case DISK_BAM_1541:
+    case DISK_BAM_1571:
+      if (track <= 35) {
+        e->countSector = e->mapSector = tracks[18].offsetInSectors;
+        e->countOffset = 4 + 4 * (track - 1);
+        e->mapOffset = e->countOffset + 1;
+        return true;
+      }
+      if (format->bamKind == DISK_BAM_1571 && track <= 70) {
+        // Side 2: counts follow the side 1 entries, bitmaps are on 53/0.
+        e->countSector = tracks[18].offsetInSectors;
+        e->countOffset = 0xDD + (track - 36);
+        e->mapSector = tracks[53].offsetInSectors;
+        e->mapOffset = 3 * (track - 36);
+        return true;
+      }
+      return false;
+    case DISK_BAM_1581:
+      // Tracks 1-40 are on 40/1 and 41-80 on 40/2.
+      e->countSector = e->mapSector = tracks[40].offsetInSectors + (track <= 40 ? 1 : 2);
+      e->countOffset = 0x10 + 6 * ((track - 1) % 40);
+      e->mapOffset = e->countOffset + 1;
+      return true;
+  }
+  return false;
+}
+
+static bool bamIsFree(emu_t* m, const BamEntry* e, unsigned sector) {
+  const byte_t* map = diskSectorData(m->diskdrive->mountedImageData, e->mapSector) + e->mapOffset;
+  return map[sector / 8] & (1 << (sector % 8));
+}
+
+static void bamSetFree(emu_t* m, unsigned track, unsigned sector, bool setFree) {
+  BamEntry e;
+  if (!bamLocate(m->diskdrive->index->format, track, &e))
+    return;
+  if (setFree == bamIsFree(m, &e, sector))
+    return;
+  byte_t* count = writableSector(m, e.countSector) + e.countOffset;
+  byte_t* map = writableSector(m, e.mapSector) + e.mapOffset;
+  byte_t bit = 1 << (sector % 8);
+  if (setFree) {
+    map[sector / 8] |= bit;
+    (*count)++;
+  } else {
+    map[sector / 8] &= ~bit;
+    (*count)--;
+  }
+}
+
+// Take the first free sector on a track, starting from the given sector and
+// stepping through it with the given interleave. Returns false if it's full.
+static bool allocateOnTrack(emu_t* m, unsigned track, unsigned* sector, unsigned interleave) {
+  const DiskFormat* format = m->diskdrive->index->format;
+  BamEntry e;
+  if (!bamLocate(format, track, &e))
+    return false;
+  unsigned count = format->tracks[track].sectorCount;
+  for (unsigned i=0; i < count; i++) {
+    unsigned s = (*sector + interleave + i) % count;
+    if (bamIsFree(m, &e, s)) {
+      bamSetFree(m, track, s, false);
+      *sector = s;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Allocate a sector for a file. Like the drive, it stays on the track of the
+// previous sector (if there is one) and otherwise takes the nearest track to
+// the directory that has room. Callers check there's room first (see
+// checkRoom).
+static unsigned allocateFileSector(emu_t* m, unsigned* track, unsigned* sector) {
+  const DiskFormat* format = m->diskdrive->index->format;
+  if (*track != 0 && allocateOnTrack(m, *track, sector, format->fileInterleave))
+    return linearSector(format, *track, *sector);
+  for (int dist=1; dist < (int)format->trackCount; dist++) {
+    int candidates[2] = { format->dirTrack - dist, format->dirTrack + dist };
+    for (int i=0; i < 2; i++) {
+      int t = candidates[i];
+      if (t < 1 || t > (int)format->trackCount)
+        continue;
+      unsigned s = 0;
+      if (allocateOnTrack(m, t, &s, 0)) {
+        *track = t;
+        *sector = s;
+        return linearSector(format, t, s);
+      }
+    }
+  }
+  fault(m, FAULT_DISK, "No free sector for a file.");
+}
+
+// Sectors a chain takes for len bytes of file data.
+static unsigned chainSectors(unsigned len) {
+  return len == 0 ? 1 : (len + SECTOR_SIZE - 3) / (SECTOR_SIZE - 2);
+}
+
+// Write data to a new sector chain. Returns the number of sectors used.
+static unsigned writeChain(emu_t* m, const byte_t* data, unsigned len,
+    byte_t* firstTrack, byte_t* firstSector) {
+  unsigned count = chainSectors(len);
+  unsigned track = 0, sector = 0;
+  byte_t* prev = NULL;
+  for (unsigned i=0; i < count; i++) {
+    unsigned n = allocateFileSector(m, &track, &sector);
+    byte_t* d = writableSector(m, n);
+    if (prev) {
+      prev[0] = track;
+      prev[1] = sector;
+    } else {
+      *firstTrack = track;
+      *firstSector = sector;
+    }
+    unsigned chunk = len < SECTOR_SIZE - 2 ? len : SECTOR_SIZE - 2;
+    memset(d, 0, SECTOR_SIZE);
+    memcpy(d + 2, data, chunk);
+    d[1] = chunk + 1; // index of the last byte, in case this is the last sector
+    data += chunk;
+    len -= chunk;
+    prev = d;
+  }
+  return count;
+}
+
+// Find an unused directory entry, adding a sector to the directory if it's
+// full.
+static byte_t* allocateDirEntry(emu_t* m) {
+  DiskIndex* index = getDiskIndex(m);
+  if (index->directoryStatus != DISK_CHAIN_OK)
+    fault(m, FAULT_DISK, "Directory is damaged (%s).",
+        DISK_CHAIN_STATUS_NAMES[index->directoryStatus]);
+  const DiskFormat* format = index->format;
+  unsigned track = format->dirTrack;
+  unsigned sector = format->dirSector;
   for (;;) {
-    if (nextTrack == 0)
+    unsigned n = linearSector(format, track, sector);
+    const byte_t* d = diskSectorData(m->diskdrive->mountedImageData, n);
+    for (unsigned e=0; e < DIRECTORY_ENTRIES_PER_SECTOR; e++) {
+      if (d[e * DIRECTORY_ENTRY_SIZE + 2] == 0)
+        return writableSector(m, n) + e * DIRECTORY_ENTRY_SIZE;
+    }
+    if (d[0] == 0)
       break;
-    if (nextTrack > MAX_TRACK_NUMBER)
-      error(m, "Track number out of range: %d", nextTrack);
-    unsigned secOff = trackAndSectorAddr(nextTrack, nextSector);
-    assert(secOff + SECTOR_SIZE <= m->diskdrive.mountedImageData->len);
-    nextTrack = d64[secOff];
-    nextSector = d64[secOff + 1];
-    for (
-        unsigned off = secOff;
-        off < secOff + SECTOR_SIZE;
-        off += DIRECTORY_ENTRY_SIZE
-        )
-    {
-      const byte_t* ent = &d64[off];
-      unsigned fileTrack = ent[3];
-      unsigned fileSector = ent[4];
-      if (fileTrack > 0) {
-
-        if (fileTrack > MAX_TRACK_NUMBER)
-          error(m, "Track number out of range: %d", fileTrack);
-        direntry_t* entry = &dir->entries[dir->entryCount];
-        unsigned filetypeByte = ent[2];
-        unsigned filetypeID = filetypeByte & 7; // 3 low bits
-        const char* filetypeName = getFiletypeName(m, filetypeID);
-        entry->filetypeID = filetypeID;
-        entry->flags = filetypeByte & (~7); // remove filetypeID
-        strcpy(entry->filetypeName, filetypeName);
-        // Read the filename. It is a 16-byte fixed-width field, and empty
-        // bytes are filled with 0xA0 (called a "shifted space", 0x20 | 0x80).
-        // We convert the padding characters to null bytes so that C code can
-        // work with the filename. This may clash with filenames that contain 0
-        // characters, but we won't worry about that. The filename is actually
-        // PETSCII, not ASCII, but we won't worry about that either.
-        for (int i=0; i < DISK_DIRECTORY_FILENAME_LEN; i++) {
-          byte_t c = ent[5+i];
-          if (c == 0xA0) // padding character
-            entry->filename[i] = 0;
-          else
-            entry->filename[i] = (char)c;
-        }
-        entry->filename[DISK_DIRECTORY_FILENAME_LEN] = 0;
-        entry->fileSizeInSectors = toWord(ent[0x1E], ent[0x1E + 1]);
-        entry->startTrack = fileTrack;
-        entry->startSector = fileSector;
-        if (filetypeID == FILETYPE_REL) {
-          entry->relSideTrack = ent[0x15];
-          entry->relSideSector = ent[0x15+1];
-          entry->relRecordLen = ent[0x17];
-        }
-        dir->entryCount++;
+    track = d[0];
+    sector = d[1];
+  }
+  unsigned newSector = sector;
+  if (!allocateOnTrack(m, format->dirTrack, &newSector, format->dirInterleave))
+    fault(m, FAULT_DISK, "No free directory sector.");
+  byte_t* last = writableSector(m, linearSector(format, track, sector));
+  last[0] = format->dirTrack;
+  last[1] = newSector;
+  byte_t* d = writableSector(m, linearSector(format, format->dirTrack, newSector));
+  memset(d, 0, SECTOR_SIZE);
+  d[1] = 0xFF;
+  return d;
+}
+
+// Free sectors on the tracks allocateFileSector takes sectors from.
+static unsigned freeFileSectors(emu_t* m) {
+  const DiskFormat* format = m->diskdrive->index->format;
+  unsigned count = 0;
+  for (unsigned t=1; t <= format->trackCount; t++) {
+    BamEntry e;
+    if (t == format->dirTrack || !bamLocate(format, t, &e))
+      continue;
+    for (unsigned s=0; s < format->tracks[t].sectorCount; s++)
+      count += bamIsFree(m, &e, s);
+  }
+  return count;
+}
+
+// Whether allocateDirEntry has an unused entry or a sector to add.
+static bool dirHasRoom(emu_t* m) {
+  const DiskFormat* format = m->diskdrive->index->format;
+  unsigned track = format->dirTrack;
+  unsigned sector = format->dirSector;
+  for (;;) {
+    const byte_t* d = diskSectorData(m->diskdrive->mountedImageData,
+        linearSector(format, track, sector));
+    for (unsigned e=0; e < DIRECTORY_ENTRIES_PER_SECTOR; e++) {
+      if (d[e * DIRECTORY_ENTRY_SIZE + 2] == 0)
+        return true;
+    }
+    if (d[0] == 0)
+      break;
+    track = d[0];
+    sector = d[1];
+  }
+  BamEntry e;
+  if (!bamLocate(format, format->dirTrack, &e))
+    return false;
+  for (unsigned s=0; s < format->tracks[format->dirTrack].sectorCount; s++) {
+    if (bamIsFree(m, &e, s))
+      return true;
+  }
+  return false;
+}
+
+// Check a new file of len bytes fits on the disk, counting the sectors and
+// directory entry of the file it replaces (or -1), and report DISK FULL if
+// it doesn't. Nothing is written then, so the disk is left as it was.
+static bool checkRoom(emu_t* m, unsigned len, int replaced) {
+  DiskIndex* index = getDiskIndex(m);
+  unsigned freeSectors = freeFileSectors(m);
+  if (replaced >= 0) {
+    const DiskFileEntry* f = &index->files[replaced];
+    for (unsigned i=0; i < f->chainLength; i++) {
+      unsigned track, sector;
+      BamEntry e;
+      sectorTrackAndSector(index->format, index->chains[f->chainStart + i], &track, &sector);
+      if (track != index->format->dirTrack && bamLocate(index->format, track, &e))
+        freeSectors++;
+    }
+  }
+  if (chainSectors(len) <= freeSectors && (replaced >= 0 || dirHasRoom(m)))
+    return true;
+  driveError(m, DOS_DISK_FULL);
+  return false;
+}
 
+static void writeDirEntryName(byte_t* ent, const byte_t* name, unsigned nameLen) {
+  memset(ent + 5, 0xA0, DISK_FILENAME_LEN);
+  memcpy(ent + 5, name, nameLen < DISK_FILENAME_LEN ? nameLen : DISK_FILENAME_LEN);
+}
+
+static void createFile(emu_t* m, const byte_t* name, unsigned nameLen,
+    unsigned filetypeID, const byte_t* data, unsigned len) {
+  byte_t* ent = allocateDirEntry(m);
+  byte_t track = 0, sector = 0;
+  unsigned blocks = writeChain(m, data, len, &track, &sector);
+  // The first two bytes of the first entry are the directory link.
+  memset(ent + 2, 0, DIRECTORY_ENTRY_SIZE - 2);
+  ent[2] = filetypeID | DIRENTRY_FLAG_CLOSED;
+  ent[3] = track;
+  ent[4] = sector;
+  writeDirEntryName(ent, name, nameLen);
+  ent[0x1E] = toLo(blocks);
+  ent[0x1E + 1] = toHi(blocks);
+}
+
+// Remove a file from the directory and free its sectors. Side sectors of REL
+// files aren't indexed, so they're left allocated.
+static void scratchFile(emu_t* m, unsigned fileIndex) {
+  DiskIndex* index = getDiskIndex(m);
+  const DiskFileEntry* f = &index->files[fileIndex];
+  for (unsigned i=0; i < f->chainLength; i++) {
+    unsigned track, sector;
+    sectorTrackAndSector(index->format, index->chains[f->chainStart + i], &track, &sector);
+    bamSetFree(m, track, sector, true);
+  }
+  writableSector(m, f->dirSector)[f->dirEntry * DIRECTORY_ENTRY_SIZE + 2] = 0;
+}
+
+// Rebuild the index after the directory or a chain has changed. Channels
+// reading files are moved over to the new index by directory position.
+static void rebuildDiskIndex(emu_t* m) {
+  DiskDrive* d = m->diskdrive;
+  DiskIndex* old = d->index;
+  DiskIndex* index = buildDiskIndex(d->mountedImageData, old->format);
+  if (!index)
+    fault(m, FAULT_OUT_OF_MEMORY, "Out of memory indexing disk.");
+  for (int b=0; b < DISKDRIVE_BUFFER_COUNT; b++) {
+    int fileIndex = d->diskBufferFiles[b];
+    if (fileIndex < 0)
+      continue;
+    const DiskFileEntry* f = &old->files[fileIndex];
+    d->diskBufferFiles[b] = DISK_FILE_NOT_FOUND;
+    for (unsigned i=0; i < index->fileCount; i++) {
+      const DiskFileEntry* g = &index->files[i];
+      if (g->dirSector == f->dirSector && g->dirEntry == f->dirEntry
+          && g->startTrack == f->startTrack && g->startSector == f->startSector) {
+        d->diskBufferFiles[b] = i;
+        break;
       }
     }
   }
+  d->index = index;
+  destroyDiskIndex(old);
 }
 
-buf_t* readFileFromDiskImage(buf_t* disk, unsigned startTrack, unsigned startSector) {
-  byte_t* d = disk->data;
-  buf_t* file = bufCreate();
-  unsigned blockAddr = trackAndSectorAddr(startTrack, startSector);
-  // The track/sector of the next sector in the chain is stored in the first
-  // two bytes of each sector.
-  unsigned nextBlockTrack = d[blockAddr];
-  unsigned nextBlockSector = d[blockAddr+1];
-  while (nextBlockTrack > 0) {
-    blockAddr = trackAndSectorAddr(nextBlockTrack, nextBlockSector);
-    nextBlockTrack = d[blockAddr];
-    nextBlockSector = d[blockAddr+1];
-    size_t bytesInSector;
-    if (nextBlockTrack == 0) {
-      // In the last block in the chain, the "sector number" is really the
-      // number of bytes in this sector that are actually part of the file.
-      bytesInSector = nextBlockSector;
-    } else {
-      // Otherwise, read the entire sector.
-      bytesInSector = SECTOR_SIZE;
+static void freeWriteFile(DiskWriteFile* w) {
+  if (!w)
+    return;
+  bufDestroy(w->data);
+  free(w);
+}
+
+// Put a file written on a channel onto the disk. Like the drive, an existing
+// file is only replaced if the name had an "@" prefix.
+static void commitWriteFile(emu_t* m, DiskWriteFile* w) {
+  DiskIndex* index = getDiskIndex(m);
+  int existing = findDiskFile(index, w->name, w->nameLen);
+  if (w->append) {
+    if (existing < 0) {
+      romTrace(m, "ROM/disk: append to missing file, data dropped.");
+      return;
+    }
+    unsigned filetypeID = index->files[existing].filetypeID;
+    buf_t* data = readDiskFile(m->diskdrive->mountedImageData, index, existing);
+    bufEnsureExtraCap(data, w->data->len);
+    memcpy(data->data + data->len, w->data->data, w->data->len);
+    data->len += w->data->len;
+    if (!checkRoom(m, data->len, existing)) {
+      bufDestroy(data);
+      return;
+    }
+    scratchFile(m, existing);
+    createFile(m, w->name, w->nameLen, filetypeID, data->data, data->len);
+    bufDestroy(data);
+  } else {
+    if (existing >= 0 && !w->replace) {
+      romTrace(m, "ROM/disk: file exists, data dropped.");
+      return;
     }
-    bufEnsureExtraCap(file, bytesInSector-2);
-    memcpy(file->data + file->len, d + blockAddr, bytesInSector-2);
+    if (!checkRoom(m, w->data->len, existing))
+      return;
+    if (existing >= 0)
+      scratchFile(m, existing);
+    createFile(m, w->name, w->nameLen, w->filetypeID, w->data->data, w->data->len);
   }
-  return file;
+  rebuildDiskIndex(m);
+}
+
+// Command arguments for SCRATCH, RENAME and COPY start with a colon.
+static bool skipColon(const byte_t** args, unsigned* len) {
+  if (*len == 0 || **args != ':')
+    return false;
+  (*args)++;
+  (*len)--;
+  return true;
+}
+
+// Split "new=old" arguments at the "=".
+static bool splitAssignment(const byte_t* args, unsigned len, unsigned* eq) {
+  for (*eq=0; *eq < len; (*eq)++) {
+    if (args[*eq] == '=')
+      return true;
+  }
+  return false;
+}
+
+// S:pattern[,pattern...]
+static void diskScratch(emu_t* m, const byte_t* args, unsigned len) {
+  if (!skipColon(&args, &len))
+    fault(m, FAULT_DISK, "SCRATCH: filename expected.");
+  getDiskIndex(m); // fault if there's no disk
+  if (!checkWritable(m))
+    return;
+  unsigned count = 0;
+  unsigned p = 0;
+  while (p < len) {
+    unsigned start, end;
+    parseFilename(args + p, len - p, &start, &end);
+    DiskIndex* index = getDiskIndex(m);
+    for (unsigned i=0; i < index->fileCount; i++) {
+      if (matchFilename(index->files[i].name, args + p + start, end - start)) {
+        scratchFile(m, i);
+        count++;
+      }
+    }
+    rebuildDiskIndex(m);
+    p += end + 1;
+  }
+  romTrace(m, "ROM/disk: %u files scratched.", count);
+}
+
+// R:newname=oldname
+static void diskRename(emu_t* m, const byte_t* args, unsigned len) {
+  unsigned eq;
+  if (!skipColon(&args, &len) || !splitAssignment(args, len, &eq))
+    fault(m, FAULT_DISK, "RENAME: invalid arguments.");
+  unsigned start, end;
+  parseFilename(args + eq + 1, len - eq - 1, &start, &end);
+  DiskIndex* index = getDiskIndex(m);
+  int fileIndex = findDiskFile(index, args + eq + 1 + start, end - start);
+  if (fileIndex < 0) {
+    romTrace(m, "ROM/disk: RENAME file not found.");
+    return;
+  }
+  if (findDiskFile(index, args, eq) >= 0) {
+    romTrace(m, "ROM/disk: RENAME file exists.");
+    return;
+  }
+  if (!checkWritable(m))
+    return;
+  const DiskFileEntry* f = &index->files[fileIndex];
+  byte_t* ent = writableSector(m, f->dirSector) + f->dirEntry * DIRECTORY_ENTRY_SIZE;
+  writeDirEntryName(ent, args, eq);
+  rebuildDiskIndex(m);
+}
+
+// C:newfile=file1[,file2...]
+// With more than one source file the new file is their concatenation.
+static void diskCopy(emu_t* m, const byte_t* args, unsigned len) {
+  unsigned eq;
+  if (!skipColon(&args, &len) || !splitAssignment(args, len, &eq))
+    fault(m, FAULT_DISK, "COPY: invalid arguments.");
+  DiskIndex* index = getDiskIndex(m);
+  if (findDiskFile(index, args, eq) >= 0) {
+    romTrace(m, "ROM/disk: COPY file exists.");
+    return;
+  }
+  buf_t* data = bufCreate();
+  unsigned filetypeID = FILETYPE_SEQ;
+  for (unsigned p = eq + 1; p < len; ) {
+    unsigned start, end;
+    parseFilename(args + p, len - p, &start, &end);
+    int fileIndex = findDiskFile(index, args + p + start, end - start);
+    if (fileIndex < 0) {
+      romTrace(m, "ROM/disk: COPY file not found.");
+      bufDestroy(data);
+      return;
+    }
+    if (p == eq + 1)
+      filetypeID = index->files[fileIndex].filetypeID;
+    buf_t* part = readDiskFile(m->diskdrive->mountedImageData, index, fileIndex);
+    bufEnsureExtraCap(data, part->len);
+    memcpy(data->data + data->len, part->data, part->len);
+    data->len += part->len;
+    bufDestroy(part);
+    p += end + 1;
+  }
+  if (!checkWritable(m) || !checkRoom(m, data->len, -1)) {
+    bufDestroy(data);
+    return;
+  }
+  createFile(m, args, eq, filetypeID, data->data, data->len);
+  bufDestroy(data);
+  rebuildDiskIndex(m);
+}
+
+// U2 and B-W: write a channel's buffer to a sector. B-W first stores the
+// buffer pointer in byte 0, which is how it records how much data there is.
+static void diskWriteBlock(emu_t* m, unsigned channel, unsigned drive,
+    unsigned track, unsigned sector, bool storePointer) {
+  unsigned bufferID = getChannelBufferID(m, channel);
+  if (drive != 0)
+    fault(m, FAULT_DISK, "Only one drive is supported.");
+  int n = linearSector(getDiskIndex(m)->format, track, sector);
+  if (n < 0)
+    fault(m, FAULT_DISK, "Track/sector out of range: %d/%d", track, sector);
+  if (!checkWritable(m))
+    return;
+  DiskDrive* d = m->diskdrive;
+  if (storePointer)
+    d->diskBuffers[bufferID][0] = d->diskBufferPointers[bufferID];
+  memcpy(writableSector(m, n), d->diskBuffers[bufferID], SECTOR_SIZE);
+  rebuildDiskIndex(m);
+  romTrace(m, "ROM/disk: wrote buffer %d to TS $%02X:%02X.", bufferID, track, sector);
+}
+
+// B-A and B-F: mark a sector used or free in the BAM.
+static void diskAllocateBlock(emu_t* m, unsigned drive, unsigned track,
+    unsigned sector, bool setFree) {
+  if (drive != 0)
+    fault(m, FAULT_DISK, "Only one drive is supported.");
+  BamEntry e;
+  const DiskFormat* format = getDiskIndex(m)->format;
+  if (!bamLocate(format, track, &e) || linearSector(format, track, sector) < 0)
+    fault(m, FAULT_DISK, "Track/sector out of range: %d/%d", track, sector);
+  if (checkWritable(m))
+    bamSetFree(m, track, sector, setFree);
+}
+
+// Write the sectors that changed since the last flush back to the image file,
+// if the mount writes back on CLOSE. In the other modes it does nothing.
+static bool flushDisk(emu_t* m) {
+  DiskDrive* d = m->diskdrive;
+  if (d->writeMode != DISK_WRITE_ON_CLOSE || d->dirtyCount == 0)
+    return true;
+  int fd = open(d->mountedImagePath, O_WRONLY);
+  if (fd < 0) {
+    setFault(m, FAULT_DISK, "Unable to open disk image for writing: %s", d->mountedImagePath);
+    return false;
+  }
+  // Sectors that fail to write stay dirty, to be tried again.
+  bool ok = true;
+  for (unsigned n=0; n < d->index->sectorCount; n++) {
+    if (!d->dirtySectors[n])
+      continue;
+    off_t offset = (off_t)n * SECTOR_SIZE;
+    if (pwrite(fd, d->writableImage->data + offset, SECTOR_SIZE, offset) != SECTOR_SIZE) {
+      ok = false;
+      continue;
+    }
+    d->dirtySectors[n] = 0;
+    d->dirtyCount--;
+  }
+  if (close(fd) != 0)
+    ok = false;
+  if (!ok)
+    setFault(m, FAULT_DISK, "Unable to write disk image: %s", d->mountedImagePath);
+  return ok;
+}
+
+// Replace the image file with the modified image. The image is written to a
+// temporary file next to it which is then renamed over it, so the file is
+// never left half written.
+static bool replaceImageFile(emu_t* m) {
+  DiskDrive* d = m->diskdrive;
+  const char* path = d->mountedImagePath;
+  size_t tmpPathSize = strlen(path) + sizeof(".XXXXXX");
+  char* tmpPath = malloc(tmpPathSize);
+  if (!tmpPath) {
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory.");
+    return false;
+  }
+  snprintf(tmpPath, tmpPathSize, "%s.XXXXXX", path);
+  int fd = mkstemp(tmpPath);
+  if (fd < 0) {
+    setFault(m, FAULT_DISK, "Unable to create temporary file for: %s", path);
+    free(tmpPath);
+    return false;
+  }
+  bool ok = true;
+  struct stat st;
+  if (stat(path, &st) == 0 && fchmod(fd, st.st_mode & 07777) != 0)
+    ok = false;
+  const buf_t* image = d->writableImage;
+  if (write(fd, image->data, image->len) != (ssize_t)image->len)
+    ok = false;
+  if (fsync(fd) != 0)
+    ok = false;
+  if (close(fd) != 0)
+    ok = false;
+  if (ok && rename(tmpPath, path) != 0)
+    ok = false;
+  if (!ok) {
+    unlink(tmpPath);
+    setFault(m, FAULT_DISK, "Unable to write disk image: %s", path);
+  }
+  free(tmpPath);
+  return ok;
+}
+
+// Unmount the current drive's disk, first writing it back if the mount mode
+// asks for that. Files still open for writing are lost, as if the disk were
+// pulled out.
+static bool unmountImage(emu_t* m) {
+  DiskDrive* d = m->diskdrive;
+  if (!d->mountedImageData)
+    return true;
+  bool ok = true;
+  if (d->writeMode == DISK_WRITE_ON_CLOSE)
+    ok = flushDisk(m);
+  else if (d->writeMode == DISK_WRITE_AT_EXIT && d->dirtyCount > 0)
+    ok = replaceImageFile(m);
+  for (int i=0; i < DISKDRIVE_BUFFER_COUNT; i++) {
+    freeWriteFile(d->diskBufferWrites[i]);
+    d->diskBufferWrites[i] = NULL;
+    if (d->diskBufferFiles[i] >= 0)
+      d->diskBufferFiles[i] = DISK_FILE_NOT_FOUND;
+  }
+  destroyDiskIndex(d->index);
+  closeG64(d->g64);
+  d->g64 = NULL;
+  if (d->writableImage)
+    bufDestroy(d->writableImage);
+  free(d->dirtySectors);
+  d->index = NULL;
+  d->writableImage = NULL;
+  d->dirtySectors = NULL;
+  d->dirtyCount = 0;
+  d->mountedImagePath = NULL;
+  d->mountedImageData = NULL;
+  d->writeMode = DISK_WRITE_PROTECTED;
+  driveDiskChanged(d);
+  return ok;
+}
+
+// Mount a G64 image. Only the tracks with the directory and files are decoded
+// now, the rest when they're read. There's no writing GCR back, so the image
+// is always write protected.
+static bool mountG64(emu_t* m, const char* path, const buf_t* file, int writeMode) {
+  if (writeMode != DISK_WRITE_PROTECTED) {
+    setFault(m, FAULT_UNSUPPORTED, "G64 images can only be mounted write protected: %s", path);
+    return false;
+  }
+  G64Image* g = openG64(file);
+  if (!g) {
+    setFault(m, FAULT_DISK, "Invalid G64 image: %s", path);
+    return false;
+  }
+  if (!unmountImage(m)) {
+    closeG64(g);
+    return false;
+  }
+  g64DecodeFiles(g);
+  DiskIndex* index = buildDiskIndex(g->image, g->format);
+  if (!index) {
+    closeG64(g);
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory mounting disk: %s", path);
+    return false;
+  }
+  DiskDrive* d = m->diskdrive;
+  d->index = index;
+  d->g64 = g;
+  d->mountCount++;
+  d->mountedImagePath = path;
+  d->mountedImageData = g->image;
+  d->writeMode = DISK_WRITE_PROTECTED;
+  driveDiskChanged(d);
+  return true;
+}
+
+// Mount a disk image in the current drive. The directory and file chains are
+// indexed once here so that nothing after this has to walk the disk. Unless
+// the mount is write protected, the image is copied so that it can be
+// modified; diskData itself is never written to.
+static bool mountImage(emu_t* m, const char* path, buf_t* diskData, int writeMode) {
+  assert(writeMode >= 0 && writeMode < DISK_WRITE_MODE_COUNT);
+  if (isG64(diskData))
+    return mountG64(m, path, diskData, writeMode);
+  if (!checkDiskSize(m, diskData))
+    return false;
+  if (!unmountImage(m))
+    return false;
+  const DiskFormat* format = diskFormatForSize(diskData->len, NULL);
+  const buf_t* image = diskData;
+  buf_t* writable = NULL;
+  byte_t* dirty = NULL;
+  if (writeMode != DISK_WRITE_PROTECTED) {
+    writable = bufCreate();
+    bufEnsureCap(writable, diskData->len);
+    memcpy(writable->data, diskData->data, diskData->len);
+    writable->len = diskData->len;
+    dirty = calloc(format->sectorCount, 1);
+    image = writable;
+  }
+  DiskIndex* index = buildDiskIndex(image, format);
+  if (!index || (writable && !dirty)) {
+    destroyDiskIndex(index);
+    if (writable)
+      bufDestroy(writable);
+    free(dirty);
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory mounting disk: %s", path);
+    return false;
+  }
+  DiskDrive* d = m->diskdrive;
+  d->index = index;
+  d->mountCount++;
+  d->mountedImagePath = path;
+  d->mountedImageData = image;
+  d->writeMode = writeMode;
+  d->writableImage = writable;
+  d->dirtySectors = dirty;
+  d->dirtyCount = 0;
+  driveDiskChanged(d);
+  return true;
+}
+
+// The drive for a device number, or NULL if it isn't one of the drives.
+static DiskDrive* driveForDevice(emu_t* m, unsigned device) {
+  if (!IS_DISK_DEVICE(device))
+    return NULL;
+  return m->diskdrives[device - DISKDRIVE_FIRST_DEVICE];
+}
+
+// Make a device's drive the one the disk calls work on. Every call from the
+// KERNAL starts with this, using the device it addressed.
+static DiskDrive* selectDrive(emu_t* m, unsigned device) {
+  DiskDrive* d = driveForDevice(m, device);
+  if (!d)
+    fault(m, FAULT_UNSUPPORTED, "No disk drive on device %u.", device);
+  m->diskdrive = d;
+  return d;
+}
+
+// Each drive has its own disk, so several can be mounted at once. Mounting
+// doesn't change which drive the KERNAL calls are working with.
+bool mountDiskWritable(emu_t* m, unsigned device, const char* path, buf_t* diskData,
+    int writeMode) {
+  DiskDrive* d = driveForDevice(m, device);
+  if (!d) {
+    setFault(m, FAULT_DISK, "No disk drive on device %u.", device);
+    return false;
+  }
+  DiskDrive* current = m->diskdrive;
+  m->diskdrive = d;
+  bool ok = mountImage(m, path, diskData, writeMode);
+  m->diskdrive = current;
+  return ok;
+}
+
+bool unmountDisk(emu_t* m, unsigned device) {
+  DiskDrive* d = driveForDevice(m, device);
+  if (!d) {
+    setFault(m, FAULT_DISK, "No disk drive on device %u.", device);
+    return false;
+  }
+  DiskDrive* current = m->diskdrive;
+  m->diskdrive = d;
+  bool ok = unmountImage(m);
+  m->diskdrive = current;
+  return ok;
+}
+
+//|---------------|
+//| DISK SWAPPING |
+//|---------------|
+
+const char* DISK_SWAP_TRIGGER_NAMES[] = {
+  "pc",
+  "ic",
+  "missing",
+};
+
+static DiskSwap* pendingSwap(DiskDrive* d, int trigger) {
+  if (d->nextSwap >= d->swapCount || d->swaps[d->nextSwap].trigger != trigger)
+    return NULL;
+  return &d->swaps[d->nextSwap];
+}
+
+// Put the next disk from a drive's list in the drive, in place of the one
+// that's there. The new disk is mounted the same way as the old one.
+static void swapDisk(emu_t* m, DiskDrive* d) {
+  DiskSwap* s = &d->swaps[d->nextSwap++];
+  int writeMode = d->writeMode;
+  DiskDrive* current = m->diskdrive;
+  m->diskdrive = d;
+  romTrace(m, "ROM/disk: swap in %s (%s) [IC=" IC_FMT "]",
+      s->path, DISK_SWAP_TRIGGER_NAMES[s->trigger], m->reg.ic);
+  bool ok = mountImage(m, s->path, s->data, writeMode);
+  m->diskdrive = current;
+  if (!ok) {
+    char message[FAULT_MESSAGE_SIZE];
+    snprintf(message, sizeof(message), "%s", m->fault.message);
+    fault(m, m->fault.code, "Disk swap failed: %s", message);
+  }
+  // The next disk in the list may be due at an IC.
+  scheduleNextEvent(m);
+}
+
+// A file or sector wasn't found on the current drive's disk. Swap in the next
+// disk if that's what the list says to do, and return true so that the
+// caller looks again.
+static bool swapOnMissing(emu_t* m) {
+  if (!pendingSwap(m->diskdrive, DISK_SWAP_ON_MISSING))
+    return false;
+  swapDisk(m, m->diskdrive);
+  return true;
+}
+
+static void diskSwapHook(emu_t* m, int pc, ExecutionHook* hook) {
+  (void)pc;
+  DiskDrive* d = hook->privateData;
+  if (pendingSwap(d, DISK_SWAP_AT_PC) && d->nextSwap == (unsigned)(hook->hookID & 0xFF))
+    swapDisk(m, d);
+}
+
+// The earliest IC at which a drive is due to swap disks, or UINT64_MAX.
+uint64_t diskNextSwapIC(emu_t* m) {
+  uint64_t next = UINT64_MAX;
+  for (int i=0; i < DISKDRIVE_COUNT; i++) {
+    DiskSwap* s = pendingSwap(m->diskdrives[i], DISK_SWAP_AT_IC);
+    if (s && s->value < next)
+      next = s->value;
+  }
+  return next;
+}
+
+void diskRunSwapsAtIC(emu_t* m) {
+  for (int i=0; i < DISKDRIVE_COUNT; i++) {
+    DiskDrive* d = m->diskdrives[i];
+    DiskSwap* s;
+    while ((s = pendingSwap(d, DISK_SWAP_AT_IC)) && s->value <= m->reg.ic)
+      swapDisk(m, d);
+  }
+}
+
+// Add a disk to the end of a drive's swap list. Each drive goes through its
+// list in order, so a disk's trigger only counts once the disks before it
+// have been swapped in. Swapping doesn't touch RAM or registers, so a
+// multi-disk program can run in one go.
+bool addDiskSwap(emu_t* m, unsigned device, int trigger, uint64_t value,
+    const char* path, buf_t* data) {
+  assert(trigger >= 0 && trigger < DISK_SWAP_TRIGGER_COUNT);
+  DiskDrive* d = driveForDevice(m, device);
+  if (!d) {
+    setFault(m, FAULT_DISK, "No disk drive on device %u.", device);
+    return false;
+  }
+  if (trigger == DISK_SWAP_AT_PC && value >= RAM_SIZE) {
+    setFault(m, FAULT_DISK, "Disk swap address out of range: %llX",
+        (unsigned long long)value);
+    return false;
+  }
+  // A swap at a PC is found again by the low byte of its hook ID.
+  if (trigger == DISK_SWAP_AT_PC && d->swapCount > 0xFF) {
+    setFault(m, FAULT_DISK, "Too many disk swaps on device %u.", device);
+    return false;
+  }
+  DiskSwap* swaps = realloc(d->swaps, (d->swapCount + 1) * sizeof(DiskSwap));
+  if (!swaps) {
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory adding disk swap.");
+    return false;
+  }
+  d->swaps = swaps;
+  unsigned index = d->swapCount++;
+  swaps[index] = (DiskSwap){ trigger, value, path, data };
+  if (trigger == DISK_SWAP_AT_PC) {
+    ExecutionHook hook = { 0 };
+    hook.pcHookAddress = value;
+    hook.hookType = HOOKTYPE_EXEC;
+    hook.hookID = device << 8 | index; // unique among the swap hooks
+    hook.name = "disk swap";
+    hook.callback = diskSwapHook;
+    hook.privateData = d;
+    if (!registerHook(m, &hook))
+      return false;
+  }
+  return true;
 }
 
 void diskSECOND(emu_t* m, byte_t second) {
-  assert(RAM[RAM_FA] >= 8);
-  m->diskdrive.secondAddress = second;
+  selectDrive(m, RAM[RAM_FA])->secondAddress = second;
 }
 
 void diskTKSA(emu_t* m, byte_t second) {
-  assert(RAM[RAM_FA] >= 8);
-  m->diskdrive.secondAddress = second;
+  selectDrive(m, RAM[RAM_FA])->secondAddress = second;
+}
+
+// Load the current sector of a file into the buffer it was opened on.
+static void diskLoadFileSector(DiskDrive* d, unsigned bufferID) {
+  const DiskFileEntry* f = &d->index->files[d->diskBufferFiles[bufferID]];
+  unsigned pos = d->diskBufferChainPos[bufferID];
+  const byte_t* data = diskSectorData(d->mountedImageData, d->index->chains[f->chainStart + pos]);
+  memcpy(d->diskBuffers[bufferID], data, SECTOR_SIZE);
+  d->diskBufferPointers[bufferID] = 2;
+  d->diskBufferDataEnd[bufferID] = data[0] != 0 ? SECTOR_SIZE - 1 : data[1];
+}
+
+// Read the next byte of a file opened by name, following its chain through
+// the index. Sets EOI in the status on the last byte, and EOI + timeout when
+// reading past the end (or from a file that wasn't found), like the drive.
+static byte_t diskReadFileByte(emu_t* m, unsigned bufferID) {
+  DiskDrive* d = m->diskdrive;
+  int fileIndex = d->diskBufferFiles[bufferID];
+  unsigned ptr = d->diskBufferPointers[bufferID];
+  if (fileIndex == DISK_FILE_NOT_FOUND
+      || d->diskBufferChainPos[bufferID] >= d->index->files[fileIndex].chainLength
+      || ptr > d->diskBufferDataEnd[bufferID]) {
+    RAM[RAM_STATUS] |= 0x42;
+    return 0x0D;
+  }
+  const DiskFileEntry* f = &d->index->files[fileIndex];
+  byte_t c = d->diskBuffers[bufferID][ptr];
+  diskLogAccess(m, DISK_ACCESS_CHANNEL,
+      d->index->chains[f->chainStart + d->diskBufferChainPos[bufferID]], bufferID, 1);
+  if (ptr < d->diskBufferDataEnd[bufferID]) {
+    d->diskBufferPointers[bufferID]++;
+  } else if (d->diskBufferChainPos[bufferID] + 1u < f->chainLength) {
+    d->diskBufferChainPos[bufferID]++;
+    diskLoadFileSector(d, bufferID);
+  } else {
+    d->diskBufferChainPos[bufferID] = f->chainLength;
+    RAM[RAM_STATUS] |= 0x40; // EOI
+  }
+  return c;
 }
 
 byte_t diskACPTR(emu_t* m) {
-  assert(RAM[RAM_FA] >= 8);
-  unsigned channel = m->diskdrive.secondAddress & 0x0F;
+  selectDrive(m, RAM[RAM_FA]);
+  unsigned channel = m->diskdrive->secondAddress & 0x0F;
   romTrace(m, "ROM/disk: ACPTR [channel=%02X]", channel);
   byte_t responseByte;
   if (channel == 15) {
-    responseByte = m->diskdrive.commandRecv;
+    DiskDrive* d = m->diskdrive;
+    if (d->statusPos < d->statusLen) {
+      responseByte = d->status[d->statusPos++];
+      if (d->statusPos == d->statusLen) {
+        d->statusLen = 0;
+        RAM[RAM_STATUS] |= 0x40; // EOI
+      }
+    } else {
+      responseByte = d->commandRecv;
+    }
   } else {
     unsigned bufferID = getChannelBufferID(m, channel);
-    //if (m->diskdrive.readBufferNxt >= m->diskdrive.readBufferLen)
-    //  error(m, "ACPTR on disk drive: no data available in buffer.");
-    responseByte = m->diskdrive.diskBuffers[bufferID][m->diskdrive.diskBufferPointers[bufferID]];
-    m->diskdrive.diskBufferPointers[bufferID]++;
+    if (m->diskdrive->diskBufferFiles[bufferID] != DISK_FILE_NONE)
+      return diskReadFileByte(m, bufferID);
+    //if (m->diskdrive->readBufferNxt >= m->diskdrive->readBufferLen)
+    //  fault(m, FAULT_DISK, "ACPTR on disk drive: no data available in buffer.");
+    responseByte = m->diskdrive->diskBuffers[bufferID][m->diskdrive->diskBufferPointers[bufferID]];
+    int sector = m->diskdrive->diskBufferSectors[bufferID];
+    if (sector >= 0)
+      diskLogAccess(m, DISK_ACCESS_CHANNEL, sector, bufferID, 1);
+    m->diskdrive->diskBufferPointers[bufferID]++;
   }
   return responseByte;
 }
 
+// Data sent to a channel that has a buffer: a file being written, or a
+// buffer opened with "#" (filled at the buffer pointer).
+static void diskWriteChannelByte(emu_t* m, unsigned bufferID, byte_t data) {
+  DiskDrive* d = m->diskdrive;
+  DiskWriteFile* w = d->diskBufferWrites[bufferID];
+  if (w)
+    bufAppendChar(w->data, data);
+  else if (d->diskBufferFiles[bufferID] == DISK_FILE_NONE)
+    d->diskBuffers[bufferID][d->diskBufferPointers[bufferID]++] = data;
+  else
+    romTrace(m, "ROM/disk: write to a channel open for reading ignored.");
+}
+
 void diskCIOUT(emu_t* m, byte_t data) {
-  assert(RAM[RAM_FA] >= 8);
-  if (m->diskdrive.commandBufferPointer == DISKDRIVE_COMMAND_BUFFER_SIZE)
-    error(m, "Disk drive command buffer is full.");
-  m->diskdrive.commandBuffer[m->diskdrive.commandBufferPointer++] = data;
+  DiskDrive* d = selectDrive(m, RAM[RAM_FA]);
+  if ((d->secondAddress & 0xF0) == 0x60) {
+    int bufferID = findChannelBuffer(d, d->secondAddress & 0x0F);
+    if (bufferID >= 0) {
+      diskWriteChannelByte(m, bufferID, data);
+      return;
+    }
+  }
+  if (m->diskdrive->commandBufferPointer == DISKDRIVE_COMMAND_BUFFER_SIZE)
+    fault(m, FAULT_DISK, "Disk drive command buffer is full.");
+  m->diskdrive->commandBuffer[m->diskdrive->commandBufferPointer++] = data;
+}
+
+// Read len bytes from the talking channel, the same as that many ACPTR calls
+// would, but a run at a time. Stops after a byte that changes the status (at
+// the end of a file), and before anything ACPTR has to do itself, and returns
+// how many bytes it read.
+unsigned diskACPTRBlock(emu_t* m, byte_t* dest, unsigned len) {
+  DiskDrive* d = selectDrive(m, RAM[RAM_FA]);
+  unsigned channel = d->secondAddress & 0x0F;
+  if (channel == 15) {
+    if (d->statusLen > 0)
+      return 0; // ACPTR reads the status
+    memset(dest, d->commandRecv, len);
+    return len;
+  }
+  unsigned bufferID = getChannelBufferID(m, channel);
+  unsigned n = 0;
+  if (d->diskBufferFiles[bufferID] == DISK_FILE_NONE) {
+    // The buffer pointer wraps around, as it does on the drive.
+    while (n < len) {
+      unsigned ptr = d->diskBufferPointers[bufferID];
+      unsigned run = SECTOR_SIZE - ptr < len - n ? SECTOR_SIZE - ptr : len - n;
+      memcpy(dest + n, &d->diskBuffers[bufferID][ptr], run);
+      d->diskBufferPointers[bufferID] = ptr + run;
+      if (d->diskBufferSectors[bufferID] >= 0)
+        diskLogAccess(m, DISK_ACCESS_CHANNEL, d->diskBufferSectors[bufferID], bufferID, run);
+      n += run;
+    }
+    return n;
+  }
+  while (n < len) {
+    int fileIndex = d->diskBufferFiles[bufferID];
+    if (fileIndex == DISK_FILE_NOT_FOUND
+        || d->diskBufferChainPos[bufferID] >= d->index->files[fileIndex].chainLength)
+      break;
+    const DiskFileEntry* f = &d->index->files[fileIndex];
+    unsigned ptr = d->diskBufferPointers[bufferID];
+    unsigned end = d->diskBufferDataEnd[bufferID];
+    if (ptr > end)
+      break;
+    // Copy up to the sector's last byte, and read that one on its own since
+    // it moves on to the next sector or ends the file.
+    unsigned run = end - ptr < len - n ? end - ptr : len - n;
+    if (run > 0) {
+      memcpy(dest + n, &d->diskBuffers[bufferID][ptr], run);
+      d->diskBufferPointers[bufferID] = ptr + run;
+      diskLogAccess(m, DISK_ACCESS_CHANNEL,
+          d->index->chains[f->chainStart + d->diskBufferChainPos[bufferID]], bufferID, run);
+      n += run;
+    }
+    if (n < len) {
+      byte_t status = RAM[RAM_STATUS];
+      dest[n++] = diskReadFileByte(m, bufferID);
+      if (RAM[RAM_STATUS] != status)
+        break;
+    }
+  }
+  return n;
+}
+
+// Send len bytes to the listening channel, the same as that many CIOUT calls.
+void diskCIOUTBlock(emu_t* m, const byte_t* src, unsigned len) {
+  DiskDrive* d = selectDrive(m, RAM[RAM_FA]);
+  int bufferID = (d->secondAddress & 0xF0) == 0x60
+      ? findChannelBuffer(d, d->secondAddress & 0x0F) : -1;
+  if (bufferID >= 0 && d->diskBufferWrites[bufferID]) {
+    buf_t* data = d->diskBufferWrites[bufferID]->data;
+    bufEnsureExtraCap(data, len);
+    memcpy(data->data + data->len, src, len);
+    data->len += len;
+  } else if (bufferID >= 0 && d->diskBufferFiles[bufferID] == DISK_FILE_NONE) {
+    for (unsigned n=0; n < len; ) {
+      unsigned ptr = d->diskBufferPointers[bufferID];
+      unsigned run = SECTOR_SIZE - ptr < len - n ? SECTOR_SIZE - ptr : len - n;
+      memcpy(&d->diskBuffers[bufferID][ptr], src + n, run);
+      d->diskBufferPointers[bufferID] = ptr + run;
+      n += run;
+    }
+  } else {
+    for (unsigned i=0; i < len; i++)
+      diskCIOUT(m, src[i]);
+  }
+}
+
+static int allocateBuffer(emu_t* m) {
+  for (int i=0; i < DISKDRIVE_BUFFER_COUNT; i++) {
+    if (m->diskdrive->diskBufferChannels[i] == DISK_CHANNEL_NONE)
+      return i;
+  }
+  fault(m, FAULT_DISK, "No buffers free.");
+}
+
+static void diskOpenNamedFile(emu_t* m, unsigned channel, const byte_t* b, unsigned len) {
+  DiskIndex* index = getDiskIndex(m);
+  const byte_t* name = b;
+  bool replace = false;
+  if (len > 0 && b[0] == '@') {
+    replace = true;
+    b++;
+    len--;
+  }
+  unsigned start, end;
+  parseFilename(b, len, &start, &end);
+  // The suffix can give a file type (S, P, U, L) and a mode (R, W, A).
+  // Channels 0 and 1 are reserved for LOAD and SAVE: 0 always reads and 1
+  // writes by default.
+  unsigned filetypeID = channel == 1 ? FILETYPE_PRG : FILETYPE_SEQ;
+  byte_t mode = channel == 1 ? 'W' : 'R';
+  for (unsigned i=end; i + 1 < len; i++) {
+    if (b[i] != ',')
+      continue;
+    switch (b[i+1]) {
+      case 'S': filetypeID = FILETYPE_SEQ; break;
+      case 'P': filetypeID = FILETYPE_PRG; break;
+      case 'U': filetypeID = FILETYPE_USR; break;
+      case 'L': fault(m, FAULT_UNSUPPORTED, "Relative files are not supported: %s", name);
+      case 'R':
+      case 'W':
+      case 'A': mode = b[i+1]; break;
+    }
+  }
+  if (channel == 0)
+    mode = 'R';
+  DiskDrive* d = m->diskdrive;
+  int bufferID = allocateBuffer(m);
+  d->diskBufferChannels[bufferID] = channel;
+  d->diskBufferChainPos[bufferID] = 0;
+  d->diskBufferFiles[bufferID] = DISK_FILE_NONE;
+  if (mode != 'R' && !checkWritable(m)) {
+    // The channel stays open, but takes no data and has none to read.
+    d->diskBufferFiles[bufferID] = DISK_FILE_NOT_FOUND;
+    return;
+  }
+
+  if (mode != 'R') {
+    DiskWriteFile* w = calloc(1, sizeof(DiskWriteFile));
+    if (!w)
+      fault(m, FAULT_OUT_OF_MEMORY, "Out of memory.");
+    w->data = bufCreate();
+    w->nameLen = end - start < DISK_FILENAME_LEN ? end - start : DISK_FILENAME_LEN;
+    memcpy(w->name, b + start, w->nameLen);
+    w->filetypeID = filetypeID;
+    w->replace = replace;
+    w->append = mode == 'A';
+    d->diskBufferWrites[bufferID] = w;
+    romTrace(m, "ROM/disk: OPEN file for writing: %s [channel=%d, buffer %d]",
+        name, channel, bufferID);
+    return;
+  }
+
+  int fileIndex = findDiskFile(index, b + start, end - start);
+  while (fileIndex < 0 && swapOnMissing(m)) {
+    index = getDiskIndex(m);
+    fileIndex = findDiskFile(index, b + start, end - start);
+  }
+  if (fileIndex < 0) {
+    romTrace(m, "ROM/disk: OPEN file not found: %s", name);
+    d->diskBufferFiles[bufferID] = DISK_FILE_NOT_FOUND;
+    return;
+  }
+  const DiskFileEntry* f = &index->files[fileIndex];
+  if (f->chainStatus != DISK_CHAIN_OK)
+    romTrace(m, "ROM/disk: OPEN file with bad sector chain (%s): %s",
+        DISK_CHAIN_STATUS_NAMES[f->chainStatus], f->filename);
+  d->diskBufferFiles[bufferID] = fileIndex;
+  if (f->chainLength > 0)
+    diskLoadFileSector(d, bufferID);
+  romTrace(m, "ROM/disk: OPEN file %s [%u bytes] on channel %d, buffer %d.",
+      f->filename, f->byteLength, channel, bufferID);
 }
 
 void diskOpenFile(emu_t* m, unsigned channel) {
-  byte_t* b = m->diskdrive.commandBuffer;
-  int len = m->diskdrive.commandBufferPointer;
+  m->diskdrive->statusLen = 0;
+  byte_t* b = m->diskdrive->commandBuffer;
+  int len = m->diskdrive->commandBufferPointer;
   if (len == 0)
-    error(m, "OPEN with empty filename.");
+    fault(m, FAULT_DISK, "OPEN with empty filename.");
   b[len] = 0; // add null term
   if (b[0] == '#') {
     int bufferRequest = -1;
     if (len > 2)
-      error(m, "Invalid OPEN buffer argument: %s", b);
+      fault(m, FAULT_DISK, "Invalid OPEN buffer argument: %s", b);
     if (len == 2) {
       bufferRequest = b[1] - '0';
       if (bufferRequest < 0 || bufferRequest >= DISKDRIVE_BUFFER_COUNT)
-        error(m, "Invalid buffer number: %c", b[1]);
-      if (m->diskdrive.diskBufferChannels[bufferRequest] != 0)
-        error(m, "Buffer #%d is in use.", bufferRequest);
+        fault(m, FAULT_DISK, "Invalid buffer number: %c", b[1]);
+      if (m->diskdrive->diskBufferChannels[bufferRequest] != DISK_CHANNEL_NONE)
+        fault(m, FAULT_DISK, "Buffer #%d is in use.", bufferRequest);
     } else {
-      for (int i=0; i < DISKDRIVE_BUFFER_COUNT; i++) {
-        if (m->diskdrive.diskBufferChannels[i] == 0) {
-          bufferRequest = i;
-          break;
-        }
+      bufferRequest = allocateBuffer(m);
+    }
+    m->diskdrive->diskBufferChannels[bufferRequest] = channel;
+    m->diskdrive->diskBufferFiles[bufferRequest] = DISK_FILE_NONE;
+    m->diskdrive->diskBufferSectors[bufferRequest] = -1;
+  } else if (b[0] == '$') {
+    fault(m, FAULT_UNSUPPORTED, "Directory listing via OPEN not supported.");
+  } else {
+    diskOpenNamedFile(m, channel, b, len);
+  }
+}
+
+// Stop with a fault if writing back to the image file failed.
+static void flushDiskOrFault(emu_t* m) {
+  if (!flushDisk(m)) {
+    char message[FAULT_MESSAGE_SIZE];
+    strcpy(message, m->fault.message);
+    fault(m, FAULT_DISK, "%s", message);
+  }
+}
+
+// Release the buffer assigned to a channel, if it has one, putting a file
+// being written on it onto the disk.
+static void diskCloseChannel(emu_t* m, unsigned channel) {
+  DiskDrive* d = m->diskdrive;
+  for (int i=0; i < DISKDRIVE_BUFFER_COUNT; i++) {
+    if (d->diskBufferChannels[i] == channel) {
+      DiskWriteFile* w = d->diskBufferWrites[i];
+      d->diskBufferChannels[i] = DISK_CHANNEL_NONE;
+      d->diskBufferFiles[i] = DISK_FILE_NONE;
+      d->diskBufferWrites[i] = NULL;
+      if (w) {
+        commitWriteFile(m, w);
+        freeWriteFile(w);
       }
-      if (bufferRequest == -1)
-        error(m, "No buffers free.");
     }
-    m->diskdrive.diskBufferChannels[bufferRequest] = channel;
   }
+  flushDiskOrFault(m);
 }
 
 void diskLISTEN(emu_t* m) {
+  selectDrive(m, RAM[RAM_FA]);
   // Clear the disk buffer to prepare to receive a command.
-  m->diskdrive.commandBufferPointer = 0;
+  m->diskdrive->commandBufferPointer = 0;
   for (int i=0; i < DISKDRIVE_COMMAND_BUFFER_SIZE; i++) {
-    m->diskdrive.commandBuffer[i] = 0;
+    m->diskdrive->commandBuffer[i] = 0;
   }
 }
 
 void diskUNLSN(emu_t* m) {
-  unsigned sec = m->diskdrive.secondAddress;
+  unsigned sec = selectDrive(m, RAM[RAM_FA])->secondAddress;
   unsigned command = sec & 0xF0;
   unsigned channel = sec & 0x0F;
   trace(m, true, "ROM/disk: DISK UNLSN: command=$%02X, channel=%d", command, channel);
@@ -688,14 +2032,14 @@ void diskUNLSN(emu_t* m) {
       if (channel == 15) {
         // command channel
         diskCommand(m);
-      } else {
+      } else if (findChannelBuffer(m->diskdrive, channel) < 0) {
+        // Data for channels with buffers went to the buffer (see diskCIOUT).
         diskCommand(m);
         //diskOpenFile(m, channel);
       }
       break;
     case 0xE0: // CLOSE
-      // Do nothing.
-      // TODO: Flush buffer to disk if we're going to emulating disk writing.
+      diskCloseChannel(m, channel);
       break;
     case 0xF0: // OPEN
       if (channel == 15) {
@@ -706,7 +2050,7 @@ void diskUNLSN(emu_t* m) {
       }
       break;
     default:
-      error(m, "OPEN: unhandled command %02X.", command);
+      fault(m, FAULT_DISK, "OPEN: unhandled command %02X.", command);
   }
 }
 
@@ -735,3 +2079,139 @@ void diskOPEN(emu_t* m) {
   emulateC64ROM(m, C64_ROM_CALL_UNLSN);
 }
 
+
+// Copy the SETNAM filename out of RAM, returning its length.
+static unsigned copyFilename(emu_t* m, byte_t* filename) {
+  unsigned filenameLength = RAM[RAM_FNLEN];
+  if (filenameLength > DISKDRIVE_COMMAND_BUFFER_SIZE)
+    filenameLength = DISKDRIVE_COMMAND_BUFFER_SIZE;
+  word_t filenameAddress = toWord(RAM[RAM_FNADR], RAM[RAM_FNADR+1]);
+  for (unsigned i=0; i < filenameLength; i++)
+    filename[i] = RAM[(word_t)(filenameAddress + i)];
+  return filenameLength;
+}
+
+// KERNAL LOAD/VERIFY from the disk drive. The file is found in the disk index
+// and copied straight from the image into RAM a sector at a time, instead of
+// going through OPEN and ACPTR a byte at a time like the real routine does.
+// Store hooks aren't triggered by the copy.
+//
+// Uses the parameters that LOAD saves in RAM: VERCK (verify flag), MEMUSS
+// (address to use when SA=0), SA and the filename. On return X/Y and EAL/EAH
+// hold the address after the last byte loaded, and the status is set the way
+// the KERNAL sets it (EOI at the end, $10 on a verify mismatch).
+void diskLOAD(emu_t* m) {
+  selectDrive(m, RAM[RAM_FA]);
+  RAM[RAM_STATUS] = 0;
+  byte_t filename[DISKDRIVE_COMMAND_BUFFER_SIZE];
+  unsigned filenameLength = copyFilename(m, filename);
+  if (filenameLength == 0) {
+    romError(m, 8); // missing filename
+    return;
+  }
+
+  const DiskIndex* index;
+  int fileIndex;
+  do {
+    index = m->diskdrive->index;
+    fileIndex = -1;
+    if (index) {
+      unsigned start, end;
+      parseFilename(filename, filenameLength, &start, &end);
+      fileIndex = findDiskFile(index, filename + start, end - start);
+    }
+  } while (fileIndex < 0 && swapOnMissing(m));
+  if (fileIndex < 0 || index->files[fileIndex].byteLength < 2) {
+    romTrace(m, "ROM/disk: LOAD file not found.");
+    RAM[RAM_STATUS] = 0x42; // EOI + read timeout
+    romError(m, 4); // file not found
+    return;
+  }
+  const DiskFileEntry* f = &index->files[fileIndex];
+  if (f->chainStatus != DISK_CHAIN_OK)
+    romTrace(m, "ROM/disk: LOAD file with bad sector chain (%s): %s",
+        DISK_CHAIN_STATUS_NAMES[f->chainStatus], f->filename);
+
+  bool verify = RAM[RAM_VERCK] != 0;
+  const buf_t* image = m->diskdrive->mountedImageData;
+  const byte_t* first = diskSectorData(image, index->chains[f->chainStart]);
+  // A secondary address of 0 relocates the file to the address passed to
+  // LOAD, otherwise it goes where its header says.
+  word_t addr = RAM[RAM_SA] == 0
+    ? toWord(RAM[RAM_MEMUSS], RAM[RAM_MEMUSS+1])
+    : toWord(first[2], first[3]);
+  RAM[RAM_STAL] = toLo(addr);
+  RAM[RAM_STAL+1] = toHi(addr);
+  bool mismatch = false;
+  for (unsigned i=0; i < f->chainLength; i++) {
+    const byte_t* d = diskSectorData(image, index->chains[f->chainStart + i]);
+    const byte_t* src = d + (i == 0 ? 4 : 2); // skip link (and load address)
+    unsigned len = sectorDataLength(d);
+    diskLogAccess(m, DISK_ACCESS_LOAD, index->chains[f->chainStart + i], DISK_BUFFER_NONE, len);
+    len = i == 0 ? len - 2 : len;
+    while (len > 0) {
+      // Split the copy where it wraps around the top of memory.
+      unsigned room = RAM_SIZE - addr;
+      unsigned n = room < len ? room : len;
+      if (verify)
+        mismatch |= memcmp(RAM + addr, src, n) != 0;
+      else
+        memcpy(RAM + addr, src, n);
+      addr += n;
+      src += n;
+      len -= n;
+    }
+  }
+  romTrace(m, "ROM/disk: %s %s [%u bytes] at $%04X-$%04X.",
+      verify ? "VERIFY" : "LOAD", f->filename, f->byteLength - 2,
+      toWord(RAM[RAM_STAL], RAM[RAM_STAL+1]), addr);
+  RAM[RAM_STATUS] = 0x40 | (mismatch ? 0x10 : 0); // EOI
+  RAM[RAM_END_PROG] = toLo(addr);
+  RAM[RAM_END_PROG+1] = toHi(addr);
+  X = toLo(addr);
+  Y = toHi(addr);
+  setFlag(m, FLAG_C, false);
+}
+
+// KERNAL SAVE to the disk drive. Like LOAD, it skips the serial protocol: the
+// RAM from start up to (not including) end is written straight into the image
+// as a PRG file. As on the drive, an existing file is only replaced if the
+// name starts with "@".
+void diskSAVE(emu_t* m, word_t start, word_t end) {
+  selectDrive(m, RAM[RAM_FA]);
+  RAM[RAM_STATUS] = 0;
+  byte_t filename[DISKDRIVE_COMMAND_BUFFER_SIZE];
+  unsigned filenameLength = copyFilename(m, filename);
+  if (filenameLength == 0) {
+    romError(m, 8); // missing filename
+    return;
+  }
+  getDiskIndex(m); // fault if there's no disk
+  if (!checkWritable(m))
+    return;
+  DiskWriteFile w = { .filetypeID = FILETYPE_PRG };
+  const byte_t* name = filename;
+  if (filenameLength > 0 && name[0] == '@') {
+    w.replace = true;
+    name++;
+    filenameLength--;
+  }
+  unsigned nameStart, nameEnd;
+  parseFilename(name, filenameLength, &nameStart, &nameEnd);
+  w.nameLen = nameEnd - nameStart < DISK_FILENAME_LEN ? nameEnd - nameStart : DISK_FILENAME_LEN;
+  memcpy(w.name, name + nameStart, w.nameLen);
+  // The file starts with its load address.
+  word_t len = end - start;
+  w.data = bufCreate();
+  bufEnsureCap(w.data, len + 2);
+  w.data->data[0] = toLo(start);
+  w.data->data[1] = toHi(start);
+  for (unsigned i=0; i < len; i++)
+    w.data->data[2 + i] = RAM[(word_t)(start + i)];
+  w.data->len = len + 2;
+  commitWriteFile(m, &w);
+  bufDestroy(w.data);
+  flushDiskOrFault(m);
+  romTrace(m, "ROM/disk: SAVE $%04X-$%04X.", start, end);
+  setFlag(m, FLAG_C, false);
+}
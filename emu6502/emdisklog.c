@@ -0,0 +1,213 @@
+
+// Disk activity log: every sector the drives read, in order, with the IC and
+// PC of the KERNAL call that read it. Logging is off unless enableDiskLog is
+// called, and then the disk calls only check a pointer.
+//
+// Reads per sector (the heatmap) are counted from the log when it's written,
+// so logging doesn't keep any other state.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "em.h"
+
+const char* DISK_ACCESS_KIND_NAMES[] = {
+  "U1",
+  "B-R",
+  "LOAD",
+  "CHANNEL",
+};
+
+// Heatmap image: a row for each track and a column for each sector, with
+// each sector drawn as a square this many pixels wide.
+#define HEATMAP_CELL_SIZE 8
+
+bool enableDiskLog(Emu* m) {
+  if (m->diskLog)
+    return true;
+  m->diskLog = calloc(1, sizeof(DiskLog));
+  if (!m->diskLog) {
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory for disk log.");
+    return false;
+  }
+  return true;
+}
+
+void destroyDiskLog(DiskLog* log) {
+  if (!log)
+    return;
+  free(log->records);
+  free(log);
+}
+
+static unsigned driveDevice(Emu* m, const DiskDrive* d) {
+  for (int i=0; i < DISKDRIVE_COUNT; i++) {
+    if (m->diskdrives[i] == d)
+      return DISKDRIVE_FIRST_DEVICE + i;
+  }
+  return 0;
+}
+
+// Log a read of a sector (a linear sector number in the current drive's
+// disk). Bytes read from a channel one at a time go in one record per sector.
+void diskLogAppend(Emu* m, int kind, unsigned sector, unsigned buffer, unsigned bytes) {
+  DiskLog* log = m->diskLog;
+  const DiskDrive* d = m->diskdrive;
+  const DiskFormat* format = d->index->format;
+  unsigned track = 1;
+  while (track < format->trackCount && format->tracks[track+1].offsetInSectors <= sector)
+    track++;
+  DiskAccess a = {
+    .ic = m->reg.ic,
+    .pc = m->reg.pc,
+    .device = driveDevice(m, d),
+    .kind = kind,
+    .track = track,
+    .sector = sector - format->tracks[track].offsetInSectors,
+    .buffer = buffer,
+    .bytes = bytes,
+    .mount = d->mountCount,
+  };
+  if (kind == DISK_ACCESS_CHANNEL && log->count > 0) {
+    DiskAccess* last = &log->records[log->count - 1];
+    if (last->kind == kind && last->device == a.device && last->buffer == a.buffer
+        && last->mount == a.mount && last->track == a.track && last->sector == a.sector) {
+      last->bytes += bytes;
+      return;
+    }
+  }
+  if (log->count == log->cap) {
+    unsigned cap = log->cap ? 2 * log->cap : 1024;
+    DiskAccess* records = realloc(log->records, cap * sizeof(DiskAccess));
+    if (!records)
+      fault(m, FAULT_OUT_OF_MEMORY, "Out of memory for disk log.");
+    log->records = records;
+    log->cap = cap;
+  }
+  log->records[log->count++] = a;
+}
+
+bool writeDiskLog(Emu* m, const char* path) {
+  const DiskLog* log = m->diskLog;
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    setFault(m, FAULT_ERROR, "Unable to write disk log: %s", path);
+    return false;
+  }
+  fprintf(f, "ic,pc,device,kind,track,sector,buffer,bytes\n");
+  for (unsigned i=0; log && i < log->count; i++) {
+    const DiskAccess* a = &log->records[i];
+    fprintf(f, "%" PRIu64 ",%04X,%u,%s,%u,%u,", a->ic, a->pc, a->device,
+        DISK_ACCESS_KIND_NAMES[a->kind], a->track, a->sector);
+    if (a->buffer != DISK_BUFFER_NONE)
+      fprintf(f, "%u", a->buffer);
+    fprintf(f, ",%u\n", a->bytes);
+  }
+  if (fclose(f) != 0) {
+    setFault(m, FAULT_ERROR, "Unable to write disk log: %s", path);
+    return false;
+  }
+  return true;
+}
+
+// Write the number of reads of each sector of a drive's disk, as CSV and as a
+// PPM image. Returns true without writing anything if the drive has no disk.
+bool writeDiskHeatmap(Emu* m, unsigned device, const char* csvPath, const char* ppmPath) {
+  if (!IS_DISK_DEVICE(device)) {
+    setFault(m, FAULT_UNSUPPORTED, "No disk drive on device %u.", device);
+    return false;
+  }
+  const DiskDrive* d = m->diskdrives[device - DISKDRIVE_FIRST_DEVICE];
+  if (!d->index)
+    return true;
+  const DiskFormat* format = d->index->format;
+  unsigned* reads = calloc(format->sectorCount, sizeof(unsigned));
+  if (!reads) {
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory for disk heatmap.");
+    return false;
+  }
+  unsigned maxReads = 0;
+  unsigned maxSectors = 0;
+  for (unsigned t=1; t <= format->trackCount; t++) {
+    if (format->tracks[t].sectorCount > maxSectors)
+      maxSectors = format->tracks[t].sectorCount;
+  }
+  // Count the times each sector was read off the disk. Reading a buffer that
+  // U1 or B-R filled doesn't count again, but a file's channel reading its next
+  // sector does.
+  int bufferSectors[DISKDRIVE_BUFFER_COUNT];
+  for (int i=0; i < DISKDRIVE_BUFFER_COUNT; i++)
+    bufferSectors[i] = -1;
+  const DiskLog* log = m->diskLog;
+  for (unsigned i=0; log && i < log->count; i++) {
+    const DiskAccess* a = &log->records[i];
+    // Only count reads of the disk in the drive, not ones swapped out.
+    if (a->device != device || a->mount != d->mountCount)
+      continue;
+    int n = format->tracks[a->track].offsetInSectors + a->sector;
+    if (a->buffer < DISKDRIVE_BUFFER_COUNT) {
+      bool sameSector = bufferSectors[a->buffer] == n;
+      bufferSectors[a->buffer] = n;
+      if (a->kind == DISK_ACCESS_CHANNEL && sameSector)
+        continue;
+    }
+    if (++reads[n] > maxReads)
+      maxReads = reads[n];
+  }
+
+  bool ok = true;
+  FILE* f = fopen(csvPath, "w");
+  if (f) {
+    fprintf(f, "track,sector,reads\n");
+    for (unsigned t=1; t <= format->trackCount; t++) {
+      for (unsigned s=0; s < format->tracks[t].sectorCount; s++)
+        fprintf(f, "%u,%u,%u\n", t, s, reads[format->tracks[t].offsetInSectors + s]);
+    }
+    ok = fclose(f) == 0;
+  }
+  if (!f || !ok) {
+    setFault(m, FAULT_ERROR, "Unable to write disk heatmap: %s", csvPath);
+    free(reads);
+    return false;
+  }
+
+  // Unread sectors are grey, and read ones go from blue through red to
+  // yellow for the most read. Past the end of a track is black.
+  f = fopen(ppmPath, "wb");
+  if (f) {
+    unsigned width = maxSectors * HEATMAP_CELL_SIZE;
+    fprintf(f, "P6\n%u %u\n255\n", width, format->trackCount * HEATMAP_CELL_SIZE);
+    byte_t* row = malloc(width * 3);
+    for (unsigned t=1; row && t <= format->trackCount; t++) {
+      for (unsigned s=0; s < maxSectors; s++) {
+        byte_t rgb[3] = { 0, 0, 0 };
+        if (s < format->tracks[t].sectorCount) {
+          unsigned n = reads[format->tracks[t].offsetInSectors + s];
+          if (n == 0) {
+            rgb[0] = rgb[1] = rgb[2] = 0x40;
+          } else {
+            unsigned heat = 510 * n / maxReads; // 0-510
+            rgb[0] = heat > 255 ? 255 : heat;
+            rgb[1] = heat > 255 ? heat - 255 : 0;
+            rgb[2] = heat > 255 ? 0 : 255 - heat;
+          }
+        }
+        for (unsigned x=0; x < HEATMAP_CELL_SIZE; x++)
+          memcpy(row + 3 * (s * HEATMAP_CELL_SIZE + x), rgb, 3);
+      }
+      for (unsigned y=0; y < HEATMAP_CELL_SIZE; y++)
+        fwrite(row, 3, width, f);
+    }
+    ok = row != NULL;
+    free(row);
+    ok = fclose(f) == 0 && ok;
+  }
+  free(reads);
+  if (!f || !ok) {
+    setFault(m, FAULT_ERROR, "Unable to write disk heatmap: %s", ppmPath);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,485 @@
+
+// 1541 drive CPU: a second 6502 with the drive's memory map, for running the
+// code that fastloaders upload to the drive with M-W and start with M-E or
+// B-E. The drive ROM isn't built in, so the user has to supply it.
+//
+// Each drive CPU runs on its own thread. Keeping the two CPUs in step on
+// every instruction would cost more than the emulation itself, so they sync
+// in slices instead: the drive is allowed to run a slice ahead of the C64,
+// and at the end of each slice the C64 waits for the drive to get there
+// before letting it run the next one. Neither gets more than a slice ahead of
+// the other, and within a slice they run in parallel.
+//
+// What isn't emulated: the disk head (so nothing that reads GCR data off the
+// disk works), and interrupts (so the ROM's job loop doesn't run). DOS
+// commands still go to the high-level drive in emdisk.c.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "em.h"
+#include "emtrace.h"
+
+// Instructions in a sync slice.
+#define DRIVE_SLICE 10000
+// Enough instructions for the ROM's reset routine to test and set up RAM.
+#define DRIVE_RESET_INSTRUCTIONS 1000000
+// How far a drive can run on while the C64 waits for it to finish its code.
+#define DRIVE_COMMAND_WAIT 1000000
+// Drive code started by the C64 returns here. It's past the end of RAM, where
+// the CPU's memory can hold a NOP without drive code being able to change it.
+#define DRIVE_RETURN_ADDR 0x1000
+// The VIA timers count cycles, but the emulator only counts instructions.
+#define DRIVE_CYCLES_PER_INSTRUCTION 3
+
+#define DRIVE_RAM_SIZE 0x0800
+#define DRIVE_RAM_END 0x1800 // RAM repeats up to here
+#define DRIVE_VIA1 0x1800    // serial bus
+#define DRIVE_VIA2 0x1C00    // disk controller
+#define DRIVE_VIA_END 0x2000
+#define DRIVE_ROM 0xC000
+
+// 6522 VIA registers.
+enum {
+  VIA_ORB, VIA_ORA, VIA_DDRB, VIA_DDRA,
+  VIA_T1CL, VIA_T1CH, VIA_T1LL, VIA_T1LH,
+  VIA_T2CL, VIA_T2CH, VIA_SR, VIA_ACR,
+  VIA_PCR, VIA_IFR, VIA_IER, VIA_ORA_NH,
+  VIA_REG_COUNT
+};
+
+#define VIA_INT_T1 0x40
+#define VIA_ACR_T1_FREE_RUN 0x40
+
+// VIA1 port B: the serial bus. Inputs are 1 while a line is pulled low.
+#define VIA1_DATA_IN  0x01
+#define VIA1_DATA_OUT 0x02
+#define VIA1_CLK_IN   0x04
+#define VIA1_CLK_OUT  0x08
+#define VIA1_ATNA     0x10 // ATN acknowledge
+#define VIA1_DEVICE_SHIFT 5 // device number jumpers, 0 for device 8
+#define VIA1_ATN_IN   0x80
+
+// VIA2 port B: the drive mechanics.
+#define VIA2_WRITE_PROTECT 0x10 // 0 if the disk is write protected
+#define VIA2_SYNC          0x80 // 0 while the head is over a sync mark
+
+// Kept in DriveCPU.busOut with the IEC_* lines the drive pulls low.
+#define DRIVE_BUS_ATNA 0x80
+
+typedef struct {
+  byte_t reg[VIA_REG_COUNT];
+  uint64_t t1Start; // IC when timer 1 was last loaded
+  bool t1Armed;     // timer 1 sets its interrupt flag when it runs out
+} Via;
+
+struct DriveCPU_struct {
+  Emu* cpu;
+  Emu* host; // the C64
+  unsigned device;
+  Via via[2];
+  _Atomic byte_t busOut; // IEC_CLK, IEC_DATA and DRIVE_BUS_ATNA
+  // The disk's write protection, set from the C64's thread when it changes.
+  _Atomic bool writeProtected;
+  pthread_t thread;
+  // The lock covers everything below. The condition is signalled whenever
+  // any of it changes.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool running;  // drive code is running and hasn't returned yet
+  bool returned; // drive code returned to DRIVE_RETURN_ADDR
+  bool quit;
+  uint64_t allowedIC; // the drive's IC at the end of its slice
+  uint64_t doneIC;    // the drive's IC at the end of its last slice
+  uint64_t icOffset;  // drive IC minus C64 IC, from when the code started
+};
+
+// THE SERIAL BUS
+
+static byte_t driveBusOut(const DriveCPU* c, bool atn) {
+  byte_t out = c->busOut;
+  byte_t lines = out & (IEC_CLK | IEC_DATA);
+  // The drive holds DATA low while ATN doesn't match its acknowledge bit, so
+  // the C64 can see that the drive is there.
+  if (atn != ((out & DRIVE_BUS_ATNA) != 0))
+    lines |= IEC_DATA;
+  return lines;
+}
+
+// Lines are wired-AND, so a line is low if anyone pulls it low.
+byte_t iecBusLines(Emu* m) {
+  byte_t lines = m->iecOut;
+  bool atn = lines & IEC_ATN;
+  for (int i=0; i < DISKDRIVE_COUNT; i++) {
+    const DriveCPU* c = m->diskdrives[i]->cpu;
+    if (c)
+      lines |= driveBusOut(c, atn);
+  }
+  return lines;
+}
+
+// VIAS
+
+static void viaReset(Via* v) {
+  memset(v, 0, sizeof(Via));
+}
+
+// Timer 1, counted from the drive's IC when it's read.
+static word_t viaTimer1(Via* v, uint64_t ic) {
+  word_t latch = toWord(v->reg[VIA_T1LL], v->reg[VIA_T1LH]);
+  uint64_t elapsed = (ic - v->t1Start) * DRIVE_CYCLES_PER_INSTRUCTION;
+  if (elapsed > latch && v->t1Armed) {
+    v->reg[VIA_IFR] |= VIA_INT_T1;
+    if (v->reg[VIA_ACR] & VIA_ACR_T1_FREE_RUN) {
+      v->t1Start = ic;
+      elapsed = 0;
+    } else {
+      v->t1Armed = false;
+    }
+  }
+  return latch - elapsed;
+}
+
+// Port B inputs, and the output bits in the data direction register.
+static byte_t viaPortB(DriveCPU* c, int viaID) {
+  Via* v = &c->via[viaID];
+  byte_t in;
+  if (viaID == 0) {
+    byte_t lines = iecBusLines(c->host);
+    in = (c->device - DISKDRIVE_FIRST_DEVICE) << VIA1_DEVICE_SHIFT;
+    if (lines & IEC_DATA)
+      in |= VIA1_DATA_IN;
+    if (lines & IEC_CLK)
+      in |= VIA1_CLK_IN;
+    if (lines & IEC_ATN)
+      in |= VIA1_ATN_IN;
+  } else {
+    // Without a head there's never a sync mark under it.
+    in = VIA2_SYNC;
+    if (!c->writeProtected)
+      in |= VIA2_WRITE_PROTECT;
+  }
+  byte_t ddr = v->reg[VIA_DDRB];
+  return (v->reg[VIA_ORB] & ddr) | (in & ~ddr);
+}
+
+static void viaUpdateBus(DriveCPU* c) {
+  const Via* v = &c->via[0];
+  byte_t out = v->reg[VIA_ORB] & v->reg[VIA_DDRB];
+  byte_t lines = 0;
+  if (out & VIA1_DATA_OUT)
+    lines |= IEC_DATA;
+  if (out & VIA1_CLK_OUT)
+    lines |= IEC_CLK;
+  if (out & VIA1_ATNA)
+    lines |= DRIVE_BUS_ATNA;
+  c->busOut = lines;
+}
+
+static byte_t viaRead(DriveCPU* c, int viaID, unsigned r, uint64_t ic) {
+  Via* v = &c->via[viaID];
+  switch (r) {
+    case VIA_ORB:
+      return viaPortB(c, viaID);
+    case VIA_T1CL:
+      {
+        byte_t lo = toLo(viaTimer1(v, ic));
+        v->reg[VIA_IFR] &= ~VIA_INT_T1;
+        return lo;
+      }
+    case VIA_T1CH:
+      return toHi(viaTimer1(v, ic));
+    case VIA_IFR:
+      viaTimer1(v, ic);
+      return v->reg[VIA_IFR] | (v->reg[VIA_IFR] & v->reg[VIA_IER] ? 0x80 : 0);
+    case VIA_IER:
+      return v->reg[VIA_IER] | 0x80;
+    default:
+      return v->reg[r];
+  }
+}
+
+static void viaWrite(DriveCPU* c, int viaID, unsigned r, byte_t value, uint64_t ic) {
+  Via* v = &c->via[viaID];
+  switch (r) {
+    case VIA_T1CL:
+      v->reg[VIA_T1LL] = value;
+      break;
+    case VIA_T1CH:
+      v->reg[VIA_T1LH] = value;
+      v->reg[VIA_IFR] &= ~VIA_INT_T1;
+      v->t1Start = ic;
+      v->t1Armed = true;
+      break;
+    case VIA_T1LH:
+      v->reg[VIA_T1LH] = value;
+      v->reg[VIA_IFR] &= ~VIA_INT_T1;
+      break;
+    case VIA_IFR:
+      v->reg[VIA_IFR] &= ~value;
+      break;
+    case VIA_IER:
+      if (value & 0x80)
+        v->reg[VIA_IER] |= value & 0x7F;
+      else
+        v->reg[VIA_IER] &= ~value;
+      break;
+    default:
+      v->reg[r] = value;
+      if (viaID == 0 && (r == VIA_ORB || r == VIA_DDRB))
+        viaUpdateBus(c);
+      break;
+  }
+}
+
+// MEMORY MAP
+
+byte_t driveLoad(Emu* m, word_t addr) {
+  if (addr < DRIVE_RAM_END)
+    return RAM[addr % DRIVE_RAM_SIZE];
+  if (addr < DRIVE_VIA_END)
+    return viaRead(m->driveCPU, addr >= DRIVE_VIA2, addr % VIA_REG_COUNT, m->reg.ic);
+  if (addr >= DRIVE_ROM)
+    return RAM[addr]; // the ROM is copied in
+  return toHi(addr); // nothing there, so the last byte on the bus
+}
+
+void driveStore(Emu* m, byte_t value, word_t addr) {
+  if (addr < DRIVE_RAM_END)
+    RAM[addr % DRIVE_RAM_SIZE] = value;
+  else if (addr < DRIVE_VIA_END)
+    viaWrite(m->driveCPU, addr >= DRIVE_VIA2, addr % VIA_REG_COUNT, value, m->reg.ic);
+}
+
+// THE DRIVE THREAD
+
+static void driveReturnHook(Emu* cpu, int pc, ExecutionHook* hook) {
+  (void)pc;
+  DriveCPU* c = hook->privateData;
+  c->returned = true;
+  // Stop after the NOP.
+  cpu->icLimit = cpu->reg.ic;
+  cpu->nextEventIC = cpu->reg.ic;
+}
+
+// Run slices as the C64 allows them, until told to quit.
+static void* driveThread(void* arg) {
+  DriveCPU* c = arg;
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    while (!c->quit && !(c->running && c->doneIC < c->allowedIC))
+      pthread_cond_wait(&c->cond, &c->lock);
+    if (c->quit)
+      break;
+    c->cpu->icLimit = c->allowedIC;
+    pthread_mutex_unlock(&c->lock);
+    int faultCode = interp(c->cpu);
+    pthread_mutex_lock(&c->lock);
+    c->doneIC = c->cpu->reg.ic;
+    if (faultCode != FAULT_NONE || c->returned)
+      c->running = false;
+    pthread_cond_broadcast(&c->cond);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+// Wait for the drive to finish its slice. Called with the lock held.
+static void waitForSlice(DriveCPU* c) {
+  while (c->running && c->doneIC < c->allowedIC)
+    pthread_cond_wait(&c->cond, &c->lock);
+}
+
+// A fault in drive code stops the C64 too, since the drive would hang. Only
+// called while the drive isn't running.
+static void checkDriveFault(Emu* m, DriveCPU* c) {
+  const EmuFault* f = &c->cpu->fault;
+  if (f->code != FAULT_NONE)
+    fault(m, FAULT_DISK, "Drive %u CPU fault at PC=%04X: %s", c->device, f->pc, f->message);
+}
+
+// The drive addressed by the current disk call, once it's done running code.
+static DriveCPU* idleDriveCPU(Emu* m, const char* command) {
+  DriveCPU* c = m->diskdrive->cpu;
+  if (!c)
+    fault(m, FAULT_DISK, "%s needs drive CPU emulation, which isn't on.", command);
+  pthread_mutex_lock(&c->lock);
+  if (c->running) {
+    // A drive running code doesn't take commands, so give it a while to
+    // finish, with the C64 held where it is.
+    c->allowedIC = c->doneIC + DRIVE_COMMAND_WAIT;
+    pthread_cond_broadcast(&c->cond);
+    waitForSlice(c);
+  }
+  bool running = c->running;
+  word_t pc = c->cpu->reg.pc;
+  pthread_mutex_unlock(&c->lock);
+  if (running)
+    fault(m, FAULT_DISK, "%s sent while drive %u is running code at $%04X.",
+        command, c->device, pc);
+  checkDriveFault(m, c);
+  return c;
+}
+
+byte_t driveReadMemory(Emu* m, word_t addr) {
+  return driveLoad(idleDriveCPU(m, "MEMORY-READ")->cpu, addr);
+}
+
+void driveWriteMemory(Emu* m, word_t addr, const byte_t* data, unsigned len) {
+  Emu* cpu = idleDriveCPU(m, "MEMORY-WRITE")->cpu;
+  for (unsigned i=0; i < len; i++)
+    driveStore(cpu, data[i], addr + i);
+}
+
+// Start drive code as a subroutine, and let the drive thread run it.
+void driveExecute(Emu* m, word_t addr) {
+  DriveCPU* c = idleDriveCPU(m, "MEMORY-EXECUTE");
+  Emu* cpu = c->cpu;
+  if (cpu->reg.s < 2)
+    fault(m, FAULT_DISK, "Drive %u stack is full.", c->device);
+  word_t returnAddr = DRIVE_RETURN_ADDR - 1; // RTS adds 1
+  cpu->ram[0x100 + cpu->reg.s--] = toHi(returnAddr);
+  cpu->ram[0x100 + cpu->reg.s--] = toLo(returnAddr);
+  cpu->reg.pc = addr;
+  romTrace(m, "ROM/disk: drive %u CPU runs $%04X", c->device, addr);
+  pthread_mutex_lock(&c->lock);
+  c->returned = false;
+  c->running = true;
+  c->icOffset = cpu->reg.ic - m->reg.ic;
+  c->doneIC = cpu->reg.ic;
+  c->allowedIC = cpu->reg.ic + DRIVE_SLICE;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+  if (m->reg.ic + DRIVE_SLICE < m->driveSyncIC)
+    m->driveSyncIC = m->reg.ic + DRIVE_SLICE;
+  scheduleNextEvent(m);
+}
+
+// At the end of a slice, wait for the drives to catch up and give them the
+// next one.
+void driveSyncAtIC(Emu* m) {
+  if (m->reg.ic < m->driveSyncIC)
+    return;
+  m->driveSyncIC = UINT64_MAX;
+  for (int i=0; i < DISKDRIVE_COUNT; i++) {
+    DriveCPU* c = m->diskdrives[i]->cpu;
+    if (!c)
+      continue;
+    pthread_mutex_lock(&c->lock);
+    waitForSlice(c);
+    bool running = c->running;
+    if (running) {
+      c->allowedIC = m->reg.ic + c->icOffset + DRIVE_SLICE;
+      pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (running)
+      m->driveSyncIC = m->reg.ic + DRIVE_SLICE;
+    else
+      checkDriveFault(m, c);
+  }
+}
+
+// ATTACHING
+
+static void destroyDriveCPU(DriveCPU* c) {
+  destroyEmulator(c->cpu);
+  free(c);
+}
+
+// Give a drive a CPU with the drive ROM, and reset it. The reset runs the
+// ROM's setup but not its job loop, which needs interrupts.
+bool attachDriveCPU(Emu* m, unsigned device, const buf_t* rom) {
+  if (!IS_DISK_DEVICE(device)) {
+    setFault(m, FAULT_UNSUPPORTED, "No disk drive on device %u.", device);
+    return false;
+  }
+  if (rom->len != DRIVE_ROM_SIZE) {
+    setFault(m, FAULT_DISK, "Drive ROM must be %u bytes.", DRIVE_ROM_SIZE);
+    return false;
+  }
+  detachDriveCPU(m, device);
+  DriveCPU* c = calloc(1, sizeof(DriveCPU));
+  if (!c) {
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory for drive CPU.");
+    return false;
+  }
+  c->host = m;
+  c->device = device;
+  c->writeProtected = m->diskdrives[device - DISKDRIVE_FIRST_DEVICE]->writeMode
+      == DISK_WRITE_PROTECTED;
+  c->cpu = createEmulator(NULL);
+  if (!c->cpu) {
+    free(c);
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory for drive CPU.");
+    return false;
+  }
+  Emu* cpu = c->cpu;
+  cpu->machine = MACHINE_1541;
+  cpu->driveCPU = c;
+  memcpy(cpu->ram + DRIVE_ROM, rom->data, DRIVE_ROM_SIZE);
+  cpu->ram[DRIVE_RETURN_ADDR] = 0xEA; // NOP
+  ExecutionHook hook = {
+    .pcHookAddress = DRIVE_RETURN_ADDR,
+    .hookType = HOOKTYPE_EXEC,
+    .name = "drive code return",
+    .callback = driveReturnHook,
+    .privateData = c,
+  };
+  if (!registerHook(cpu, &hook)) {
+    setFault(m, cpu->fault.code, "%s", cpu->fault.message);
+    destroyDriveCPU(c);
+    return false;
+  }
+  for (int i=0; i < 2; i++)
+    viaReset(&c->via[i]);
+  cpu->reg.pc = toWord(cpu->ram[0xFFFC], cpu->ram[0xFFFD]);
+  cpu->icLimit = DRIVE_RESET_INSTRUCTIONS;
+  if (interp(cpu) != FAULT_NONE) {
+    setFault(m, FAULT_DISK, "Drive %u CPU reset failed at PC=%04X: %s",
+        device, cpu->fault.pc, cpu->fault.message);
+    destroyDriveCPU(c);
+    return false;
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  if (pthread_create(&c->thread, NULL, driveThread, c) != 0) {
+    setFault(m, FAULT_ERROR, "Unable to start drive %u CPU thread.", device);
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    destroyDriveCPU(c);
+    return false;
+  }
+  m->diskdrives[device - DISKDRIVE_FIRST_DEVICE]->cpu = c;
+  return true;
+}
+
+// Called when a drive's disk is mounted, unmounted or swapped, so that the
+// drive CPU sees the new disk's write protection.
+void driveDiskChanged(DiskDrive* d) {
+  if (d->cpu)
+    d->cpu->writeProtected = d->writeMode == DISK_WRITE_PROTECTED;
+}
+
+void detachDriveCPU(Emu* m, unsigned device) {
+  if (!IS_DISK_DEVICE(device))
+    return;
+  DiskDrive* d = m->diskdrives[device - DISKDRIVE_FIRST_DEVICE];
+  DriveCPU* c = d->cpu;
+  if (!c)
+    return;
+  pthread_mutex_lock(&c->lock);
+  c->quit = true;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+  pthread_join(c->thread, NULL);
+  pthread_cond_destroy(&c->cond);
+  pthread_mutex_destroy(&c->lock);
+  d->cpu = NULL;
+  destroyDriveCPU(c);
+}
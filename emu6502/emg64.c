@@ -0,0 +1,287 @@
+
+// G64 images: raw GCR tracks as the 1541 head reads them.
+// Format: https://ist.uwaterloo.ca/~schepers/formats/G64.TXT
+//
+// The drive works on sectors, so tracks are decoded into a D64 image (with an
+// error table for sectors that don't decode cleanly). Decoding happens a track
+// at a time when a track is first needed, and the result is kept.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "em.h"
+
+#define G64_SIGNATURE "GCR-1541"
+#define G64_HEADER_SIZE 12
+
+// Block sizes after decoding.
+#define GCR_HEADER_SIZE 8    // $08, checksum, sector, track, id2, id1, $0F, $0F
+#define GCR_DATA_SIZE 260    // $07, 256 bytes of data, checksum, $00, $00
+#define GCR_HEADER_ID 0x08
+#define GCR_DATA_ID 0x07
+#define GCR_SYNC_BITS 10     // a sync mark is at least this many 1 bits
+#define GCR_MAX_HEADER_GAP 64 // GCR bytes from a header to its data block
+
+// Error codes the 1541 reports for sectors it can't read.
+enum {
+  DISK_ERROR_OK = 1,
+  DISK_ERROR_NO_HEADER = 20,
+  DISK_ERROR_NO_SYNC = 21,
+  DISK_ERROR_NO_DATA = 22,
+  DISK_ERROR_DATA_CHECKSUM = 23,
+  DISK_ERROR_GCR = 24,
+  DISK_ERROR_HEADER_CHECKSUM = 27,
+};
+
+// GCR code for each nibble. The other 16 5-bit values are invalid.
+static const byte_t GCR_ENCODE[16] = {
+  0x0A, 0x0B, 0x12, 0x13, 0x0E, 0x0F, 0x16, 0x17,
+  0x09, 0x19, 0x1A, 0x1B, 0x0D, 0x1D, 0x1E, 0x15,
+};
+
+// Byte for each pair of GCR codes (10 bits), or -1 if either is invalid.
+// Filled in once, by whichever thread opens a G64 first.
+static int16_t gcrDecodeTable[1 << 10];
+static pthread_once_t gcrTableOnce = PTHREAD_ONCE_INIT;
+
+static void initGcrTable(void) {
+  for (int i=0; i < (1 << 10); i++)
+    gcrDecodeTable[i] = -1;
+  for (int hi=0; hi < 16; hi++) {
+    for (int lo=0; lo < 16; lo++)
+      gcrDecodeTable[GCR_ENCODE[hi] << 5 | GCR_ENCODE[lo]] = hi << 4 | lo;
+  }
+}
+
+// The 40 bits starting at a bit offset. Reads 6 bytes.
+static uint64_t gcrBits40(const byte_t* data, size_t bitPos) {
+  const byte_t* p = data + bitPos / 8;
+  uint64_t v = 0;
+  for (int i=0; i < 6; i++)
+    v = v << 8 | p[i];
+  return (v >> (8 - bitPos % 8)) & 0xFFFFFFFFFFull;
+}
+
+// Decode GCR starting at a bit offset, 5 bytes (eight codes) into 4 bytes at
+// a time. Returns false if there were invalid codes.
+static bool gcrDecode(const byte_t* data, size_t bitPos, byte_t* out, unsigned len) {
+  assert(len % 4 == 0);
+  int bad = 0;
+  for (unsigned i=0; i < len; i += 4, bitPos += 40) {
+    uint64_t v = gcrBits40(data, bitPos);
+    int a = gcrDecodeTable[(v >> 30) & 0x3FF];
+    int b = gcrDecodeTable[(v >> 20) & 0x3FF];
+    int c = gcrDecodeTable[(v >> 10) & 0x3FF];
+    int d = gcrDecodeTable[v & 0x3FF];
+    bad |= a | b | c | d;
+    out[i] = a;
+    out[i+1] = b;
+    out[i+2] = c;
+    out[i+3] = d;
+  }
+  return bad >= 0;
+}
+
+static unsigned readLE16(const byte_t* p) {
+  return p[0] | p[1] << 8;
+}
+
+static unsigned readLE32(const byte_t* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+// The GCR data of a track, or NULL if the image doesn't have it.
+static const byte_t* g64TrackData(const G64Image* g, unsigned track, unsigned* len) {
+  unsigned halfTrack = 2 * (track - 1);
+  if (halfTrack >= g->halfTrackCount)
+    return NULL;
+  unsigned offset = readLE32(g->file->data + G64_HEADER_SIZE + 4 * halfTrack);
+  if (offset == 0)
+    return NULL;
+  *len = readLE16(g->file->data + offset);
+  return *len > 0 ? g->file->data + offset + 2 : NULL;
+}
+
+bool isG64(const buf_t* file) {
+  return file->len >= G64_HEADER_SIZE
+      && memcmp(file->data, G64_SIGNATURE, strlen(G64_SIGNATURE)) == 0;
+}
+
+// Check the header and pick a D64 format for the decoded image. Returns NULL
+// if the file isn't a valid G64 image.
+G64Image* openG64(const buf_t* file) {
+  if (!isG64(file))
+    return NULL;
+  unsigned halfTrackCount = file->data[9];
+  if (G64_HEADER_SIZE + 8 * halfTrackCount > file->len)
+    return NULL;
+  // Check the tracks are within the file, and see if it has any past 35.
+  unsigned lastTrack = 0;
+  for (unsigned i=0; i < halfTrackCount; i++) {
+    unsigned offset = readLE32(file->data + G64_HEADER_SIZE + 4 * i);
+    if (offset == 0)
+      continue;
+    if (offset + 2 > file->len || offset + 2 + readLE16(file->data + offset) > file->len)
+      return NULL;
+    if (i % 2 == 0)
+      lastTrack = i / 2 + 1;
+  }
+  G64Image* g = calloc(1, sizeof(G64Image));
+  if (!g)
+    return NULL;
+  pthread_once(&gcrTableOnce, initGcrTable);
+  g->file = file;
+  g->halfTrackCount = halfTrackCount;
+  g->format = &DISK_FORMATS[lastTrack > 35 ? DISK_FORMAT_D64_40 : DISK_FORMAT_D64];
+  unsigned sectorCount = g->format->sectorCount;
+  g->image = bufCreate();
+  bufEnsureCap(g->image, sectorCount * (SECTOR_SIZE + 1));
+  g->image->len = sectorCount * (SECTOR_SIZE + 1);
+  memset(g->image->data, 0, sectorCount * SECTOR_SIZE);
+  memset(g->image->data + sectorCount * SECTOR_SIZE, DISK_ERROR_OK, sectorCount);
+  return g;
+}
+
+void closeG64(G64Image* g) {
+  if (!g)
+    return;
+  bufDestroy(g->image);
+  free(g);
+}
+
+// Decode a track into the image, unless that's already been done. Sectors
+// that aren't found or don't decode are given an error code, like the
+// drive would report for them.
+void g64DecodeTrack(G64Image* g, unsigned track) {
+  const DiskFormat* format = g->format;
+  if (track < 1 || track > format->trackCount || g->decoded[track])
+    return;
+  g->decoded[track] = true;
+  unsigned sectorCount = format->tracks[track].sectorCount;
+  unsigned firstSector = format->tracks[track].offsetInSectors;
+  byte_t* errors = g->image->data + format->sectorCount * SECTOR_SIZE + firstSector;
+  memset(errors, DISK_ERROR_NO_HEADER, sectorCount);
+  unsigned len;
+  const byte_t* gcr = g64TrackData(g, track, &len);
+  if (!gcr) {
+    memset(errors, DISK_ERROR_NO_SYNC, sectorCount);
+    return;
+  }
+  // The track is a loop. Laying it out three times over lets blocks be read
+  // across the end of the track, starting from any point in the middle copy.
+  // The padding is for short tracks.
+  size_t padding = GCR_MAX_HEADER_GAP + GCR_DATA_SIZE / 4 * 5 + 6;
+  byte_t* bits = malloc(3 * len + padding);
+  if (!bits)
+    return;
+  for (int i=0; i < 3; i++)
+    memcpy(bits + i * len, gcr, len);
+  memset(bits + 3 * len, 0, padding);
+  size_t trackBits = (size_t)len * 8;
+  // Find the sync marks. Start on a 0 bit so that no mark is cut in two, and
+  // go on a little past one turn in case the last header's data block is
+  // after that.
+  size_t start = trackBits;
+  while (start < 2 * trackBits && (bits[start / 8] & (0x80 >> start % 8)))
+    start++;
+  if (start == 2 * trackBits) {
+    memset(errors, DISK_ERROR_NO_SYNC, sectorCount);
+    free(bits);
+    return;
+  }
+  // Each block starts straight after a sync mark. Headers say which sector the
+  // data block after them is for.
+  int sector = -1;
+  unsigned ones = 0;
+  size_t end = start + trackBits + GCR_MAX_HEADER_GAP * 8;
+  for (size_t pos = start + 1; pos <= end; pos++) {
+    if (bits[pos / 8] & (0x80 >> pos % 8)) {
+      ones++;
+      continue;
+    }
+    bool sync = ones >= GCR_SYNC_BITS;
+    ones = 0;
+    if (!sync)
+      continue;
+    byte_t block[GCR_DATA_SIZE];
+    bool valid = gcrDecode(bits, pos, block, 4);
+    if (valid && block[0] == GCR_HEADER_ID) {
+      gcrDecode(bits, pos + 40, block + 4, GCR_HEADER_SIZE - 4);
+      sector = -1;
+      if (block[3] != track || block[2] >= sectorCount)
+        continue;
+      sector = block[2];
+      if (errors[sector] == DISK_ERROR_OK) {
+        sector = -1; // already read it from another copy
+        continue;
+      }
+      errors[sector] = (block[1] == (block[2] ^ block[3] ^ block[4] ^ block[5]))
+          ? DISK_ERROR_NO_DATA : DISK_ERROR_HEADER_CHECKSUM;
+    } else if (sector >= 0) {
+      if (errors[sector] == DISK_ERROR_NO_DATA) {
+        if (!valid || block[0] != GCR_DATA_ID) {
+          sector = -1;
+          continue;
+        }
+        valid = gcrDecode(bits, pos, block, GCR_DATA_SIZE);
+        byte_t checksum = 0;
+        for (int i=1; i <= SECTOR_SIZE; i++)
+          checksum ^= block[i];
+        memcpy(g->image->data + (firstSector + sector) * SECTOR_SIZE, block + 1, SECTOR_SIZE);
+        errors[sector] = !valid ? DISK_ERROR_GCR
+            : checksum != block[SECTOR_SIZE + 1] ? DISK_ERROR_DATA_CHECKSUM
+            : DISK_ERROR_OK;
+      }
+      sector = -1;
+    }
+  }
+  free(bits);
+}
+
+// Decode the tracks that the directory and files are on, by following their
+// sector chains. The rest are left until something reads them.
+void g64DecodeFiles(G64Image* g) {
+  const DiskFormat* format = g->format;
+  byte_t* visited = calloc(format->sectorCount, 1);
+  if (!visited)
+    return;
+  unsigned dirTrack = format->dirTrack;
+  unsigned dirSector = format->dirSector;
+  g64DecodeTrack(g, dirTrack); // BAM
+  while (dirTrack >= 1 && dirTrack <= format->trackCount
+      && dirSector < format->tracks[dirTrack].sectorCount) {
+    unsigned n = format->tracks[dirTrack].offsetInSectors + dirSector;
+    if (visited[n])
+      break;
+    visited[n] = 1;
+    g64DecodeTrack(g, dirTrack);
+    const byte_t* d = diskSectorData(g->image, n);
+    for (int e=0; e < SECTOR_SIZE; e += 0x20) {
+      if (d[e + 2] == 0)
+        continue;
+      // The file's chain, and a REL file's side sector chain.
+      for (int link=3; link <= 0x15; link += 0x12) {
+        unsigned t = d[e + link];
+        unsigned s = d[e + link + 1];
+        while (t >= 1 && t <= format->trackCount && s < format->tracks[t].sectorCount) {
+          unsigned fn = format->tracks[t].offsetInSectors + s;
+          if (visited[fn])
+            break;
+          visited[fn] = 1;
+          g64DecodeTrack(g, t);
+          const byte_t* fd = diskSectorData(g->image, fn);
+          t = fd[0];
+          s = fd[1];
+        }
+      }
+    }
+    dirTrack = d[0];
+    dirSector = d[1];
+  }
+  free(visited);
+}
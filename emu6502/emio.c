@@ -0,0 +1,154 @@
+
+// The I/O area at $D000-$DFFF, a page at a time. When the banking bits map
+// I/O in, loads and stores there go through the handlers in IO_PAGES instead
+// of RAM. The chips keep their registers in Emu, and the RAM under them is
+// left alone, as on a C64.
+//
+// VIC: the raster line comes from the cycle count (PAL timing), and the
+//   registers that don't exist or don't have all their bits read as 1s.
+//   Sprites, collisions and raster interrupts aren't emulated.
+// SID: the write only registers read as 0, and the voice 3 oscillator reads
+//   as noise, since that's what programs read it for.
+// Color RAM: 1K of nybbles, with the high nybble reading as 0.
+// CIAs: see emcia.c.
+// $DE00-$DFFF: there's no cartridge, so nothing answers. Reads get an open
+//   bus value and writes are lost.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "em.h"
+
+#define VIC_REGISTER_MASK 0x3F // the registers repeat every 64 bytes
+#define VIC_CYCLES_PER_LINE 63
+#define VIC_LINES 312
+
+#define SID_REGISTER_MASK 0x1F // the registers repeat every 32 bytes
+
+enum {
+  SID_POTX = 0x19,
+  SID_POTY = 0x1A,
+  SID_OSC3 = 0x1B,
+  SID_ENV3 = 0x1C,
+};
+
+static unsigned rasterLine(Emu* m) {
+  return m->reg.cycles / VIC_CYCLES_PER_LINE % VIC_LINES;
+}
+
+static byte_t vicRead(Emu* m, word_t addr) {
+  unsigned reg = addr & VIC_REGISTER_MASK;
+  if (reg >= VIC_REGISTER_COUNT)
+    return 0xFF;
+  byte_t value = m->vic[reg];
+  switch (reg) {
+    case VIC_CONTROL1:
+    case VIC_RASTER: {
+      // A loop reading the raster line isn't idle (see idleLoopCheck).
+      m->memWrites++;
+      unsigned line = rasterLine(m);
+      if (reg == VIC_RASTER)
+        return line;
+      return (value & 0x7F) | ((line >> 1) & 0x80);
+    }
+    case VIC_CONTROL2:
+      return value | 0xC0;
+    case VIC_MEMORY:
+      return value | 0x01;
+    case VIC_IRQ_FLAGS:
+      return value | 0x70;
+    case VIC_IRQ_MASK:
+      return value | 0xF0;
+    case VIC_SPRITE_SPRITE:
+    case VIC_SPRITE_DATA:
+      return 0;
+    default:
+      if (reg >= VIC_BORDER)
+        return value | 0xF0;
+      return value;
+  }
+}
+
+static void vicWrite(Emu* m, word_t addr, byte_t value) {
+  unsigned reg = addr & VIC_REGISTER_MASK;
+  if (reg == VIC_IRQ_FLAGS)
+    m->vic[reg] &= ~value; // writing 1s acknowledges
+  else if (reg < VIC_REGISTER_COUNT)
+    m->vic[reg] = value;
+}
+
+// A 23 bit LFSR like the SID's noise waveform, taking a step for each read.
+static byte_t sidNoise(Emu* m) {
+  uint32_t n = m->sidNoise;
+  n = ((n << 1) | (((n >> 22) ^ (n >> 17)) & 1)) & 0x7FFFFF;
+  m->sidNoise = n;
+  return n >> 15;
+}
+
+static byte_t sidRead(Emu* m, word_t addr) {
+  switch (addr & SID_REGISTER_MASK) {
+    case SID_POTX:
+    case SID_POTY:
+      return 0xFF; // no paddles
+    case SID_OSC3:
+      m->memWrites++; // see idleLoopCheck
+      return sidNoise(m);
+    default:
+      return 0;
+  }
+}
+
+static void sidWrite(Emu* m, word_t addr, byte_t value) {
+  unsigned reg = addr & SID_REGISTER_MASK;
+  if (reg < SID_REGISTER_COUNT)
+    m->sid[reg] = value;
+}
+
+static byte_t colorRead(Emu* m, word_t addr) {
+  return m->colorRam[addr & (COLOR_RAM_SIZE - 1)];
+}
+
+static void colorWrite(Emu* m, word_t addr, byte_t value) {
+  m->colorRam[addr & (COLOR_RAM_SIZE - 1)] = value & 0x0F;
+}
+
+// Nothing drives the bus, so a read gets whatever was last on it. For an
+// absolute load that's the high byte of the address.
+static byte_t openBusRead(Emu* m, word_t addr) {
+  (void)m;
+  return addr >> 8;
+}
+
+static void openBusWrite(Emu* m, word_t addr, byte_t value) {
+  (void)m;
+  (void)addr;
+  (void)value;
+}
+
+const IoPage IO_PAGES[IO_PAGE_COUNT] = {
+  { vicRead, vicWrite }, // $D000
+  { vicRead, vicWrite },
+  { vicRead, vicWrite },
+  { vicRead, vicWrite },
+  { sidRead, sidWrite }, // $D400
+  { sidRead, sidWrite },
+  { sidRead, sidWrite },
+  { sidRead, sidWrite },
+  { colorRead, colorWrite }, // $D800
+  { colorRead, colorWrite },
+  { colorRead, colorWrite },
+  { colorRead, colorWrite },
+  { ciaRead, ciaWrite }, // $DC00
+  { ciaRead, ciaWrite }, // $DD00
+  { openBusRead, openBusWrite }, // $DE00
+  { openBusRead, openBusWrite },
+};
+
+void ioReset(Emu* m) {
+  memset(m->vic, 0, sizeof(m->vic));
+  memset(m->sid, 0, sizeof(m->sid));
+  memset(m->colorRam, 0, sizeof(m->colorRam));
+  m->sidNoise = 0x7FFFF8; // what the SID starts with
+}
@@ -0,0 +1,241 @@
+
+// Keyboard input script: keys to type into the KERNAL's keyboard buffer, in
+// steps that wait for an instruction count or for execution to reach an
+// address. The keys are typed straight into the buffer (GETIN and BASIN read
+// them from there), since there's no keyboard matrix to scan.
+//
+// A script is text, where most characters type themselves and names in
+// braces type other keys or start a step:
+//   LOAD"*",8,1{RETURN}{pc=C000}RUN{RETURN}{ic=5000000}Y
+// Letters type the unshifted key in either case, and a newline is RETURN.
+//   {RETURN} {SPACE} {HOME} {CLR} {DEL} {INST} {UP} {DOWN} {LEFT} {RIGHT}
+//   {F1}-{F8} {STOP}  named keys
+//   {$XX}             a PETSCII code in hex
+//   {ic=COUNT}        type what follows when the instruction count gets here
+//   {pc=ADDR}         type what follows when execution gets to ADDR (hex)
+// Each step waits for the ones before it to be typed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "em.h"
+
+static const struct {
+  const char* name;
+  byte_t key;
+} KEY_NAMES[] = {
+  { "RETURN", 0x0D },
+  { "SPACE", 0x20 },
+  { "HOME", 0x13 },
+  { "CLR", 0x93 },
+  { "DEL", 0x14 },
+  { "INST", 0x94 },
+  { "UP", 0x91 },
+  { "DOWN", 0x11 },
+  { "LEFT", 0x9D },
+  { "RIGHT", 0x1D },
+  { "F1", 0x85 },
+  { "F2", 0x89 },
+  { "F3", 0x86 },
+  { "F4", 0x8A },
+  { "F5", 0x87 },
+  { "F6", 0x8B },
+  { "F7", 0x88 },
+  { "F8", 0x8C },
+  { "STOP", 0x03 },
+  { NULL, 0 },
+};
+
+void destroyKeyScript(KeyScript* k) {
+  if (!k)
+    return;
+  free(k->keys);
+  free(k->steps);
+  free(k);
+}
+
+// Move typed keys into the keyboard buffer while there's room.
+void keyboardRefill(Emu* m) {
+  KeyScript* k = m->keys;
+  if (!k)
+    return;
+  unsigned size = RAM[RAM_XMAX];
+  if (size == 0 || size > KEYBOARD_BUFFER_SIZE)
+    size = KEYBOARD_BUFFER_SIZE;
+  while (k->buffered < k->typed && RAM[RAM_NDX] < size) {
+    RAM[RAM_KEYD + RAM[RAM_NDX]++] = k->keys[k->buffered++];
+    m->memWrites++;
+  }
+}
+
+// Take the next key out of the keyboard buffer, or return -1 if it's empty.
+int keyboardTake(Emu* m) {
+  keyboardRefill(m);
+  unsigned n = RAM[RAM_NDX];
+  if (n == 0)
+    return -1;
+  byte_t key = RAM[RAM_KEYD];
+  memmove(&RAM[RAM_KEYD], &RAM[RAM_KEYD+1], n - 1);
+  RAM[RAM_NDX] = n - 1;
+  m->memWrites++;
+  keyboardRefill(m);
+  return key;
+}
+
+// Whether a RETURN has been typed (so BASIN can read a line).
+bool keyboardHasLine(Emu* m) {
+  for (unsigned i=0; i < RAM[RAM_NDX]; i++) {
+    if (RAM[RAM_KEYD + i] == 0x0D)
+      return true;
+  }
+  KeyScript* k = m->keys;
+  return k && memchr(k->keys + k->buffered, 0x0D, k->typed - k->buffered);
+}
+
+// Whether the script still has keys to type.
+bool keyScriptPending(Emu* m) {
+  return m->keys && m->keys->nextStep < m->keys->stepCount;
+}
+
+static void typeStep(Emu* m) {
+  KeyScript* k = m->keys;
+  k->typed = k->steps[k->nextStep++].end;
+  keyboardRefill(m);
+  scheduleNextEvent(m);
+}
+
+static void keyScriptHook(Emu* m, int pc, ExecutionHook* hook) {
+  (void)pc;
+  KeyScript* k = m->keys;
+  // Hooks stay behind when a script is replaced or fails to be set, so check
+  // it's this one's.
+  if (k && (uintptr_t)hook->privateData == k->generation
+      && k->nextStep == (unsigned)hook->hookID)
+    typeStep(m);
+}
+
+// The IC at which the next step is due, or UINT64_MAX.
+uint64_t keyScriptNextIC(Emu* m) {
+  KeyScript* k = m->keys;
+  if (!k || k->nextStep == k->stepCount || k->steps[k->nextStep].trigger != KEY_STEP_AT_IC)
+    return UINT64_MAX;
+  return k->steps[k->nextStep].value;
+}
+
+void keyScriptRunAtIC(Emu* m) {
+  KeyScript* k = m->keys;
+  while (k && k->nextStep < k->stepCount && k->steps[k->nextStep].trigger == KEY_STEP_AT_IC
+      && k->steps[k->nextStep].value <= m->reg.ic)
+    typeStep(m);
+}
+
+static void addKey(KeyScript* k, byte_t key) {
+  k->keys[k->keyCount++] = key;
+  k->steps[k->stepCount - 1].end = k->keyCount;
+}
+
+static void addStep(KeyScript* k, int trigger, uint64_t value) {
+  k->steps[k->stepCount++] = (KeyStep){ trigger, value, k->keyCount };
+}
+
+// Parse one {...} item, given what's between the braces.
+static bool parseKeyItem(KeyScript* k, const char* item, size_t len) {
+  char* end;
+  if (len > 3 && !strncmp(item, "ic=", 3)) {
+    uint64_t ic = strtoull(item + 3, &end, 10);
+    if (end != item + len)
+      return false;
+    addStep(k, KEY_STEP_AT_IC, ic);
+    return true;
+  }
+  if (len > 3 && !strncmp(item, "pc=", 3)) {
+    unsigned long pc = strtoul(item + 3, &end, 16);
+    if (end != item + len || pc >= RAM_SIZE)
+      return false;
+    addStep(k, KEY_STEP_AT_PC, pc);
+    return true;
+  }
+  if (len == 3 && item[0] == '$' && isxdigit(item[1]) && isxdigit(item[2])) {
+    addKey(k, strtoul(item + 1, NULL, 16));
+    return true;
+  }
+  for (int i=0; KEY_NAMES[i].name; i++) {
+    if (strlen(KEY_NAMES[i].name) == len && !strncmp(item, KEY_NAMES[i].name, len)) {
+      addKey(k, KEY_NAMES[i].key);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Set the keys to type (see the top of this file). Keys before the first
+// step are typed straight away.
+bool setKeyScript(Emu* m, const char* script, size_t len) {
+  // Each character types at most one key, and each step takes at least six
+  // ("{ic=1}").
+  KeyScript* k = calloc(1, sizeof(KeyScript));
+  if (k) {
+    k->keys = malloc(len + 1);
+    k->steps = malloc((len / 6 + 1) * sizeof(KeyStep));
+  }
+  if (!k || !k->keys || !k->steps) {
+    destroyKeyScript(k);
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory for input script.");
+    return false;
+  }
+  k->generation = ++m->keyScriptCount;
+  addStep(k, KEY_STEP_NOW, 0);
+  bool ok = true;
+  size_t i = 0;
+  while (ok && i < len) {
+    char c = script[i];
+    if (c == '{') {
+      const char* close = memchr(script + i, '}', len - i);
+      ok = close && parseKeyItem(k, script + i + 1, close - (script + i + 1));
+      if (ok)
+        i = close - script + 1;
+      continue;
+    }
+    if (c == '\n')
+      addKey(k, 0x0D);
+    else if (c >= 'a' && c <= 'z')
+      addKey(k, c - 'a' + 'A');
+    else if (c >= 0x20 && c <= 0x5F)
+      addKey(k, c);
+    else
+      ok = c == '\r'; // for files with CRLF line ends
+    if (ok)
+      i++;
+  }
+  if (!ok) {
+    destroyKeyScript(k);
+    setFault(m, FAULT_ERROR, "Invalid input script at character %zu.", i);
+    return false;
+  }
+  for (unsigned s=0; s < k->stepCount; s++) {
+    if (k->steps[s].trigger != KEY_STEP_AT_PC)
+      continue;
+    ExecutionHook hook = { 0 };
+    hook.pcHookAddress = k->steps[s].value;
+    hook.hookType = HOOKTYPE_EXEC;
+    hook.hookID = s;
+    hook.name = "input script";
+    hook.callback = keyScriptHook;
+    hook.privateData = (void*)(uintptr_t)k->generation;
+    if (!registerHook(m, &hook)) {
+      destroyKeyScript(k);
+      return false;
+    }
+  }
+  destroyKeyScript(m->keys);
+  m->keys = k;
+  k->linePos = -1;
+  // The keys before the first step are typed now, but only go in the buffer
+  // when the program reads the keyboard, so CINT clearing it doesn't lose them.
+  k->typed = k->steps[k->nextStep++].end;
+  scheduleNextEvent(m);
+  return true;
+}
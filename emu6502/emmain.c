@@ -59,21 +59,68 @@ static inline char* spc4(char* s) {
 
 // TRACE OUTPUT
 
-void error(emu_t* m, const char* fmt, ...) {
-  FILE* f;
-  if (!m || !m->traceFile)
-    f = stderr;
-  else
-    f = m->traceFile;
+// FAULTS
+
+const char* FAULT_NAMES[] = {
+  "NONE",
+  "ERROR",
+  "ILLEGAL_INSTRUCTION",
+  "STACK",
+  "UNSUPPORTED",
+  "DISK",
+  "HOOK",
+  "OUT_OF_MEMORY",
+};
+
+static void vsetFault(emu_t* m, int code, const char* fmt, va_list ap) {
+  assert(code > FAULT_NONE && code < FAULT_COUNT);
+  m->fault.code = code;
+  m->fault.pc = m->reg.pc;
+  m->fault.ic = m->reg.ic;
+  vsnprintf(m->fault.message, FAULT_MESSAGE_SIZE, fmt, ap);
+  if (m->traceFile) {
+    fprintf(m->traceFile, "%s\n", m->fault.message);
+    fflush(m->traceFile);
+  }
+}
+
+void setFault(emu_t* m, int code, const char* fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(f, fmt, ap);
+  vsetFault(m, code, fmt, ap);
   va_end(ap);
-  putc('\n', f);
-  fflush(f);
+}
+
+static void vfault(emu_t* m, int code, const char* fmt, va_list ap)
+  __attribute__((noreturn));
+
+static void vfault(emu_t* m, int code, const char* fmt, va_list ap) {
+  if (!m) {
+    vfprintf(stderr, fmt, ap);
+    putc('\n', stderr);
+    exit(1);
+  }
+  vsetFault(m, code, fmt, ap);
+  if (m->faultJump)
+    longjmp(*m->faultJump, 1);
+  // Not emulating, so there's no caller to report the fault to.
+  if (!m->traceFile)
+    fprintf(stderr, "%s\n", m->fault.message);
   exit(1);
 }
 
+void fault(emu_t* m, int code, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfault(m, code, fmt, ap);
+}
+
+void error(emu_t* m, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfault(m, FAULT_ERROR, fmt, ap);
+}
+
 #if TRACE_ON
 void trace(emu_t* m, bool indent, const char* fmt, ...) {
   FILE* f = m->traceFile;
@@ -144,24 +191,29 @@ static void setNZ(emu_t* m, byte_t byteValue) {
   }
 }
 
-static void push(emu_t* m, byte_t operand) {
+void push(emu_t* m, byte_t operand) {
   if (SP == 0)
-    error(m, "Stack overflow.");
+    fault(m, FAULT_STACK, "Stack overflow.");
   traceStack(m, operand, '>');
   RAM[0x100 + SP] = operand;
+  m->memWrites++;
   SP--;
 }
 
-static byte_t pull(emu_t* m) {
+byte_t pull(emu_t* m) {
   if (SP == 0xFF)
-    error(m, "Stack underflow.");
+    fault(m, FAULT_STACK, "Stack underflow.");
   SP++;
   byte_t v = RAM[0x100 + SP];
-  setNZ(m, v);
   traceStack(m, v, '<');
   return v;
 }
 
+// Pull P. B and bit 5 only exist on the stack, so they're dropped.
+byte_t pullFlags(emu_t* m) {
+  return pull(m) & ~(FLAG_B | 0x20);
+}
+
 // C64 banks:
 // %x00: RAM visible in all three areas.
 // %x01: RAM visible at $A000-$BFFF and $E000-$FFFF.
@@ -183,21 +235,22 @@ byte_t loadBanked(Emu* m, word_t addr) {
 #define ROM_RANGE(RANGE_NAME, BEGIN, END) \
   if (BEGIN <= addr && addr <= END) { \
     word_t offset = addr - BEGIN; \
-    assert(offset < sizeof(m->rom.RANGE_NAME)); \
-    return m->rom.RANGE_NAME[offset - BEGIN]; \
+    assert(offset < sizeof(m->rom->RANGE_NAME)); \
+    return m->rom->RANGE_NAME[offset]; \
   }
 #define CHARACTER_ROM_VISIBLE   ROM_RANGE(chargen,  0xD000, 0xDFFF)
 #define BASIC_ROM_VISIBLE       ROM_RANGE(basic,    0xA000, 0xBFFF)
 #define KERNAL_ROM_VISIBLE      ROM_RANGE(kernal,   0xE000, 0xFFFF)
+#define IO_VISIBLE \
+  if ((addr & 0xF000) == 0xD000) return IO_PAGES[(addr >> 8) & 0x0F].read(m, addr)
 /*
-  if (0xD000 <= addr && addr <= 0xDFFF) return m->rom.chargen[addr - 0xD000]
-  if (0xA000 <= addr && addr <= 0xBFFF) return m->rom.basic[addr - 0xA000]
-  if (0xE000 <= addr && addr <= 0xFFFF) return m->rom.kernal[addr - 0xE000]
+  if (0xD000 <= addr && addr <= 0xDFFF) return m->rom->chargen[addr - 0xD000]
+  if (0xA000 <= addr && addr <= 0xBFFF) return m->rom->basic[addr - 0xA000]
+  if (0xE000 <= addr && addr <= 0xFFFF) return m->rom->kernal[addr - 0xE000]
 */
 
   // Switch block defines bank behavior.
-  // Note that we're not emulating I/O, so reads from the I/O area are treated
-  // as reads from RAM. We're also not emulating the EXROM or GAME pins.
+  // Note that we're not emulating the EXROM or GAME pins.
   switch (RAM[0x0001] & 0b111) {
 
     case 0b000:
@@ -218,14 +271,14 @@ byte_t loadBanked(Emu* m, word_t addr) {
     case 0b100:
       break;
     case 0b101:
-      // I/O at $D000-$DFFF
+      IO_VISIBLE;
       break;
     case 0b110:
-      // I/O at $D000-$DFFF
+      IO_VISIBLE;
       KERNAL_ROM_VISIBLE;
       break;
     case 0b111:
-      // I/O at $D000-$DFFF
+      IO_VISIBLE;
       BASIC_ROM_VISIBLE;
       KERNAL_ROM_VISIBLE;
       break;
@@ -233,6 +286,7 @@ byte_t loadBanked(Emu* m, word_t addr) {
   }
   return RAM[addr];
 
+#undef IO_VISIBLE
 #undef KERNAL_ROM_VISIBLE
 #undef BASIC_ROM_VISIBLE
 #undef CHARACTER_ROM_VISIBLE
@@ -241,17 +295,30 @@ byte_t loadBanked(Emu* m, word_t addr) {
 }
 
 byte_t load(emu_t* m, word_t addr) {
-  byte_t value = loadBanked(m, addr);
+  byte_t value = m->machine == MACHINE_C64 ? loadBanked(m, addr) : driveLoad(m, addr);
   trace(m, true, "LOAD %04X: %02X", addr, value);
   return value;
 }
 
 byte_t store(emu_t* m, byte_t value, word_t addr) {
   trace(m, true, "STORE %04X: %02X -> %02X", addr, m->ram[addr], value);
-  m->ram[addr] = value;
+  m->memWrites++;
+  if (m->machine != MACHINE_C64)
+    driveStore(m, value, addr);
+  else if ((addr & 0xF000) == 0xD000 && ioVisible(RAM[0x0001]))
+    IO_PAGES[(addr >> 8) & 0x0F].write(m, addr, value);
+  else
+    m->ram[addr] = value;
   return value;
 }
 
+// Load for a read-modify-write instruction, which writes the value back
+// before the result, as the 6502 does. That's how ASL $D019 acknowledges
+// the VIC's interrupts.
+static byte_t loadModify(emu_t* m, word_t addr) {
+  return store(m, load(m, addr), addr);
+}
+
 static byte_t bitwiseASL(emu_t* m, byte_t value) {
   setFlag(m, FLAG_C, value & 0x80);
   value <<= 1;
@@ -286,26 +353,6 @@ static byte_t bitwiseROR(emu_t* m, byte_t value) {
   return value;
 }
 
-static void add(emu_t* m, byte_t regVal, byte_t memVal, bool isCmp) {
-  word_t diff = regVal + memVal;
-  // The carry flag always means +1 here.
-  // This works for subtraction because we're subtracting the one's complement
-  // instead of the two's complement. (The +1 from the carry flag is the
-  // missing +1 to convert one's complement to two's complement.)
-  if (isCmp || getFlag(m, FLAG_C))
-    diff++; // CMP behaves like SBC with carry set
-  byte_t b = diff;
-  // All instructions set N, Z and C.
-  setNZ(m, b);
-  setFlag(m, FLAG_C, diff & 0x100);
-  if (!isCmp) {
-    // ADC and SBC set A and V, but compare instructions don't.
-    bool overflow = (regVal ^ b) & (memVal ^ b) & 0x80;
-    setFlag(m, FLAG_V, overflow);
-    A = b;
-  }
-}
-
 static void returnFromSub(emu_t* m) {
   word_t returnAddr = pull(m);
   returnAddr |= pull(m) << 8;
@@ -314,14 +361,74 @@ static void returnFromSub(emu_t* m) {
   m->reg.pc = returnAddr;
 }
 
+// Whether a trapped ROM routine is banked in. Calls into the top 4K of the
+// KERNAL are trapped whatever the banking, so unsupported ones there still
+// fault instead of running whatever is in RAM.
+static bool romTrapVisible(emu_t* m, word_t addr) {
+  if (addr >= 0xF000)
+    return true;
+  if (addr >= 0xE000)
+    return RAM[0x0001] & 0b010;
+  return (RAM[0x0001] & 0b011) == 0b011; // BASIC
+}
+
+// Called after a jump back to an address up to IDLE_LOOP_MAX_BYTES before
+// the end of the jump instruction (from), including a trapped JSR that
+// returns to itself. If the code since the same jump last went there didn't
+// store anything and left the registers as they were, every pass of the loop
+// from here does the same, until a timed event changes something. Then the
+// loop is skipped to the last pass before the next event, counting the
+// instructions it would have run. Every write to memory counts in memWrites:
+// stores, read-modify-write instructions, pushes, ROM traps that write and
+// the ACS bytecode engine, and so do reads of I/O registers that change on
+// their own. Loops that wait for a key from the input script or for a disk
+// swap end up here, as do ones polling I/O that only a timed event changes.
+static void idleLoopCheck(emu_t* m, word_t from) {
+  IdleLoop* loop = &m->idle;
+  const Registers* r = &m->reg;
+  if (loop->from == from && loop->to == r->pc && loop->memWrites == m->memWrites
+      && loop->reg.a == r->a && loop->reg.x == r->x && loop->reg.y == r->y
+      && loop->reg.p == r->p && loop->reg.s == r->s) {
+    uint64_t pass = r->ic - loop->reg.ic;
+    uint64_t passCycles = r->cycles - loop->reg.cycles;
+    // With no event due the loop never ends, so leave it to run.
+    if (m->nextEventIC != UINT64_MAX && m->nextEventIC > r->ic) {
+      uint64_t passes = (m->nextEventIC - r->ic) / pass;
+      if (passCycles && passes > (UINT64_MAX - r->cycles) / passCycles)
+        passes = (UINT64_MAX - r->cycles) / passCycles;
+      m->reg.cycles += passes * passCycles;
+      m->reg.ic += passes * pass;
+      loop->skipped += passes * pass;
+    }
+  }
+  loop->from = from;
+  loop->to = r->pc;
+  loop->reg = *r;
+  loop->memWrites = m->memWrites;
+}
+
 static void jump(emu_t* m, word_t addr, bool far) {
+  word_t from = m->reg.pc;
   traceSetPC(m, addr);
-  if (far && addr >= 0xF000) {
+  if (far && romTrapIndex[addr] && m->machine == MACHINE_C64 && romTrapVisible(m, addr)) {
+    // A trapped routine only takes the cycles of its RTS.
     emulateC64ROM(m, addr);
     returnFromSub(m);
+    m->reg.cycles += instructionSet[0x60].cycles;
   } else {
     m->reg.pc = addr;
   }
+  // Loops only wait for events on the C64, since reading the drive's I/O
+  // can change it. The trace shows every instruction, so it turns this off.
+  if ((word_t)(from - 1 - m->reg.pc) < IDLE_LOOP_MAX_BYTES
+      && m->machine == MACHINE_C64 && !(TRACE_ON && m->traceFile))
+    idleLoopCheck(m, from);
+}
+
+// A taken branch takes a cycle more, or two if it goes to another page.
+static void branch(emu_t* m, word_t addr) {
+  m->reg.cycles += (addr ^ PC) & 0xFF00 ? 2 : 1;
+  jump(m, addr, false);
 }
 
 // RESOLVE ADDRESSING MODES
@@ -330,10 +437,60 @@ static inline word_t deref(emu_t* m, word_t pointer) {
   return toWord(RAM[pointer], RAM[pointer+1]);
 }
 
+// Take an interrupt: IRQ and NMI from the event check in interpLoop, and BRK.
+// On the C64 the KERNAL's entry code ($FF48 for IRQ and BRK, $FE43 for NMI)
+// is done here instead of run, saving A, X and Y for IRQ and BRK and going
+// through the vector in RAM, to the handler's trap or the program's own.
+static void interrupt(emu_t* m, word_t vector, bool brk) {
+  push(m, toHi(PC));
+  push(m, toLo(PC));
+  push(m, (m->reg.p & ~FLAG_B) | (brk ? FLAG_B : 0) | 0x20);
+  setFlag(m, FLAG_I, true);
+  word_t addr = toWord(load(m, vector), load(m, vector + 1));
+  bool kernal = m->machine == MACHINE_C64 && romTrapVisible(m, 0xE000);
+  if (kernal && addr == C64_ROM_IRQ_ENTRY) {
+    push(m, A);
+    push(m, X);
+    push(m, Y);
+    addr = deref(m, brk ? RAM_CBINV : RAM_CINV);
+  } else if (kernal && addr == C64_ROM_NMI_ENTRY) {
+    addr = deref(m, RAM_NMINV);
+  }
+  trace(m, true, "%s -> %04X", brk ? "BRK" : vector == 0xFFFA ? "NMI" : "IRQ", addr);
+  jump(m, addr, kernal);
+}
+
+static void returnFromInterrupt(emu_t* m) {
+  m->reg.p = pullFlags(m);
+  word_t returnAddr = pull(m);
+  returnAddr |= pull(m) << 8;
+  traceSetPC(m, returnAddr);
+  m->reg.pc = returnAddr;
+  pollInterrupts(m);
+}
+
+// Called at a timed event, after the CIAs have run. Returns whether an
+// interrupt was taken.
+static bool takeInterrupts(emu_t* m) {
+  if (m->nmi) {
+    m->nmi = false;
+    interrupt(m, 0xFFFA, false);
+  } else if (m->irq && !getFlag(m, FLAG_I)) {
+    interrupt(m, 0xFFFE, false);
+  } else {
+    return false;
+  }
+  m->reg.cycles += INTERRUPT_CYCLES;
+  return true;
+}
+
+// Indexed modes add pageCycles to the cycle count when the index takes the
+// address to another page.
 static bool resolveAddress(
     emu_t* m,
     byte_t admd,
     AddrModeFlags_t admdFlags,
+    byte_t pageCycles,
     word_t* effAddr,
     word_t* rawAddr)
 {
@@ -350,6 +507,8 @@ static bool resolveAddress(
       addr += Y;
     else
       assert(admd == AM_abs);
+    if ((addr ^ *rawAddr) & 0xFF00)
+      m->reg.cycles += pageCycles;
   } else {
     if (admdFlags & AMF_Ind) {
       // indirect
@@ -357,8 +516,10 @@ static bool resolveAddress(
         addr = deref(m, addr + X);
       } else {
         if (admd == AM_indY) {
-          addr = deref(m, addr);
-          addr += Y;
+          word_t base = deref(m, addr);
+          addr = base + Y;
+          if ((addr ^ base) & 0xFF00)
+            m->reg.cycles += pageCycles;
         } else {
           assert(admd == AM_ind);
           addr |= RAM[PC++] << 8;
@@ -410,19 +571,19 @@ static void interpImm(emu_t* m, byte_t inst, byte_t operand) {
       // ADD / SUB
 
     case ADC:
-      add(m, m->reg.a, operand, false);
+      aluADC(&m->reg, operand);
       break;
     case SBC:
-      add(m, m->reg.a, ~operand, false);
+      aluSBC(&m->reg, operand);
       break;
     case CMP:
-      add(m, m->reg.a, ~operand, true);
+      aluCompare(&m->reg, m->reg.a, operand);
       break;
     case CPY:
-      add(m, m->reg.y, ~operand, true);
+      aluCompare(&m->reg, m->reg.y, operand);
       break;
     case CPX:
-      add(m, m->reg.x, ~operand, true);
+      aluCompare(&m->reg, m->reg.x, operand);
       break;
 
 
@@ -472,31 +633,31 @@ static void interpAddr(emu_t* m, byte_t inst, word_t addr) {
 
     case BPL:
       if (!getFlag(m, FLAG_N))
-        jump(m, addr, false);
+        branch(m, addr);
       break;
     case BMI:
       if (getFlag(m, FLAG_N))
-        jump(m, addr, false);
+        branch(m, addr);
       break;
     case BVS:
       if (getFlag(m, FLAG_V))
-        jump(m, addr, false);
+        branch(m, addr);
       break;
     case BCC:
       if (!getFlag(m, FLAG_C))
-        jump(m, addr, false);
+        branch(m, addr);
       break;
     case BCS:
       if (getFlag(m, FLAG_C))
-        jump(m, addr, false);
+        branch(m, addr);
       break;
     case BNE:
       if (!getFlag(m, FLAG_Z))
-        jump(m, addr, false);
+        branch(m, addr);
       break;
     case BEQ:
       if (getFlag(m, FLAG_Z))
-        jump(m, addr, false);
+        branch(m, addr);
       break;
 
       // LOAD
@@ -513,6 +674,14 @@ static void interpAddr(emu_t* m, byte_t inst, word_t addr) {
       m->reg.y = load(m, addr);
       setNZ(m, m->reg.y);
       break;
+    case BIT:
+      {
+        byte_t value = load(m, addr);
+        setFlag(m, FLAG_N, value & 0x80);
+        setFlag(m, FLAG_V, value & 0x40);
+        setFlag(m, FLAG_Z, !(m->reg.a & value));
+      }
+      break;
 
       // STORE
 
@@ -525,44 +694,36 @@ static void interpAddr(emu_t* m, byte_t inst, word_t addr) {
     case STY:
       store(m, m->reg.y, addr);
       break;
-    case BIT:
-      store(m, m->reg.p, addr);
-      break;
 
       // INCREMENT / DECREMENT
 
     case INC:
-      {
-        byte_t v = store(m, RAM[addr] + 1, addr);
-        setNZ(m, v);
-      }
+      setNZ(m, store(m, loadModify(m, addr) + 1, addr));
       break;
     case DEC:
-      {
-        byte_t v = store(m, RAM[addr] + 1, addr);
-        setNZ(m, v);
-      }
+      setNZ(m, store(m, loadModify(m, addr) - 1, addr));
       break;
 
       // BIT SHIFTS
 
     case ASL:
-        m->ram[addr] = bitwiseASL(m, m->ram[addr]);
-        break;
+      store(m, bitwiseASL(m, loadModify(m, addr)), addr);
+      break;
     case LSR:
-        m->ram[addr] = bitwiseLSR(m, m->ram[addr]);
-        break;
+      store(m, bitwiseLSR(m, loadModify(m, addr)), addr);
+      break;
     case ROL:
-        m->ram[addr] = bitwiseROL(m, m->ram[addr]);
-        break;
+      store(m, bitwiseROL(m, loadModify(m, addr)), addr);
+      break;
     case ROR:
-        m->ram[addr] = bitwiseROR(m, m->ram[addr]);
-        break;
+      store(m, bitwiseROR(m, loadModify(m, addr)), addr);
+      break;
 
     default:
         // The opcodes with immediate arguments can be applied to memory just
-        // by loading the value from memory and calling the same code.
-        interpImm(m, inst, m->ram[addr]);
+        // by loading the value from memory and calling the same code. It's
+        // loaded through the banking, so CMP $D012 sees the raster line.
+        interpImm(m, inst, load(m, addr));
 
   }
 }
@@ -574,23 +735,25 @@ static void interpImpl(emu_t* m, byte_t inst) {
 
     case RTS:
       if (m->reg.s > 0xFD)
-        error(m, "Stack underflow in RTS.");
+        fault(m, FAULT_STACK, "Stack underflow in RTS.");
       returnFromSub(m);
       break;
       
       // STACK
 
     case PHP:
-      push(m, m->reg.p);
+      push(m, m->reg.p | FLAG_B | 0x20);
       break;
     case PLP:
-      m->reg.p = pull(m);
+      m->reg.p = pullFlags(m);
+      pollInterrupts(m);
       break;
     case PHA:
       push(m, m->reg.a);
       break;
     case PLA:
       m->reg.a = pull(m);
+      setNZ(m, A);
       break;
 
       // FLAGS
@@ -612,6 +775,7 @@ static void interpImpl(emu_t* m, byte_t inst) {
       break;
     case CLI:
       setFlag(m, FLAG_I, false);
+      pollInterrupts(m);
       break;
     case SEI:
       setFlag(m, FLAG_I, true);
@@ -686,8 +850,14 @@ static void interpImpl(emu_t* m, byte_t inst) {
       // interrupts.
 
     case BRK:
+      PC++; // BRK skips a byte
+      interrupt(m, 0xFFFE, true);
+      break;
     case RTI:
-      error(m, "Interrupt-related opcodes not supported.");
+      if (m->reg.s > 0xFC)
+        fault(m, FAULT_STACK, "Stack underflow in RTI.");
+      returnFromInterrupt(m);
+      break;
 
     default:
       error(m, "%s:%d: Unexpected instruction: %s (PC=%04X, IC=" IC_FMT ")",
@@ -704,7 +874,8 @@ static void traceInstruction(
     byte_t admd,
     AddrModeFlags_t admdFlags,
     word_t operand,
-    word_t rawAddr)
+    word_t rawAddr,
+    uint64_t cycles)
 {
   char buf[TRACE_BUFSIZ];
   char* s = buf;
@@ -816,7 +987,8 @@ static void traceInstruction(
   s = putHexByte(s, (m->reg.ic >> 16) & 0xFF);
   s = putHexByte(s, (m->reg.ic >>  8) & 0xFF);
   s = putHexByte(s, (m->reg.ic >>  0) & 0xFF);
-  *s = 0;
+  // Cycles before the instruction, in decimal like VICE's monitor.
+  s += sprintf(s, " %" PRIu64, cycles);
   assert(s - buf < TRACE_BUFSIZ); // check buffer overflow
   trace(m, false, buf);
 }
@@ -826,42 +998,58 @@ static void traceInstruction(
 //| EXECUTION HOOKS |
 //|-----------------|
 
-static void expandHooksTable(emu_t* m) {
-  m->hooks.cap += 16;
-  m->hooks.hooks = realloc(m->hooks.hooks, m->hooks.cap * sizeof(ExecutionHook));
-  m->hooks.lookup = realloc(m->hooks.lookup, m->hooks.cap * sizeof(ExecutionHooksLookupTableRow));
-  if (!m->hooks.hooks) {
-    fprintf(stderr, "Out of memory while expanding hooks table.\n");
-    exit(1);
+static bool expandHooksTable(emu_t* m) {
+  int cap = m->hooks.cap + 16;
+  ExecutionHook* hooks =
+    realloc(m->hooks.hooks, cap * sizeof(ExecutionHook));
+  if (hooks)
+    m->hooks.hooks = hooks;
+  ExecutionHooksLookupTableRow* lookup =
+    realloc(m->hooks.lookup, cap * sizeof(ExecutionHooksLookupTableRow));
+  if (lookup)
+    m->hooks.lookup = lookup;
+  if (!hooks || !lookup) {
+    setFault(m, FAULT_OUT_OF_MEMORY, "Out of memory while expanding hooks table.");
+    return false;
   }
+  m->hooks.cap = cap;
+  return true;
 }
 
-void registerHook(emu_t* m, ExecutionHook* hook) {
+bool registerHook(emu_t* m, ExecutionHook* hook) {
   assert(hook != NULL);
-  assert(hook->callback != NULL);
-  assert(hook->pcHookAddress >= 0);
-  assert(hook->pcHookAddress < RAM_SIZE);
-  assert(hook->hookType >= 0);
-  assert(hook->hookType < HOOKTYPE_COUNT);
-  assert(hook->name != NULL);
+  if (hook->callback == NULL
+      || hook->pcHookAddress < 0
+      || hook->pcHookAddress >= RAM_SIZE
+      || hook->hookType < 0
+      || hook->hookType >= HOOKTYPE_COUNT
+      || hook->name == NULL) {
+    setFault(m, FAULT_HOOK, "Invalid execution hook '%s'.",
+        hook->name ? hook->name : "<unnamed>");
+    return false;
+  }
   if (m->hooks.len == m->hooks.cap)
-    expandHooksTable(m);
+    if (!expandHooksTable(m))
+      return false;
   m->hooks.hooks[m->hooks.len++] = *hook;
   m->hooks.ready = false;
+  return true;
+}
+
+static int compareInts(int a, int b) {
+  return (a > b) - (a < b);
 }
 
 int compareHooks(const void* argA, const void* argB) {
   const ExecutionHook* hookA = argA;
   const ExecutionHook* hookB = argB;
-  int cmp =
-    (int)hookA->pcHookAddress - (int)hookB->pcHookAddress
-    || (int)hookA->hookType - (int)hookB->hookType
-    || (int)hookA->isPostHook - (int)hookB->isPostHook
-    || (int)hookA->hookID - (int)hookB->hookID;
-  if (cmp == 0) {
-    fprintf(stderr, "ERROR: Duplicate execution hook '%s'.", hookA->name);
-    exit(1);
-  }
+  int cmp = compareInts(hookA->pcHookAddress, hookB->pcHookAddress);
+  if (cmp == 0)
+    cmp = compareInts(hookA->hookType, hookB->hookType);
+  if (cmp == 0)
+    cmp = compareInts(hookA->isPostHook, hookB->isPostHook);
+  if (cmp == 0)
+    cmp = compareInts(hookA->hookID, hookB->hookID);
   return cmp;
 }
 
@@ -871,6 +1059,11 @@ void sortHooks(emu_t* m) {
       m->hooks.len,
       sizeof(m->hooks.hooks[0]),
       compareHooks);
+  // Duplicates are adjacent after sorting.
+  for (int i=1; i < m->hooks.len; i++) {
+    if (compareHooks(&m->hooks.hooks[i-1], &m->hooks.hooks[i]) == 0)
+      fault(m, FAULT_HOOK, "Duplicate execution hook '%s'.", m->hooks.hooks[i].name);
+  }
 }
 
 void buildHooksLookupTable(emu_t* m) {
@@ -893,6 +1086,7 @@ void buildHooksLookupTable(emu_t* m) {
       m->hooks.lookup[lookupIndex].t[type].off = hookIndex;
       m->hooks.lookup[lookupIndex].t[type].len = 1;
     } else if (type != prevHookType) {
+      prevHookType = type;
       m->hooks.lookup[lookupIndex].t[type].off = hookIndex;
       m->hooks.lookup[lookupIndex].t[type].len = 1;
     } else {
@@ -902,9 +1096,29 @@ void buildHooksLookupTable(emu_t* m) {
   m->hooks.lookupLen = lookupIndex + 1;
 }
 
+// Flag the addresses that have exec hooks, so the interpreter can skip the
+// lookup for the rest with one bit test. There's no map if there are no exec
+// hooks.
+static void buildExecHookMap(emu_t* m) {
+  free(m->execHookMap);
+  m->execHookMap = NULL;
+  for (int i=0; i < m->hooks.len; i++) {
+    const ExecutionHook* hook = &m->hooks.hooks[i];
+    if (hook->hookType != HOOKTYPE_EXEC)
+      continue;
+    if (!m->execHookMap) {
+      m->execHookMap = calloc(RAM_SIZE / 8, 1);
+      if (!m->execHookMap)
+        fault(m, FAULT_OUT_OF_MEMORY, "Out of memory while preparing hooks.");
+    }
+    m->execHookMap[hook->pcHookAddress >> 3] |= 1 << (hook->pcHookAddress & 7);
+  }
+}
+
 void prepareHooks(emu_t* m) {
   sortHooks(m);
   buildHooksLookupTable(m);
+  buildExecHookMap(m);
   m->hooks.ready = true; // Mark hooks ready for lookup.
 }
 
@@ -929,10 +1143,33 @@ void lookupHooks(emu_t* m,
 //| MAIN ENTRY TO EMULATION |
 //|-------------------------|
 
-void interp(emu_t* m) {
-#if TRACE_ON
-  prepareHooks(m);
-#endif
+// Set the IC at which the interpreter next has to stop and check something:
+// the IC or cycle limit, the earliest timed disk swap or input script step, a
+// CIA timer running out, or a sync with drive CPUs. A waiting interrupt also
+// stops it (see pollInterrupts).
+void scheduleNextEvent(emu_t* m) {
+  uint64_t next = m->icLimit;
+  uint64_t cycleLimitIC = icAtCycle(m, m->cycleLimit);
+  if (cycleLimitIC < next)
+    next = cycleLimitIC;
+  uint64_t swapIC = diskNextSwapIC(m);
+  if (swapIC < next)
+    next = swapIC;
+  uint64_t keyIC = keyScriptNextIC(m);
+  if (keyIC < next)
+    next = keyIC;
+  uint64_t ciaIC = ciaNextIC(m);
+  if (ciaIC < next)
+    next = ciaIC;
+  if (m->driveSyncIC < next)
+    next = m->driveSyncIC;
+  m->nextEventIC = next;
+}
+
+static void interpLoop(emu_t* m) {
+  if (!m->hooks.ready)
+    prepareHooks(m);
+  scheduleNextEvent(m);
   for (;;) {
     word_t opcodeAddr = PC;
     byte_t opcode = RAM[opcodeAddr];
@@ -945,29 +1182,42 @@ void interp(emu_t* m) {
     // separating any machine-specific or game-specific functionality from the
     // emulator core.
 
-    PC++;
-    m->reg.ic++;
-
+    if (m->reg.ic >= m->nextEventIC) {
+      if (m->reg.ic >= m->icLimit || m->reg.cycles >= m->cycleLimit) {
 #if TRACE_ON
-    if (m->reg.ic == INSTRUCTION_COUNT_LIMIT) {
-      fprintf(stderr, "Too many instructions, stopping before the disk gets full.\n");
-      return;
-    }
+        if (m->icLimit == INSTRUCTION_COUNT_LIMIT)
+          fprintf(stderr, "Too many instructions, stopping before the disk gets full.\n");
 #endif
+        return;
+      }
+      diskRunSwapsAtIC(m);
+      keyScriptRunAtIC(m);
+      ciaRunAtIC(m);
+      driveSyncAtIC(m);
+      scheduleNextEvent(m);
+      if (takeInterrupts(m))
+        continue; // at the handler
+    }
 
-#if TRACE_ON
-    // Check for execution hooks.
-    ExecutionHook* hooks; // pointer to hooks found for this PC
-    int hooksCount; // will be 0 if no hooks for this PC
-    lookupHooks(m, opcodeAddr, HOOKTYPE_EXEC, &hooks, &hooksCount);
-
-    // Run pre hooks.
-    for (int i=0; i < hooksCount; i++) {
-      if (hooks[i].isPostHook)
-        break; // Post hooks sort after pre hooks
-      hooks[i].callback(m, opcodeAddr, &hooks[i]);
+    PC++;
+    m->reg.ic++;
+
+    // Check for execution hooks. Most addresses don't have any, and the map
+    // says so without a lookup.
+    if (m->execHookMap
+        && (m->execHookMap[opcodeAddr >> 3] & (1 << (opcodeAddr & 7)))) {
+      ExecutionHook* hooks; // pointer to hooks found for this PC
+      int hooksCount; // will be 0 if no hooks for this PC
+      lookupHooks(m, opcodeAddr, HOOKTYPE_EXEC, &hooks, &hooksCount);
+      m->memWrites++; // hooks can change anything
+
+      // Run pre hooks.
+      for (int i=0; i < hooksCount; i++) {
+        if (hooks[i].isPostHook)
+          break; // Post hooks sort after pre hooks
+        hooks[i].callback(m, opcodeAddr, &hooks[i]);
+      }
     }
-#endif
 
     // DECODE INSTRUCTION
 
@@ -975,8 +1225,13 @@ void interp(emu_t* m) {
     byte_t inst = instr.instruction;
     byte_t admd = instr.addressingMode;
     if (inst == 0)
-      error(m, "Illegal instruction: %02X (PC=%04X, IC=" IC_FMT ")",
+      fault(m, FAULT_ILLEGAL_INSTRUCTION,
+          "Illegal instruction: %02X (PC=%04X, IC=" IC_FMT ")",
           opcode, opcodeAddr, m->reg.ic);
+#if TRACE_ON
+    uint64_t startCycles = m->reg.cycles;
+#endif
+    m->reg.cycles += instr.cycles;
     AddrModeFlags_t admdFlags = addrModeInfo[admd].flags;
     word_t operand = 0;
     word_t rawOperand = -1;
@@ -984,7 +1239,7 @@ void interp(emu_t* m) {
     //bool isIndirect = false;
     if (admdFlags & AMF_Resolve) {
       //isIndirect =
-      resolveAddress(m, admd, admdFlags, &operand, &rawOperand);
+      resolveAddress(m, admd, admdFlags, instr.pageCycles, &operand, &rawOperand);
     } else {
       if (admd == AM_imm) {
         operand = RAM[PC];
@@ -997,7 +1252,7 @@ void interp(emu_t* m) {
     // TRACE
 
 #if TRACE_ON
-    traceInstruction(m, opcodeAddr, inst, admd, admdFlags, operand, rawOperand);
+    traceInstruction(m, opcodeAddr, inst, admd, admdFlags, operand, rawOperand, startCycles);
 #endif
 
     // EXECUTE
@@ -1013,18 +1268,35 @@ void interp(emu_t* m) {
         interpAddr(m, inst, operand);
         break;
     }
+  }
+}
 
+// Run the emulator until it stops. Faults raised while running unwind back
+// here, leaving the emulator state as it was at the fault.
+int interp(emu_t* m) {
+  jmp_buf faultJump;
+  jmp_buf* outerFaultJump = m->faultJump;
+  m->fault.code = FAULT_NONE;
+  if (setjmp(faultJump) == 0) {
+    m->faultJump = &faultJump;
+    interpLoop(m);
+  } else {
+    m->romCallEmbeddingLevel = 0;
   }
+  m->faultJump = outerFaultJump;
+  return m->fault.code;
 }
 
-// Returns the address where the file was loaded.
+// Returns the address where the file was loaded, or -1 if it can't be loaded.
 // Sets X:Y to the end address of the loaded file (the byte after the file
 // data).
-word_t loadPRG(emu_t* m, buf_t* prgFile) {
+int loadPRG(emu_t* m, buf_t* prgFile) {
   assert(m);
   assert(prgFile);
-  if (prgFile->len < 2)
-    error(m, "File data is too small to be a PRG file.");
+  if (prgFile->len < 2) {
+    setFault(m, FAULT_ERROR, "File data is too small to be a PRG file.");
+    return -1;
+  }
   byte_t* d = prgFile->data;
   for (int i=0; i < 6; i++)
     printf("%02x ", d[i]);
@@ -1035,8 +1307,11 @@ word_t loadPRG(emu_t* m, buf_t* prgFile) {
   if (top % 0x100 != 0)
     top = (top / 0x100 + 1) * 0x100;
   printf("Loading file of length %X at $%04X\n", len, loadAddr);
-  if (top >= RAM_SIZE)
-    error(m, "Not enough space to load file of length %X at address %X.", len, loadAddr);
+  if (top >= RAM_SIZE) {
+    setFault(m, FAULT_ERROR,
+        "Not enough space to load file of length %X at address %X.", len, loadAddr);
+    return -1;
+  }
   byte_t* src = d + 2;
   byte_t* dst = m->ram + loadAddr;
   for (unsigned i = 0; i < len; i++) {
@@ -1079,9 +1354,11 @@ word_t readLine(buf_t* f, unsigned off, char* s, unsigned limit) {
   return off;
 }
 
-void loadRegisters(emu_t* m, buf_t* regFile) {
-  if (regFile->len != 7)
-    error(m, "Invalid register file (wrong size).");
+bool loadRegisters(emu_t* m, buf_t* regFile) {
+  if (regFile->len != 7) {
+    setFault(m, FAULT_ERROR, "Invalid register file (wrong size).");
+    return false;
+  }
   uint8_t* r = regFile->data;
   PC = toWord(r[0], r[1]);
   A = r[2];
@@ -1089,45 +1366,141 @@ void loadRegisters(emu_t* m, buf_t* regFile) {
   Y = r[4];
   SP = r[5];
   m->reg.p = r[6];
+  return true;
+}
+
+static void freeRAM(emu_t* m) {
+  if (m->ramMapped)
+    bufUnmapCopyOnWrite(m->ram, RAM_SIZE);
+  else
+    free(m->ram);
+  m->ram = NULL;
+  m->ramMapped = false;
 }
 
-void loadRAM(emu_t* m, buf_t* ramFile) {
-  if (ramFile->len != RAM_SIZE)
-    error(m, "Invalid RAM file (wrong size).");
+bool loadRAM(emu_t* m, const buf_t* ramFile) {
+  if (ramFile->len != RAM_SIZE) {
+    setFault(m, FAULT_ERROR, "Invalid RAM file (wrong size).");
+    return false;
+  }
   memcpy(m->ram, ramFile->data, RAM_SIZE);
+  return true;
 }
 
-void mountDisk(emu_t* m, const char* path, buf_t* diskData) {
-  checkDiskSize(m, diskData);
-  m->diskdrive.mountedImagePath = path;
-  m->diskdrive.mountedImageData = diskData;
+// Load RAM from a base image that many emulators may share. If the image is a
+// mapped file, RAM becomes a copy-on-write view of it: nothing is copied up
+// front, and each emulator only gets its own copy of the pages it writes.
+// Otherwise this is the same as loadRAM.
+bool loadRAMCopyOnWrite(emu_t* m, const buf_t* ramFile) {
+  if (ramFile->len != RAM_SIZE) {
+    setFault(m, FAULT_ERROR, "Invalid RAM file (wrong size).");
+    return false;
+  }
+  byte_t* ram = bufMapCopyOnWrite(ramFile);
+  if (!ram)
+    return loadRAM(m, ramFile);
+  freeRAM(m);
+  m->ram = ram;
+  m->ramMapped = true;
+  return true;
 }
 
-void dumpRam(Emu* m, const char* path) {
+bool mountDisk(emu_t* m, const char* path, buf_t* diskData) {
+  return mountDiskWritable(m, DISKDRIVE_FIRST_DEVICE, path, diskData, DISK_WRITE_PROTECTED);
+}
+
+bool dumpRam(Emu* m, const char* path) {
   FILE* f = fopen(path, "wb");
   if (!f) {
-    fprintf(stderr, "Unable to open file: %s\n", path);
-    exit(1);
+    setFault(m, FAULT_ERROR, "Unable to open file: %s", path);
+    return false;
   }
   fwrite(RAM, 1, RAM_SIZE, f);
   //for (int addr=0; addr < RAM_SIZE; addr++) {
   //  putc(RAM[addr], f);
   //}
   fclose(f);
+  return true;
 }
 
-emu_t* createEmulator(FILE* traceFile) {
-  emu_t* m = calloc(1, sizeof(emu_t));
-  if (!m) {
+// ROM image used by new emulator instances. All instances share the same
+// image, so creating an emulator doesn't read or copy any ROM data.
+static const RomC64* sharedROM = &ROM_C64_BUILTIN;
+
+// Replace the built-in ROMs with the files chargen, basic and kernal from the
+// given directory. Affects emulators created after the call.
+bool loadSharedROM(const char* dir) {
+  RomC64* rom = malloc(sizeof(RomC64));
+  if (!rom) {
     fprintf(stderr, "Out of memory\n");
-    exit(1);
+    return false;
+  }
+  char path[FILENAME_MAX];
+  bool ok = true;
+  snprintf(path, sizeof(path), "%s/chargen", dir);
+  ok = ok && loadROM(path, rom->chargen, sizeof(rom->chargen));
+  snprintf(path, sizeof(path), "%s/basic", dir);
+  ok = ok && loadROM(path, rom->basic, sizeof(rom->basic));
+  snprintf(path, sizeof(path), "%s/kernal", dir);
+  ok = ok && loadROM(path, rom->kernal, sizeof(rom->kernal));
+  if (!ok) {
+    free(rom);
+    return false;
+  }
+  sharedROM = rom;
+  return true;
+}
+
+emu_t* createEmulator(FILE* traceFile) {
+  initRomTraps();
+  // sizeof(emu_t) is a multiple of its alignment, as aligned_alloc requires.
+  emu_t* m = aligned_alloc(CACHE_LINE_SIZE, sizeof(emu_t));
+  if (!m)
+    return NULL;
+  memset(m, 0, sizeof(emu_t));
+  m->ram = calloc(1, RAM_SIZE);
+  for (int i=0; i < DISKDRIVE_COUNT; i++)
+    m->diskdrives[i] = calloc(1, sizeof(DiskDrive));
+  m->diskdrive = m->diskdrives[0];
+  bool allocated = m->ram;
+  for (int i=0; allocated && i < DISKDRIVE_COUNT; i++)
+    allocated = m->diskdrives[i] != NULL;
+  if (!allocated) {
+    free(m->ram);
+    for (int i=0; i < DISKDRIVE_COUNT; i++)
+      free(m->diskdrives[i]);
+    free(m);
+    return NULL;
   }
   m->reg.s = 0xFF; // set S to top of stack
-  m->reg.p = FLAG_B; // set B flag so BIT works as expected
   m->traceFile = traceFile;
-  loadROM("rom/c64/chargen", m->rom.chargen, sizeof(m->rom.chargen));
-  loadROM("rom/c64/basic", m->rom.basic, sizeof(m->rom.basic));
-  loadROM("rom/c64/kernal", m->rom.kernal, sizeof(m->rom.kernal));
+  m->rom = sharedROM;
+  m->driveSyncIC = UINT64_MAX;
+  m->cycleLimit = UINT64_MAX;
+  ioReset(m);
+  ciaReset(m);
+  for (int i=0; i < DISKDRIVE_COUNT; i++)
+    diskReset(m->diskdrives[i]);
+#if TRACE_ON
+  m->icLimit = INSTRUCTION_COUNT_LIMIT;
+#else
+  m->icLimit = UINT64_MAX;
+#endif
   return m;
 }
 
+void destroyEmulator(emu_t* m) {
+  freeRAM(m);
+  for (int i=0; i < DISKDRIVE_COUNT; i++) {
+    detachDriveCPU(m, DISKDRIVE_FIRST_DEVICE + i);
+    unmountDisk(m, DISKDRIVE_FIRST_DEVICE + i);
+    free(m->diskdrives[i]->swaps);
+    free(m->diskdrives[i]);
+  }
+  free(m->hooks.hooks);
+  free(m->hooks.lookup);
+  free(m->execHookMap);
+  destroyDiskLog(m->diskLog);
+  destroyKeyScript(m->keys);
+  free(m);
+}
@@ -7,6 +7,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <memory.h>
+#include <pthread.h>
 
 #include "em.h"
 #include "emtrace.h"
@@ -17,7 +18,6 @@
 #define SERIAL_BUS_STATE_LISTENER 0x20
 
 
-#define RAM_NDX  0x00C6 // keyboard buffer count
 #define RAM_INDX 0x00C8 // end-of-line for input pointer
 #define RAM_LSXP 0x00C9 // input cursor log (row)
 #define RAM_LSTP 0x00CA // input cursor log (col)
@@ -31,6 +31,26 @@
 #define RAM_LNMX 0x00D5 // current screen line length
 #define RAM_TBLX 0x00D6 // row where cursor is
 #define RAM_DATA 0x00D6 // last inkey/checksum/buffer (scratch space)
+#define RAM_RVS  0x00C7 // print reversed characters
+#define RAM_INSRT 0x00D8 // inserted spaces left to fill
+#define RAM_USER 0x00F3 // pointer to color RAM line (word size)
+#define RAM_STKEY 0x0091 // stop key row (0x7F if stop is down)
+#define RAM_MSGFLG 0x009D // KERNAL message flags
+#define RAM_TIME 0x00A0 // jiffy clock (3 bytes, high first)
+#define RAM_TAPE1 0x00B2 // tape buffer pointer
+#define RAM_MEMSTR 0x0281 // bottom of memory for BASIC
+#define RAM_MEMSIZ 0x0283 // top of memory for BASIC
+#define RAM_TIMOUT 0x0285 // serial bus timeout flag
+#define RAM_COLOR 0x0286 // current text color
+#define RAM_HIBASE 0x0288 // screen memory page
+#define RAM_SHFLAG 0x028D // shift/ctrl/C= keys down
+
+#define KERNAL_VECTORS 0xFD30 // default KERNAL vectors, copied by RESTOR
+#define KERNAL_VECTORS_SIZE 32
+#define JIFFIES_PER_DAY 0x4F1A01 // the clock goes back to 0 here
+#define SCREEN_COLUMNS 40
+#define SCREEN_ROWS 25
+#define JIFFY_TIMER 0x4025 // PAL cycles between jiffy clock IRQs
 
 
 static inline int getSerialBusAddrState(Emu* m) {
@@ -74,10 +94,11 @@ static void romFetchFileTableEntries(emu_t* m, int fileTableRow) {
 static void romCLRCH(emu_t* m) {
   byte_t outputChannel = RAM[RAM_DFLTO];
   byte_t inputChannel = RAM[RAM_DFLTN];
-  if (outputChannel < 3) {
+  // Only serial devices (4 and up) need to be released.
+  if (outputChannel > 3) {
     emulateC64ROM(m, C64_ROM_CALL_UNLSN);
   }
-  if (inputChannel < 3) {
+  if (inputChannel > 3) {
     emulateC64ROM(m, C64_ROM_CALL_UNTLK);
   }
   RAM[RAM_DFLTO] = 3; // output to screen
@@ -101,7 +122,7 @@ static void romOpen(emu_t* m) {
   RAM[RAM_SAT + nextFileIndex] = RAM[RAM_SA];
   byte_t deviceNumber = RAM[RAM_FA];
   RAM[RAM_FAT + nextFileIndex] = deviceNumber;
-  if (deviceNumber >= 8)
+  if (IS_DISK_DEVICE(deviceNumber))
     diskOPEN(m);
   else
     switch (deviceNumber) {
@@ -109,11 +130,11 @@ static void romOpen(emu_t* m) {
       case 3: // screen
         break; // do nothing
       case 1:
-        error(m, "Datasette I/O not supported.");
+        fault(m, FAULT_UNSUPPORTED, "Datasette I/O not supported.");
       case 2:
-        error(m, "RS-232C I/O not supported.");
+        fault(m, FAULT_UNSUPPORTED, "RS-232C I/O not supported.");
       default:
-        error(m, "Raw serial I/O not supported.");
+        fault(m, FAULT_UNSUPPORTED, "Raw serial I/O not supported.");
     }
   setFlag(m, FLAG_C, false); // good return status
 }
@@ -149,9 +170,9 @@ void romCHKIN(emu_t* m, int logicalFileNumber) {
       // do nothing
       break;
     case 1:
-      error(m, "Datasette not supported.");
+      fault(m, FAULT_UNSUPPORTED, "Datasette not supported.");
     case 2:
-      error(m, "RS-232 not supported.");
+      fault(m, FAULT_UNSUPPORTED, "RS-232 not supported.");
     default:
       {
         A = deviceNumber;
@@ -163,6 +184,38 @@ void romCHKIN(emu_t* m, int logicalFileNumber) {
       }
       break;
   }
+  RAM[RAM_DFLTN] = deviceNumber; // input now comes from this device
+  setFlag(m, FLAG_C, false);
+}
+
+void romCHKOUT(emu_t* m, int logicalFileNumber) {
+  int fileTableRow = romLookupFileNumber(m, logicalFileNumber, true);
+  if (fileTableRow < 0) {
+    romError(m, 3); // file not open
+    return;
+  }
+  romFetchFileTableEntries(m, fileTableRow);
+  unsigned deviceNumber = RAM[RAM_FA];
+  switch (deviceNumber) {
+    case 0:
+      romError(m, 7); // not output file
+      return;
+    case 3:
+      // do nothing
+      break;
+    case 1:
+      fault(m, FAULT_UNSUPPORTED, "Datasette not supported.");
+    case 2:
+      fault(m, FAULT_UNSUPPORTED, "RS-232 not supported.");
+    default:
+      A = deviceNumber;
+      emulateC64ROM(m, C64_ROM_CALL_LISTEN);
+      A = RAM[RAM_SA];
+      emulateC64ROM(m, C64_ROM_CALL_SECOND);
+      break;
+  }
+  RAM[RAM_DFLTO] = deviceNumber; // output now goes to this device
+  setFlag(m, FLAG_C, false);
 }
 
 void removeFileTableEntry(Emu* m, int tableIndex) {
@@ -202,7 +255,7 @@ void romCloseInternal(Emu* m, int fd) {
       break; // nothing to do
     case 1: // Datasette
     case 2: // RS232
-      error(m, "Unsupported device: %d", devNo);
+      fault(m, FAULT_UNSUPPORTED, "Unsupported device: %d", devNo);
     default: // serial
       romCloseSerial(m);
   }
@@ -228,12 +281,6 @@ void romClrch(Emu* m) {
 }
 
 #if 0
-void romBsoutScreen(Emu* m, byte_t character) {
-  char displayChar = renderDisplayChar(character);
-  romTrace(m, "Print character to screen: '%c'", displayChar);
-  // TODO: Implement routine so we write to screen RAM
-}
-
 void romInputLineUntilCR(Emu* m) {
   // BASIN for keyboard, screen
   // label LOOP5
@@ -274,261 +321,1102 @@ void romInputLineUntilCR(Emu* m) {
 }
 #endif
 
-void emulateC64ROM(emu_t* m, word_t callAddr) {
-  m->romCallEmbeddingLevel++;
-  switch (callAddr) {
+// SCREEN EDITOR
+//
+// BSOUT to the screen works on screen and color RAM the way the KERNAL's
+// editor does, except that lines are always 40 columns: a line that runs
+// over doesn't link to the next one to make an 80 column line.
 
-    case C64_ROM_CALL_CHKIN:
-      romTrace(m, "ROM %04X: CHKIN(X:logFiNo=%02X)", callAddr, X);
-      romCHKIN(m, X);
-      break;
+static word_t screenBase(Emu* m) {
+  return toWord(0, RAM[RAM_HIBASE] & 0xFC); // the VIC sees 1K pages
+}
 
-    case C64_ROM_CALL_GETIN:
-      // FIXME: RETURNING DUMMY DATA
-      A = 0x30; // this is what ACS receives here in VICE
-      romTrace(m, "ROM %04X: GETIN() -> %02X", callAddr, A);
-      break;
+static byte_t* screenLine(Emu* m, unsigned row) {
+  return &RAM[screenBase(m) + row * SCREEN_COLUMNS];
+}
 
-    case C64_ROM_CALL_CLRCHN:
-      romTrace(m, "ROM %04X: CLRCHN()", callAddr);
-      romClrch(m);
-      break;
+static byte_t* colorLine(Emu* m, unsigned row) {
+  return &m->colorRam[row * SCREEN_COLUMNS];
+}
 
-    case C64_ROM_CALL_BSOUT:
-      {
-        int device = RAM[RAM_DFLTO];
-        char displayChar = renderDisplayChar(A);
-        romTrace(m, "ROM %04X: BSOUT(A=%02X '%c') [dev=%d]",
-            callAddr, A, displayChar, device);
-        switch (device) {
-          case 0:
-            error(m, "BSOUT to keyboard is invalid.");
-          case 1:
-          case 2:
-            error(m, "BSOUT not supported on device %d.", device);
-          case 3:
-            romTrace(m, "ROM (BSOUT not yet supported for screen, ignored)");
-            //error(m, "BSOUT not yet supported for screen.");
-            // FIXME: Uncomment.
-            //romBsoutScreen(m, A);
-            break;
-          default:
-            romTrace(m, "BSOUT calls CIOUT for serial device.");
-            emulateC64ROM(m, C64_ROM_CALL_CIOUT);
+static void romSetCursor(Emu* m, byte_t row, byte_t col) {
+  word_t line = screenBase(m) + row * SCREEN_COLUMNS;
+  word_t colorLine = COLOR_RAM + row * SCREEN_COLUMNS;
+  RAM[RAM_TBLX] = row;
+  RAM[RAM_PNTR] = col;
+  RAM[RAM_PNT_LO] = toLo(line);
+  RAM[RAM_PNT_HI] = toHi(line);
+  RAM[RAM_USER] = toLo(colorLine);
+  RAM[RAM_USER+1] = toHi(colorLine);
+  RAM[RAM_LNMX] = SCREEN_COLUMNS - 1;
+}
+
+static void clearScreenLine(Emu* m, unsigned row) {
+  memset(screenLine(m, row), ' ', SCREEN_COLUMNS);
+  memset(colorLine(m, row), RAM[RAM_COLOR] & 0x0F, SCREEN_COLUMNS);
+}
+
+static void scrollScreen(Emu* m) {
+  memmove(screenLine(m, 0), screenLine(m, 1), (SCREEN_ROWS - 1) * SCREEN_COLUMNS);
+  memmove(colorLine(m, 0), colorLine(m, 1), (SCREEN_ROWS - 1) * SCREEN_COLUMNS);
+  clearScreenLine(m, SCREEN_ROWS - 1);
+}
+
+// Move the cursor to the start of the next line, scrolling at the bottom.
+static void screenNewLine(Emu* m) {
+  unsigned row = RAM[RAM_TBLX] + 1;
+  if (row >= SCREEN_ROWS) {
+    scrollScreen(m);
+    row = SCREEN_ROWS - 1;
+  }
+  romSetCursor(m, row, 0);
+}
+
+// Screen code of a printable PETSCII character.
+static byte_t petsciiToScreenCode(byte_t c) {
+  if (c == 0xFF)
+    return 0x5E; // pi
+  switch (c >> 5) {
+    case 1: return c;        // $20-$3F
+    case 2: return c - 0x40; // $40-$5F
+    case 3: return c - 0x20; // $60-$7F
+    case 5: return c - 0x40; // $A0-$BF
+    case 6: return c - 0x80; // $C0-$DF
+    case 7: return c - 0x80; // $E0-$FE
+  }
+  // Control codes in quotes show as reversed characters.
+  return c < 0x20 ? c | 0x80 : c + 0x40;
+}
+
+// Text printed to the screen, in ASCII, for the screen log. Returns 0 for
+// characters that don't have one.
+static char petsciiToAscii(Emu* m, byte_t c) {
+  bool lowercase = m->vic[VIC_MEMORY] & 0x02;
+  if (c == 0x0D || c == 0x8D)
+    return '\n';
+  if (c >= 0x41 && c <= 0x5A)
+    return lowercase ? c + 0x20 : c;
+  if ((c >= 0x61 && c <= 0x7A) || (c >= 0xC1 && c <= 0xDA))
+    return lowercase ? (c & 0x1F) + 0x40 : '~'; // graphics in upper case
+  if (c >= 0x20 && c <= 0x5F)
+    return c;
+  if (c == 0xA0)
+    return ' ';
+  return (c & 0x7F) >= 0x20 ? '~' : 0;
+}
+
+static const byte_t PETSCII_COLORS[16] = {
+  0x90, 0x05, 0x1C, 0x9F, 0x9C, 0x1E, 0x1F, 0x9E,
+  0x81, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0x9B,
+};
+
+static void screenPutCode(Emu* m, byte_t code) {
+  unsigned row = RAM[RAM_TBLX];
+  unsigned col = RAM[RAM_PNTR];
+  if (RAM[RAM_RVS])
+    code |= 0x80;
+  screenLine(m, row)[col] = code;
+  colorLine(m, row)[col] = RAM[RAM_COLOR] & 0x0F;
+  if (col + 1 < SCREEN_COLUMNS)
+    romSetCursor(m, row, col + 1);
+  else
+    screenNewLine(m);
+}
+
+// Carry out a control code. The ones the editor doesn't use do nothing.
+static void screenControl(Emu* m, byte_t c) {
+  unsigned row = RAM[RAM_TBLX];
+  unsigned col = RAM[RAM_PNTR];
+  byte_t* line = screenLine(m, row);
+  byte_t* colors = colorLine(m, row);
+  switch (c) {
+    case 0x0D: // return
+    case 0x8D: // shifted return
+      RAM[RAM_RVS] = 0;
+      RAM[RAM_QTSW] = 0;
+      RAM[RAM_INSRT] = 0;
+      screenNewLine(m);
+      return;
+    case 0x11: // down
+      if (row + 1 < SCREEN_ROWS)
+        romSetCursor(m, row + 1, col);
+      else {
+        scrollScreen(m);
+        romSetCursor(m, row, col);
+      }
+      return;
+    case 0x91: // up
+      if (row > 0)
+        romSetCursor(m, row - 1, col);
+      return;
+    case 0x1D: // right
+      if (col + 1 < SCREEN_COLUMNS)
+        romSetCursor(m, row, col + 1);
+      else
+        screenNewLine(m);
+      return;
+    case 0x9D: // left
+      if (col > 0)
+        romSetCursor(m, row, col - 1);
+      else if (row > 0)
+        romSetCursor(m, row - 1, SCREEN_COLUMNS - 1);
+      return;
+    case 0x13: // home
+      romSetCursor(m, 0, 0);
+      return;
+    case 0x93: // clear
+      emulateC64ROM(m, C64_ROM_CALL_CLSR);
+      return;
+    case 0x12: // reverse on
+      RAM[RAM_RVS] = 1;
+      return;
+    case 0x92: // reverse off
+      RAM[RAM_RVS] = 0;
+      return;
+    case 0x14: // delete
+      if (col == 0) {
+        if (row > 0) {
+          romSetCursor(m, row - 1, SCREEN_COLUMNS - 1);
+          screenLine(m, row - 1)[SCREEN_COLUMNS - 1] = ' ';
         }
+        return;
       }
-      break;
+      memmove(line + col - 1, line + col, SCREEN_COLUMNS - col);
+      memmove(colors + col - 1, colors + col, SCREEN_COLUMNS - col);
+      line[SCREEN_COLUMNS - 1] = ' ';
+      romSetCursor(m, row, col - 1);
+      return;
+    case 0x94: // insert
+      if (line[SCREEN_COLUMNS - 1] == ' ') {
+        memmove(line + col + 1, line + col, SCREEN_COLUMNS - 1 - col);
+        memmove(colors + col + 1, colors + col, SCREEN_COLUMNS - 1 - col);
+        line[col] = ' ';
+        RAM[RAM_INSRT]++;
+      }
+      return;
+    case 0x0E: // lower case
+      m->vic[VIC_MEMORY] |= 0x02;
+      return;
+    case 0x8E: // upper case
+      m->vic[VIC_MEMORY] &= ~0x02;
+      return;
+  }
+  for (int i=0; i < 16; i++) {
+    if (c == PETSCII_COLORS[i]) {
+      RAM[RAM_COLOR] = i;
+      return;
+    }
+  }
+}
 
-    case C64_ROM_CALL_BASIN:
-      // BASIN: INPUT CHARACTER FROM CHANNEL INPUT DIFFERS FROM GET ON DEVICE
-      // #0 FUNCTION WHICH IS KEYBOARD. THE SCREEN EDITOR MAKES READY AN ENTIRE
-      // LINE WHICH IS PASSED CHAR BY CHAR UP TO THE CARRIAGE RETURN. OTHER
-      // DEVICES ARE: 0 KEYBOARD; 1 CASSETTE #1; 2 RS232; 3 SCREEN; 4-31 SERIAL
-      // BUS
-      {
-        int device = RAM[RAM_DFLTN];
-        if (device == 0) {
-        } else if (device == 3) {
-        }
-        char displayChar = renderDisplayChar(A);
-        romTrace(m, "ROM %04X: BSOUT(A=%02X '%c') [dev=%d]",
-            callAddr, A, displayChar, device);
-        switch (device) {
-          case 0:
-            error(m, "BASIN not supported on keyboard yet.");
-#if 0
-            // save cursor row, column
-            RAM[RAM_LSXP] = RAM[RAM_TBLX]; // row
-            RAM[RAM_LSTP] = RAM[RAM_PNTR]; // col
-            romInputLineUntilCR(m);
-            break;
+static void romBsoutScreen(Emu* m, byte_t c) {
+  char ascii = petsciiToAscii(m, c);
+  if (ascii && m->screenLog)
+    putc(ascii, m->screenLog);
+  bool control = (c & 0x7F) < 0x20;
+  // In quotes or after inserts, control codes other than return (and
+  // delete, in quotes) print instead of acting.
+  bool literal = control && c != 0x0D && c != 0x8D
+      && (RAM[RAM_INSRT] > 0 || (RAM[RAM_QTSW] && c != 0x14));
+  if (RAM[RAM_INSRT] > 0 && c != 0x0D && c != 0x8D)
+    RAM[RAM_INSRT]--;
+  if (control && !literal) {
+    screenControl(m, c);
+    return;
+  }
+  if (c == '"')
+    RAM[RAM_QTSW] ^= 1;
+  screenPutCode(m, petsciiToScreenCode(c));
+}
+
+// Write the screen as text, a line for each row without trailing spaces.
+bool writeScreenText(Emu* m, const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    setFault(m, FAULT_ERROR, "Unable to write screen: %s", path);
+    return false;
+  }
+  bool lowercase = m->vic[VIC_MEMORY] & 0x02;
+  for (unsigned row=0; row < SCREEN_ROWS; row++) {
+    char text[SCREEN_COLUMNS + 1];
+    int len = 0;
+    const byte_t* line = screenLine(m, row);
+    for (unsigned col=0; col < SCREEN_COLUMNS; col++) {
+      byte_t code = line[col] & 0x7F; // reversed or not
+      char c;
+      if (code == 0)
+        c = '@';
+      else if (code < 0x1B)
+        c = code + (lowercase ? 0x60 : 0x40);
+      else if (code < 0x40)
+        c = code < 0x20 ? code + 0x40 : code;
+      else if (lowercase && code >= 0x41 && code <= 0x5A)
+        c = code;
+      else
+        c = code == 0x60 ? ' ' : '~'; // graphics
+      text[col] = c;
+      if (c != ' ')
+        len = col + 1;
+    }
+    text[len] = 0;
+    fprintf(f, "%s\n", text);
+  }
+  if (fclose(f) != 0) {
+    setFault(m, FAULT_ERROR, "Unable to write screen: %s", path);
+    return false;
+  }
+  return true;
+}
+
+// The address of the JSR that called a trap, or -1 if it wasn't called by a
+// JSR (or was called by another trap).
+static int romCallSite(Emu* m, word_t callAddr) {
+  if (m->romCallEmbeddingLevel != 1)
+    return -1;
+  word_t call = toWord(RAM[0x100 + (byte_t)(SP + 1)], RAM[0x100 + (byte_t)(SP + 2)]) - 2;
+  if (RAM[call] != 0x20 || toWord(RAM[call+1], RAM[call+2]) != callAddr)
+    return -1;
+  return call;
+}
+
+// KEYBOARD INPUT
+
+// Wait for keys to be typed by leaving the return address pointing back at
+// the JSR, so the program calls the trap again and the instruction count
+// (and the input script's steps) move on.
+static void romWaitForKeys(Emu* m, word_t callAddr) {
+  if (!keyScriptPending(m))
+    error(m, "Waiting for a key after the end of the input script.");
+  int site = romCallSite(m, callAddr);
+  if (site < 0)
+    fault(m, FAULT_UNSUPPORTED, "Can't wait for keys in ROM call %04X.", callAddr);
+  // Only the instruction count moves on while waiting here.
+  const KeyStep* next = &m->keys->steps[m->keys->nextStep];
+  if (next->trigger == KEY_STEP_AT_PC && next->value != (uint64_t)site)
+    error(m, "Waiting for a key that's typed at PC=%04X.", (unsigned)next->value);
+  word_t again = site - 1; // RTS adds one
+  RAM[0x100 + (byte_t)(SP + 1)] = toLo(again);
+  RAM[0x100 + (byte_t)(SP + 2)] = toHi(again);
+}
+
+// BASIN from the keyboard. The editor takes the typed keys up to a RETURN
+// as a line, echoing them on the screen, then returns the line a character
+// at a time and a return at the end. DEL takes back the last character, and
+// other control keys only move the cursor.
+static bool romBasinKeyboard(Emu* m, word_t callAddr) {
+  KeyScript* k = m->keys;
+  if (!k)
+    fault(m, FAULT_UNSUPPORTED, "BASIN from the keyboard needs an input script.");
+  if (k->linePos < 0) {
+    if (!keyboardHasLine(m)) {
+      romWaitForKeys(m, callAddr);
+      return false;
+    }
+    k->lineLen = 0;
+    for (int key; (key = keyboardTake(m)) != 0x0D; ) {
+      if (key == 0x14) {
+        if (k->lineLen == 0)
+          continue;
+        k->lineLen--;
+      } else if ((key & 0x7F) >= 0x20) {
+        if (k->lineLen == KEY_LINE_MAX)
+          continue;
+        k->line[k->lineLen++] = key;
+      }
+      romBsoutScreen(m, key);
+    }
+    k->linePos = 0;
+  }
+  m->memWrites++; // the next call returns the next character
+  if ((unsigned)k->linePos < k->lineLen) {
+    A = k->line[k->linePos++];
+  } else {
+    A = 0x0D;
+    k->linePos = -1;
+    romBsoutScreen(m, A);
+  }
+  return true;
+}
+
+static void romSetNZ(Emu* m, byte_t value) {
+  setFlag(m, FLAG_N, value & 0x80);
+  setFlag(m, FLAG_Z, value == 0);
+}
+
+// BULK SERIAL TRANSFERS
+//
+// Loaders move a buffer a byte at a time with loops like these:
+//   loop: JSR ACPTR      loop: LDA (ptr),Y
+//         STA (ptr),Y          JSR CIOUT
+//         INY                  INY
+//         BNE loop             BNE loop
+// (or with BASIN and BSOUT, or abs,Y). When a trap finds it was called from
+// one of them, it does the calls up to the loop's last one in a block, and
+// leaves the registers, status, instruction count and cycles the way the loop
+// would have. The interpreter then runs the rest of the last pass.
+
+// Instructions in each pass through the loop (the JSR counts as one).
+#define TRANSFER_LOOP_INSTRUCTIONS 4
+
+typedef struct {
+  word_t head; // first instruction, where the BNE goes back to
+  word_t end;  // after the BNE
+  word_t data; // address the loop stores or loads at, before adding Y
+  byte_t access; // opcode of the STA or LDA
+} TransferLoop;
+
+// Cycles of a pass through a loop with Y at the start of the pass. The
+// trapped call takes the cycles of its JSR and RTS (see jump).
+static unsigned transferLoopCycles(const TransferLoop* loop, byte_t y) {
+  const instruction_t* access = &instructionSet[loop->access];
+  unsigned cycles = instructionSet[0x20].cycles + instructionSet[0x60].cycles
+      + access->cycles + instructionSet[0xC8].cycles + instructionSet[0xD0].cycles;
+  if ((loop->data ^ (loop->data + y)) & 0xFF00)
+    cycles += access->pageCycles;
+  return cycles + ((loop->head ^ loop->end) & 0xFF00 ? 2 : 1); // BNE taken
+}
+
+// Decode the loop that a trap was called from, if it is one.
+static bool findTransferLoop(Emu* m, word_t callAddr, bool write, TransferLoop* loop) {
+#if TRACE_ON
+  if (m->traceFile)
+    return false; // run it all to trace it
 #endif
-          case 1:
-          case 2:
-            error(m, "BASIN not supported on device %d.", device);
-          case 3:
-            error(m, "BASIN not supported on screen yet.");
+  int site = romCallSite(m, callAddr);
+  if (site < 0 || Y == 0xFF)
+    return false;
+  word_t call = site;
+  word_t ret = call + 3;
+  word_t p = ret;
+  word_t access = call; // the STA or LDA
+  if (!write) {
+    access = p;
+    p += RAM[p] == 0x91 ? 2 : 3;
+  }
+  if (RAM[p] != 0xC8 || RAM[p+1] != 0xD0)
+    return false; // not INY, BNE
+  loop->end = p + 3;
+  loop->head = loop->end + (int8_t)RAM[p+2];
+  if (write) {
+    access = loop->head;
+    if (access + (RAM[access] == 0xB1 ? 2 : 3) != call)
+      return false;
+  } else if (loop->head != call) {
+    return false;
+  }
+  byte_t op = RAM[access];
+  loop->access = op;
+  if (op == (write ? 0xB1 : 0x91))
+    loop->data = toWord(RAM[RAM[access+1]], RAM[(byte_t)(RAM[access+1] + 1)]);
+  else if (op == (write ? 0xB9 : 0x99))
+    loop->data = toWord(RAM[access+1], RAM[access+2]);
+  else
+    return false;
+  if (loop->data > 0xFF00)
+    return false; // Y would wrap around memory
+  for (word_t a = loop->head; m->execHookMap && a != loop->end; a++) {
+    if (m->execHookMap[a >> 3] & (1 << (a & 7)))
+      return false;
+  }
+  return true;
+}
+
+// Passes of a loop that can run before the next event is due.
+static unsigned transferLoopPasses(Emu* m) {
+  uint64_t passes = (m->nextEventIC - m->reg.ic) / TRANSFER_LOOP_INSTRUCTIONS;
+  unsigned left = 0xFF - Y; // before the last pass
+  return passes < left ? passes : left;
+}
+
+// Called by ACPTR and BASIN after reading a byte into A.
+static void romBulkRead(Emu* m, word_t callAddr) {
+  TransferLoop loop;
+  if (!findTransferLoop(m, callAddr, false, &loop))
+    return;
+  unsigned passes = transferLoopPasses(m);
+  word_t dest = loop.data + Y;
+  // Stores over the zero page (with the pointer and status), the stack or the
+  // loop itself change what the loop does.
+  if (passes == 0 || dest < 0x200 || (dest < loop.end && dest + passes > loop.head))
+    return;
+  byte_t bytes[SECTOR_SIZE];
+  bytes[0] = A;
+  unsigned n = diskACPTRBlock(m, bytes + 1, passes);
+  // Bytes stored into I/O go through its handlers, as the loop's stores do.
+  if (dest + n > 0xD000 && dest < 0xE000 && ioVisible(RAM[0x0001])) {
+    for (unsigned i=0; i < n; i++)
+      store(m, bytes[i], dest + i);
+  } else {
+    memcpy(&RAM[dest], bytes, n);
+    m->memWrites++; // BASIN is a read only trap (see idleLoopCheck)
+  }
+  A = bytes[n];
+  romSetNZ(m, A);
+  for (unsigned i=0; i < n; i++)
+    m->reg.cycles += transferLoopCycles(&loop, Y++);
+  m->reg.ic += n * TRANSFER_LOOP_INSTRUCTIONS;
+  m->romTrapCalls[romTrapIndex[callAddr]] += n;
+  if (callAddr != C64_ROM_CALL_ACPTR)
+    m->romTrapCalls[romTrapIndex[C64_ROM_CALL_ACPTR]] += n;
+}
+
+// Called by CIOUT and BSOUT after sending the byte in A.
+static void romBulkWrite(Emu* m, word_t callAddr) {
+  TransferLoop loop;
+  if (!findTransferLoop(m, callAddr, true, &loop))
+    return;
+  unsigned passes = transferLoopPasses(m);
+  if (passes == 0)
+    return;
+  byte_t bytes[SECTOR_SIZE];
+  for (unsigned i=0; i < passes; i++)
+    bytes[i] = load(m, loop.data + Y + 1 + i);
+  diskCIOUTBlock(m, bytes, passes);
+  A = bytes[passes - 1];
+  romSetNZ(m, A); // from the LDA
+  for (unsigned i=0; i < passes; i++)
+    m->reg.cycles += transferLoopCycles(&loop, ++Y);
+  m->reg.ic += passes * TRANSFER_LOOP_INSTRUCTIONS;
+  m->romTrapCalls[romTrapIndex[callAddr]] += passes;
+  if (callAddr != C64_ROM_CALL_CIOUT)
+    m->romTrapCalls[romTrapIndex[C64_ROM_CALL_CIOUT]] += passes;
+}
+
+// ROM TRAPS
+//
+// Each emulated ROM routine is a trap handler. A JSR or JMP to a trapped
+// address calls the handler (see jump in emmain.c), and so do the handlers
+// themselves when one ROM routine calls another.
+
+static void romUnsupported(Emu* m, word_t callAddr) {
+  fault(m, FAULT_UNSUPPORTED, "Unsupported ROM procedure: %04X", callAddr);
+}
+
+static void romTrapCINT(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: CINT()", callAddr);
+  RAM[RAM_DFLTO] = 3;
+  RAM[RAM_DFLTN] = 0;
+  RAM[RAM_NDX] = 0;
+  RAM[RAM_XMAX] = KEYBOARD_BUFFER_SIZE;
+  RAM[RAM_QTSW] = 0;
+  RAM[RAM_CRSW] = 0;
+  emulateC64ROM(m, C64_ROM_CALL_CLSR);
+}
+
+static void romTrapIOINIT(Emu* m, word_t callAddr) {
+  // The CIA timers are stopped with their interrupts off, then CIA 1's timer
+  // A starts for the jiffy IRQ. The ports get the KERNAL's directions: CIA 1
+  // port A drives the keyboard columns, and CIA 2 port A the serial bus and
+  // VIC bank.
+  romTrace(m, "ROM %04X: IOINIT()", callAddr);
+  for (word_t cia = CIA1_BASE; cia <= CIA2_BASE; cia += 0x100) {
+    ciaWrite(m, cia + CIA_ICR, 0x7F);
+    ciaWrite(m, cia + CIA_CRA, CIA_CR_ONE_SHOT);
+    ciaWrite(m, cia + CIA_CRB, CIA_CR_ONE_SHOT);
+  }
+  ciaWrite(m, CIA1_BASE + CIA_PRA, 0x7F);
+  ciaWrite(m, CIA1_BASE + CIA_DDRA, 0xFF);
+  ciaWrite(m, CIA1_BASE + CIA_DDRB, 0x00);
+  ciaWrite(m, CIA2_BASE + CIA_PRA, 0x07);
+  ciaWrite(m, CIA2_BASE + CIA_DDRA, 0x3F);
+  ciaWrite(m, CIA1_BASE + CIA_TALO, toLo(JIFFY_TIMER));
+  ciaWrite(m, CIA1_BASE + CIA_TAHI, toHi(JIFFY_TIMER));
+  ciaWrite(m, CIA1_BASE + CIA_ICR, 0x81);
+  ciaWrite(m, CIA1_BASE + CIA_CRA, CIA_CR_LOAD | CIA_CR_START);
+}
+
+static void romTrapRAMTAS(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: RAMTAS()", callAddr);
+  memset(&RAM[0x0002], 0, 0x0100);
+  memset(&RAM[0x0200], 0, 0x0200);
+  RAM[RAM_TAPE1] = 0x3C; // tape buffer at $033C
+  RAM[RAM_TAPE1+1] = 0x03;
+  RAM[RAM_MEMSTR] = 0x00; // BASIC from $0800
+  RAM[RAM_MEMSTR+1] = 0x08;
+  RAM[RAM_MEMSIZ] = 0x00; // up to $A000
+  RAM[RAM_MEMSIZ+1] = 0xA0;
+  RAM[RAM_HIBASE] = 0x04; // screen at $0400
+}
+
+static void romTrapRESTOR(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: RESTOR()", callAddr);
+  memcpy(&RAM[RAM_CINV], &m->rom->kernal[KERNAL_VECTORS - 0xE000], KERNAL_VECTORS_SIZE);
+}
+
+static void romTrapVECTOR(Emu* m, word_t callAddr) {
+  word_t table = toWord(X, Y);
+  bool read = getFlag(m, FLAG_C);
+  romTrace(m, "ROM %04X: VECTOR(X:adrLo=%02X,Y:adrHi=%02X,C:%s)",
+      callAddr, X, Y, read ? "read" : "set");
+  for (int i=0; i < KERNAL_VECTORS_SIZE; i++) {
+    if (read)
+      RAM[(word_t)(table + i)] = RAM[RAM_CINV + i];
+    else
+      RAM[RAM_CINV + i] = RAM[(word_t)(table + i)];
+  }
+}
+
+static void romTrapSETMSG(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: SETMSG(A:flags=%02X)", callAddr, A);
+  RAM[RAM_MSGFLG] = A;
+  A = RAM[RAM_STATUS]; // falls through to READST in the ROM
+}
+
+static void romTrapSECOND(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: SECOND(A:sec=%02X)", callAddr, A);
+  int device = getSerialBusAddrDevice(m);
+  if (getSerialBusAddrState(m) != SERIAL_BUS_STATE_LISTENER)
+    error(m, "SECOND called while no device is listening.");
+  if (IS_DISK_DEVICE(device))
+    diskSECOND(m, A);
+  else
+    fault(m, FAULT_UNSUPPORTED, "SECOND not supported on device %d.", device);
+}
+
+static void romTrapTKSA(Emu* m, word_t callAddr) {
+  int device = getSerialBusAddrDevice(m);
+  romTrace(m, "ROM %04X: TKSA(A:sec=%02X) [dev=%02X]", callAddr, A, device);
+  if (getSerialBusAddrState(m) != SERIAL_BUS_STATE_TALKER)
+    error(m, "TKSA called while no device is talking.");
+  if (IS_DISK_DEVICE(device))
+    diskTKSA(m, A);
+  else
+    fault(m, FAULT_UNSUPPORTED, "TKSA not supported for device %d.", A);
+}
+
+// MEMTOP and MEMBOT read a pointer into X and Y when carry is set, and set it
+// from them when it's clear.
+static void romMemoryPointer(Emu* m, word_t callAddr, const char* name, word_t addr) {
+  if (getFlag(m, FLAG_C)) {
+    X = RAM[addr];
+    Y = RAM[addr+1];
+  } else {
+    RAM[addr] = X;
+    RAM[addr+1] = Y;
+  }
+  romTrace(m, "ROM %04X: %s(C:%s) -> X:lo=%02X,Y:hi=%02X",
+      callAddr, name, getFlag(m, FLAG_C) ? "read" : "set", X, Y);
+}
+
+static void romTrapMEMTOP(Emu* m, word_t callAddr) {
+  romMemoryPointer(m, callAddr, "MEMTOP", RAM_MEMSIZ);
+}
+
+static void romTrapMEMBOT(Emu* m, word_t callAddr) {
+  romMemoryPointer(m, callAddr, "MEMBOT", RAM_MEMSTR);
+}
+
+static void romTrapSCNKEY(Emu* m, word_t callAddr) {
+  // There's no keyboard matrix, so no key is ever down, but keys from the
+  // input script go in the buffer.
+  romTrace(m, "ROM %04X: SCNKEY()", callAddr);
+  RAM[RAM_SFDX] = 64;
+  RAM[RAM_SHFLAG] = 0;
+  keyboardRefill(m);
+}
+
+static void romTrapSETTMO(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: SETTMO(A:timeout=%02X)", callAddr, A);
+  RAM[RAM_TIMOUT] = A;
+}
+
+static void romTrapACPTR(Emu* m, word_t callAddr) {
+  // Returns a received byte in A.
+  int device = getSerialBusAddrDevice(m);
+  if (getSerialBusAddrState(m) != SERIAL_BUS_STATE_TALKER)
+    error(m, "ACPTR called while no device is talking.");
+  // I think the secondary for a disk command is 0x60 | channel.
+  if (IS_DISK_DEVICE(device))
+    A = diskACPTR(m);
+  else
+    fault(m, FAULT_UNSUPPORTED, "ROM: ACPTR not supported on device %d.", device);
+  romSetNZ(m, A);
+  setFlag(m, FLAG_C, false); // no error
+  romTrace(m, "ROM %04X: ACPTR() [dev=%02X] -> %02X", callAddr, device, A);
+  romBulkRead(m, callAddr);
+}
+
+static void romTrapCIOUT(Emu* m, word_t callAddr) {
+  byte_t device = getSerialBusAddrDevice(m);
+  char displayChar = renderDisplayChar(A);
+  romTrace(m, "ROM %04X: CIOUT(A:data=%02X '%c') [dev=%d]",
+      callAddr, A, displayChar, device);
+  if (device <= 3)
+    error(m, "Invalid device for CIOUT: %d (must be serial device)", device);
+  if (!IS_DISK_DEVICE(device))
+    fault(m, FAULT_UNSUPPORTED, "CIOUT not supported on device %d.", device);
+  if (getSerialBusAddrState(m) != SERIAL_BUS_STATE_LISTENER)
+    error(m, "CIOUT called while no device is listening.");
+  diskCIOUT(m, A);
+  romBulkWrite(m, callAddr);
+}
+
+static void romTrapUNTLK(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: UNTLK()", callAddr);
+  m->serialBusActiveAddress = 0;
+  // nothing else to do
+}
+
+static void romTrapUNLSN(Emu* m, word_t callAddr) {
+  byte_t device = RAM[RAM_FA];
+  romTrace(m, "ROM %04X: UNLSN() [dev=%d]", callAddr, device);
+  if (IS_DISK_DEVICE(device))
+    diskUNLSN(m);
+  else
+    fault(m, FAULT_UNSUPPORTED, "UNLSN not supported on device %d.", device);
+  m->serialBusActiveAddress = 0;
+}
+
+static void romTrapLISTEN(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: LISTEN(A:dev=%02X)", callAddr, A);
+  byte_t device = A;
+  RAM[RAM_FA] = device;
+  m->serialBusActiveAddress = A | SERIAL_BUS_STATE_LISTENER;
+  if (IS_DISK_DEVICE(device))
+    diskLISTEN(m);
+  else
+    fault(m, FAULT_UNSUPPORTED, "LISTEN not supported on device %d.", device);
+}
+
+static void romTrapTALK(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: TALK(A:dev=%02X)", callAddr, A);
+  RAM[RAM_FA] = A; // device number XXX is this right?
+  m->serialBusActiveAddress = A | SERIAL_BUS_STATE_TALKER;
+}
+
+static void romTrapREADST(Emu* m, word_t callAddr) {
+  A = RAM[RAM_STATUS];
+  romSetNZ(m, A);
+  romTrace(m, "ROM %04X: READST() -> %02X", callAddr, A);
+}
+
+static void romTrapSETLFS(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: SETLFS(A:logFiNo=%02X,X:dev=%02X,Y:sec=%02X)",
+      callAddr, A, X, Y);
+  RAM[RAM_LA] = A; // logical file number
+  RAM[RAM_FA] = X; // device number
+  RAM[RAM_SA] = Y; // command / secondary address
+}
+
+static void romTrapSETNAM(Emu* m, word_t callAddr) {
+  assert(A <= 16);
+  RAM[RAM_FNLEN] = A; // filename length
+  RAM[RAM_FNADR] = X; // filename address, lo
+  RAM[RAM_FNADR+1] = Y; // filename address, hi
+  char filename[17];
+  memcpy(filename, &RAM[toWord(X, Y)], A);
+  filename[A] = 0;
+  romTrace(m, "ROM %04X: SETNAM(A:fnLen=%02X,X:fnAdrLo=%02X,Y:fnAdrHi=%02X) '%s'",
+      callAddr, A, X, Y, filename);
+}
+
+static void romTrapOPEN(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: OPEN()", callAddr);
+  romOpen(m);
+}
+
+static void romTrapCLOSE(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: CLOSE(A:fd=%02X)", callAddr, A);
+  romClose(m, A);
+}
+
+static void romTrapCHKIN(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: CHKIN(X:logFiNo=%02X)", callAddr, X);
+  romCHKIN(m, X);
+}
+
+static void romTrapCHKOUT(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: CHKOUT(X:logFiNo=%02X)", callAddr, X);
+  romCHKOUT(m, X);
+}
+
+static void romTrapCLRCHN(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: CLRCHN()", callAddr);
+  romClrch(m);
+}
+
+static void romTrapBASIN(Emu* m, word_t callAddr) {
+  // BASIN: INPUT CHARACTER FROM CHANNEL INPUT DIFFERS FROM GET ON DEVICE
+  // #0 FUNCTION WHICH IS KEYBOARD. THE SCREEN EDITOR MAKES READY AN ENTIRE
+  // LINE WHICH IS PASSED CHAR BY CHAR UP TO THE CARRIAGE RETURN. OTHER
+  // DEVICES ARE: 0 KEYBOARD; 1 CASSETTE #1; 2 RS232; 3 SCREEN; 4-31 SERIAL
+  // BUS
+  int device = RAM[RAM_DFLTN];
+  romTrace(m, "ROM %04X: BASIN [dev=%d]", callAddr, device);
+  switch (device) {
+    case 0:
+      if (romBasinKeyboard(m, callAddr))
+        setFlag(m, FLAG_C, false);
+      break;
+    case 1:
+    case 2:
+      fault(m, FAULT_UNSUPPORTED, "BASIN not supported on device %d.", device);
+    case 3:
+      fault(m, FAULT_UNSUPPORTED, "BASIN not supported on screen yet.");
 #if 0
-            RAM[RAM_CRSW] = device;
-            RAM[RAM_INDX] = RAM[RAM_LNMX];
-            romInputLineUntilCR(m);
-            break;
+      RAM[RAM_CRSW] = device;
+      RAM[RAM_INDX] = RAM[RAM_LNMX];
+      romInputLineUntilCR(m);
+      break;
 #endif
-          default: // serial device
-            if (RAM[RAM_STATUS] == 0) {
-              romTrace(m, "BASIN calls ACPTR for serial device.");
-              emulateC64ROM(m, C64_ROM_CALL_ACPTR);
-            } else {
-              // error
-              A = 0xD;
-              setFlag(m, FLAG_C, false);
-            }
-            break;
-        }
+    default: // serial device
+      if (RAM[RAM_STATUS] == 0) {
+        romTrace(m, "BASIN calls ACPTR for serial device.");
+        emulateC64ROM(m, C64_ROM_CALL_ACPTR);
+        if (RAM[RAM_STATUS] == 0)
+          romBulkRead(m, callAddr);
+      } else {
+        // error
+        A = 0xD;
+        setFlag(m, FLAG_C, false);
       }
       break;
+  }
+}
 
-    case C64_ROM_CALL_CIOUT:
-      {
-        byte_t device = getSerialBusAddrDevice(m);
-        char displayChar = renderDisplayChar(A);
-        romTrace(m, "ROM %04X: CIOUT(A:data=%02X '%c') [dev=%d]",
-            callAddr, A, displayChar, device);
-        if (device <= 3)
-          error(m, "Invalid device for CIOUT: %d (must be serial device)", device);
-        if (device < 8)
-          error(m, "CIOUT not supported on device %d.", device);
-        if (getSerialBusAddrState(m) != SERIAL_BUS_STATE_LISTENER)
-          error(m, "CIOUT called while no device is listening.");
-        diskCIOUT(m, A);
-      }
+static void romTrapBSOUT(Emu* m, word_t callAddr) {
+  int device = RAM[RAM_DFLTO];
+  char displayChar = renderDisplayChar(A);
+  romTrace(m, "ROM %04X: BSOUT(A=%02X '%c') [dev=%d]",
+      callAddr, A, displayChar, device);
+  switch (device) {
+    case 0:
+      error(m, "BSOUT to keyboard is invalid.");
+    case 1:
+    case 2:
+      fault(m, FAULT_UNSUPPORTED, "BSOUT not supported on device %d.", device);
+    case 3:
+      romBsoutScreen(m, A);
+      setFlag(m, FLAG_C, false);
       break;
+    default:
+      romTrace(m, "BSOUT calls CIOUT for serial device.");
+      emulateC64ROM(m, C64_ROM_CALL_CIOUT);
+      romBulkWrite(m, callAddr);
+  }
+}
 
-    case C64_ROM_CALL_SECOND:
-      {
-        romTrace(m, "ROM %04X: SECOND(A:sec=%02X)", callAddr, A);
-        int device = getSerialBusAddrDevice(m);
-        if (getSerialBusAddrState(m) != SERIAL_BUS_STATE_LISTENER)
-          error(m, "SECOND called while no device is listening.");
-        if (device >= 8)
-          diskSECOND(m, A);
-        else
-          error(m, "SECOND not supported on device %d.", device);
-      }
-      break;
+static void romTrapLOAD(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: LOAD(A:vfy=%02X,X:adrLo=%02X,Y:adrHi=%02X)",
+      callAddr, A, X, Y);
+  byte_t dev = RAM[RAM_FA];
+  RAM[RAM_VERCK] = A;
+  RAM[RAM_MEMUSS] = X;
+  RAM[RAM_MEMUSS+1] = Y;
+  if (IS_DISK_DEVICE(dev))
+    diskLOAD(m);
+  else if (dev >= 4)
+    romError(m, 5); // device not present
+  else
+    fault(m, FAULT_UNSUPPORTED, "Load only supports devices 8-11, selected device %d", dev);
+}
 
-    case C64_ROM_CALL_LISTEN:
-      romTrace(m, "ROM %04X: LISTEN(A:dev=%02X)", callAddr, A);
-      {
-        byte_t device = A;
-        RAM[RAM_FA] = device;
-        m->serialBusActiveAddress = A | SERIAL_BUS_STATE_LISTENER;
-        if (device == 8) {
-          diskLISTEN(m);
-        } else {
-          error(m, "LISTEN not supported on device %d.", device);
-        }
-      }
-      break;
+static void romTrapSAVE(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: SAVE(A:startPtr=%02X,X:endLo=%02X,Y:endHi=%02X)",
+      callAddr, A, X, Y);
+  byte_t dev = RAM[RAM_FA];
+  word_t start = toWord(RAM[A], RAM[(byte_t)(A+1)]);
+  RAM[RAM_STAL] = toLo(start);
+  RAM[RAM_STAL+1] = toHi(start);
+  RAM[RAM_END_PROG] = X;
+  RAM[RAM_END_PROG+1] = Y;
+  if (IS_DISK_DEVICE(dev))
+    diskSAVE(m, start, toWord(X, Y));
+  else if (dev >= 4)
+    romError(m, 5); // device not present
+  else
+    fault(m, FAULT_UNSUPPORTED, "Save only supports devices 8-11, selected device %d", dev);
+}
 
-    case C64_ROM_CALL_UNLSN:
-      {
-        byte_t device = RAM[RAM_FA];
-        romTrace(m, "ROM %04X: UNLSN() [dev=%d]", callAddr, device);
-        if (device >= 8)
-          diskUNLSN(m);
-        else
-          error(m, "UNLSN not supported on device %d.", device);
-        m->serialBusActiveAddress = 0;
-      }
-      break;
+// The jiffy clock is big endian: TIME is the high byte.
+static void romTrapSETTIM(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: SETTIM(A:lo=%02X,X:mid=%02X,Y:hi=%02X)", callAddr, A, X, Y);
+  RAM[RAM_TIME+2] = A;
+  RAM[RAM_TIME+1] = X;
+  RAM[RAM_TIME] = Y;
+}
 
-    case C64_ROM_CALL_TALK:
-      romTrace(m, "ROM %04X: TALK(A:dev=%02X)", callAddr, A);
-      RAM[RAM_FA] = A; // device number XXX is this right?
-      m->serialBusActiveAddress = A | SERIAL_BUS_STATE_TALKER;
-      break;
+static void romTrapRDTIM(Emu* m, word_t callAddr) {
+  A = RAM[RAM_TIME+2];
+  X = RAM[RAM_TIME+1];
+  Y = RAM[RAM_TIME];
+  romTrace(m, "ROM %04X: RDTIM() -> A:lo=%02X,X:mid=%02X,Y:hi=%02X", callAddr, A, X, Y);
+}
 
-    case C64_ROM_CALL_TKSA:
-      {
-        int device = getSerialBusAddrDevice(m);
-        romTrace(m, "ROM %04X: TKSA(A:sec=%02X) [dev=%02X]", callAddr, A, device);
-        if (getSerialBusAddrState(m) != SERIAL_BUS_STATE_TALKER)
-          error(m, "TKSA called while no device is talking.");
-        if (device >= 8)
-          diskTKSA(m, A);
-        else
-          error(m, "TKSA not supported for device %d.", A);
-      }
-      break;
+static void romTrapSTOP(Emu* m, word_t callAddr) {
+  bool stop = RAM[RAM_STKEY] == 0x7F;
+  romTrace(m, "ROM %04X: STOP() -> %s", callAddr, stop ? "stop" : "no stop");
+  if (stop) {
+    emulateC64ROM(m, C64_ROM_CALL_CLRCHN);
+    RAM[RAM_NDX] = 0;
+  }
+  setFlag(m, FLAG_Z, stop);
+}
 
-    case C64_ROM_CALL_ACPTR:
-      {
-        // Returns a received byte in A.
-        int device = getSerialBusAddrDevice(m);
-        if (getSerialBusAddrState(m) != SERIAL_BUS_STATE_TALKER)
-          error(m, "ACPTR called while no device is talking.");
-        // I think the secondary for a disk command is 0x60 | channel.
-        if (device >= 8)
-          A = diskACPTR(m);
-        else
-          error(m, "ROM: ACPTR not supported on device %d.", device);
-        setFlag(m, FLAG_C, false); // no error
-        romTrace(m, "ROM %04X: ACPTR() [dev=%02X] -> %02X", callAddr, device, A);
-      }
-      break;
+static void romTrapGETIN(Emu* m, word_t callAddr) {
+  if (RAM[RAM_DFLTN] != 0) {
+    romTrace(m, "ROM %04X: GETIN() [dev=%d] calls BASIN", callAddr, RAM[RAM_DFLTN]);
+    emulateC64ROM(m, C64_ROM_CALL_BASIN);
+    return;
+  }
+  int key = keyboardTake(m);
+  if (key >= 0)
+    A = key;
+  else if (m->keys)
+    A = 0; // no key yet
+  else
+    A = 0x30; // with no input script, what ACS receives here in VICE
+  romSetNZ(m, A);
+  setFlag(m, FLAG_C, false);
+  romTrace(m, "ROM %04X: GETIN() -> %02X", callAddr, A);
+}
 
-    case C64_ROM_CALL_UNTLK:
-      romTrace(m, "ROM %04X: UNTLK()", callAddr);
-      m->serialBusActiveAddress = 0;
-      // nothing else to do
-      break;
+static void romTrapCLALL(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: CLALL()", callAddr);
+  A = 0;
+  RAM[RAM_LDTND] = A;
+  emulateC64ROM(m, C64_ROM_CALL_CLRCHN);
+}
 
-    case C64_ROM_CALL_SETNAM:
-      {
-        assert(A <= 16);
-        RAM[RAM_FNLEN] = A; // filename length
-        RAM[RAM_FNADR] = X; // filename address, lo
-        RAM[RAM_FNADR+1] = Y; // filename address, hi
-        char filename[17];
-        memcpy(filename, &RAM[toWord(X, Y)], A);
-        filename[A] = 0;
-        romTrace(m, "ROM %04X: SETNAM(A:fnLen=%02X,X:fnAdrLo=%02X,Y:fnAdrHi=%02X) '%s'",
-            callAddr, A, X, Y, filename);
-      }
-      break;
+static void romTrapUDTIM(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: UDTIM()", callAddr);
+  uint32_t time = RAM[RAM_TIME] << 16 | RAM[RAM_TIME+1] << 8 | RAM[RAM_TIME+2];
+  if (++time == JIFFIES_PER_DAY)
+    time = 0;
+  RAM[RAM_TIME] = time >> 16;
+  RAM[RAM_TIME+1] = time >> 8;
+  RAM[RAM_TIME+2] = time;
+  RAM[RAM_STKEY] = 0xFF; // no key down on the stop key's row
+}
 
-    case C64_ROM_CALL_SETLFS:
-      romTrace(m, "ROM %04X: SETLFS(A:logFiNo=%02X,X:dev=%02X,Y:sec=%02X)",
-          callAddr, A, X, Y);
-      RAM[RAM_LA] = A; // logical file number
-      RAM[RAM_FA] = X; // device number
-      RAM[RAM_SA] = Y; // command / secondary address
-      break;
+// INTERRUPTS
+//
+// The KERNAL's interrupt entry is done by the interpreter (see interrupt in
+// emmain.c), which goes through the RAM vectors to these handlers or the
+// program's own.
 
-    case C64_ROM_CALL_LOAD:
-      romTrace(m, "ROM %04X: LOAD(A:vfy=%02X,X:adrHi=%02X,Y:adrLo=%02X)",
-          callAddr, A, X, Y);
-      {
-        byte_t dev = RAM[RAM_FA];
-        if (dev != 8)
-          error(m, "Load only supports device 8, selected device %d", dev);
-        RAM[RAM_VERCK] = A;
-        RAM[RAM_MEMUSS] = X;
-        RAM[RAM_MEMUSS+1] = Y;
-        // TODO: Call loadPRG or something like that.
-        // Need to port Lua load file code.
-        // set RAM_END_PROG to the end of the loaded file (EAL/EAH)
-      }
-      break;
+// Return from an interrupt, pulling the A, X and Y that the KERNAL saved.
+// The trap returns with an RTS, so the return address is made one less than
+// where the interrupt came in.
+static void romReturnFromInterrupt(Emu* m) {
+  Y = pull(m);
+  X = pull(m);
+  A = pull(m);
+  m->reg.p = pullFlags(m);
+  word_t ret = toWord(RAM[0x100 + (byte_t)(SP + 1)], RAM[0x100 + (byte_t)(SP + 2)]) - 1;
+  RAM[0x100 + (byte_t)(SP + 1)] = toLo(ret);
+  RAM[0x100 + (byte_t)(SP + 2)] = toHi(ret);
+  pollInterrupts(m);
+}
 
-    case C64_ROM_CALL_OPEN:
-      romTrace(m, "ROM %04X: OPEN()", callAddr);
-      romOpen(m);
-      break;
+static void romTrapIRQ(Emu* m, word_t callAddr) {
+  // The jiffy IRQ: there's no cursor to blink or tape motor to run.
+  romTrace(m, "ROM %04X: IRQ()", callAddr);
+  emulateC64ROM(m, C64_ROM_CALL_UDTIM);
+  emulateC64ROM(m, C64_ROM_CALL_SCNKEY);
+  ciaRead(m, CIA1_BASE + CIA_ICR); // acknowledges the interrupt
+  romReturnFromInterrupt(m);
+}
 
-    case C64_ROM_CALL_CLOSE:
-      romTrace(m, "ROM %04X: CLOSE(A:fd=%02X)", callAddr, A);
-      romClose(m, A);
-      break;
+static void romTrapIRQExit(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: IRQ exit", callAddr);
+  romReturnFromInterrupt(m);
+}
 
-    case C64_ROM_CALL_CLALL:
-      romTrace(m, "ROM %04X: CLALL()", callAddr);
-      A = 0;
-      RAM[RAM_LDTND] = A;
-      emulateC64ROM(m, C64_ROM_CALL_CLRCHN);
-      break;
+static void romTrapNMI(Emu* m, word_t callAddr) {
+  // No RS-232 and no RESTORE key, so just acknowledge CIA 2.
+  romTrace(m, "ROM %04X: NMI()", callAddr);
+  push(m, A);
+  push(m, X);
+  push(m, Y);
+  ciaRead(m, CIA2_BASE + CIA_ICR);
+  romReturnFromInterrupt(m);
+}
 
-    default:
-      error(m, "Unsupported ROM procedure: %04X", callAddr);
+static void romTrapSCREEN(Emu* m, word_t callAddr) {
+  X = SCREEN_COLUMNS;
+  Y = SCREEN_ROWS;
+  romTrace(m, "ROM %04X: SCREEN() -> X:cols=%02X,Y:rows=%02X", callAddr, X, Y);
+}
+
+static void romTrapPLOT(Emu* m, word_t callAddr) {
+  if (getFlag(m, FLAG_C)) {
+    X = RAM[RAM_TBLX];
+    Y = RAM[RAM_PNTR];
+  } else {
+    romSetCursor(m, X, Y);
   }
+  romTrace(m, "ROM %04X: PLOT(C:%s) -> X:row=%02X,Y:col=%02X",
+      callAddr, getFlag(m, FLAG_C) ? "read" : "set", X, Y);
+}
+
+static void romTrapIOBASE(Emu* m, word_t callAddr) {
+  X = 0x00; // CIA 1 at $DC00
+  Y = 0xDC;
+  romTrace(m, "ROM %04X: IOBASE() -> X:lo=%02X,Y:hi=%02X", callAddr, X, Y);
+}
+
+static void romTrapCLSR(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: CLSR()", callAddr);
+  for (unsigned row=0; row < SCREEN_ROWS; row++)
+    clearScreenLine(m, row);
+  romSetCursor(m, 0, 0);
+}
+
+static void romTrapHOME(Emu* m, word_t callAddr) {
+  romTrace(m, "ROM %04X: HOME()", callAddr);
+  romSetCursor(m, 0, 0);
+}
+
+// BASIC: print the zero terminated string at A (lo) and Y (hi).
+static void romTrapSTROUT(Emu* m, word_t callAddr) {
+  word_t addr = toWord(A, Y);
+  romTrace(m, "ROM %04X: STROUT(A:strLo=%02X,Y:strHi=%02X)", callAddr, A, Y);
+  for (byte_t c; (c = RAM[addr]) != 0; addr++) {
+    A = c;
+    emulateC64ROM(m, C64_ROM_CALL_BSOUT);
+  }
+}
+
+// BASIC: print the unsigned number in A (hi) and X (lo) in decimal.
+static void romTrapLINPRT(Emu* m, word_t callAddr) {
+  char digits[6];
+  snprintf(digits, sizeof(digits), "%u", toWord(X, A));
+  romTrace(m, "ROM %04X: LINPRT(A:hi=%02X,X:lo=%02X) %s", callAddr, A, X, digits);
+  for (char* p = digits; *p; p++) {
+    A = *p;
+    emulateC64ROM(m, C64_ROM_CALL_BSOUT);
+  }
+}
+
+// The emulated ROM routines. The index in this table is what romTrapIndex
+// holds, with 0 for no trap and 1 for an unsupported KERNAL address.
+const RomTrap ROM_TRAPS[] = {
+  { 0, NULL, NULL },
+  { 0, "unsupported", romUnsupported },
+  // KERNAL jump table
+  { 0xFF81, "CINT", romTrapCINT },
+  { 0xFF84, "IOINIT", romTrapIOINIT },
+  { 0xFF87, "RAMTAS", romTrapRAMTAS },
+  { 0xFF8A, "RESTOR", romTrapRESTOR },
+  { 0xFF8D, "VECTOR", romTrapVECTOR },
+  { 0xFF90, "SETMSG", romTrapSETMSG },
+  { C64_ROM_CALL_SECOND, "SECOND", romTrapSECOND },
+  { C64_ROM_CALL_TKSA, "TKSA", romTrapTKSA },
+  { 0xFF99, "MEMTOP", romTrapMEMTOP },
+  { 0xFF9C, "MEMBOT", romTrapMEMBOT },
+  { C64_ROM_CALL_SCNKEY, "SCNKEY", romTrapSCNKEY },
+  { 0xFFA2, "SETTMO", romTrapSETTMO },
+  { C64_ROM_CALL_ACPTR, "ACPTR", romTrapACPTR },
+  { C64_ROM_CALL_CIOUT, "CIOUT", romTrapCIOUT },
+  { C64_ROM_CALL_UNTLK, "UNTLK", romTrapUNTLK },
+  { C64_ROM_CALL_UNLSN, "UNLSN", romTrapUNLSN },
+  { C64_ROM_CALL_LISTEN, "LISTEN", romTrapLISTEN },
+  { C64_ROM_CALL_TALK, "TALK", romTrapTALK },
+  { 0xFFB7, "READST", romTrapREADST },
+  { C64_ROM_CALL_SETLFS, "SETLFS", romTrapSETLFS },
+  { C64_ROM_CALL_SETNAM, "SETNAM", romTrapSETNAM },
+  { C64_ROM_CALL_OPEN, "OPEN", romTrapOPEN },
+  { C64_ROM_CALL_CLOSE, "CLOSE", romTrapCLOSE },
+  { C64_ROM_CALL_CHKIN, "CHKIN", romTrapCHKIN },
+  { C64_ROM_CALL_CHKOUT, "CHKOUT", romTrapCHKOUT },
+  { C64_ROM_CALL_CLRCHN, "CLRCHN", romTrapCLRCHN },
+  { C64_ROM_CALL_BASIN, "BASIN", romTrapBASIN },
+  { C64_ROM_CALL_BSOUT, "BSOUT", romTrapBSOUT },
+  { C64_ROM_CALL_LOAD, "LOAD", romTrapLOAD },
+  { C64_ROM_CALL_SAVE, "SAVE", romTrapSAVE },
+  { 0xFFDB, "SETTIM", romTrapSETTIM },
+  { 0xFFDE, "RDTIM", romTrapRDTIM },
+  { 0xFFE1, "STOP", romTrapSTOP },
+  { C64_ROM_CALL_GETIN, "GETIN", romTrapGETIN },
+  { C64_ROM_CALL_CLALL, "CLALL", romTrapCLALL },
+  { C64_ROM_CALL_UDTIM, "UDTIM", romTrapUDTIM },
+  { 0xFFED, "SCREEN", romTrapSCREEN },
+  { 0xFFF0, "PLOT", romTrapPLOT },
+  { 0xFFF3, "IOBASE", romTrapIOBASE },
+  // KERNAL screen editor
+  { C64_ROM_CALL_CLSR, "CLSR", romTrapCLSR },
+  { 0xE566, "HOME", romTrapHOME },
+  // KERNAL interrupt handlers
+  { 0xEA31, "IRQ", romTrapIRQ },
+  { 0xEA81, "IRQ exit", romTrapIRQExit },
+  { 0xFE47, "NMI", romTrapNMI },
+  { 0xFEBC, "NMI exit", romTrapIRQExit },
+  // BASIC
+  { 0xAB1E, "STROUT", romTrapSTROUT },
+  { 0xBDCD, "LINPRT", romTrapLINPRT },
+};
+
+#define ROM_TRAP_TABLE_SIZE (sizeof(ROM_TRAPS) / sizeof(ROM_TRAPS[0]))
+
+_Static_assert(ROM_TRAP_TABLE_SIZE <= ROM_TRAP_MAX, "Too many ROM traps.");
+
+// Traps that only change memory through functions that count it in
+// memWrites, so that loops calling them can be idle (see idleLoopCheck). The
+// rest count as changing memory every time they're called.
+static const word_t ROM_TRAPS_READ_ONLY[] = {
+  C64_ROM_CALL_SCNKEY, // its stores are the same every time
+  0xFFB7, // READST
+  C64_ROM_CALL_BASIN,
+  0xFFDE, // RDTIM
+  C64_ROM_CALL_GETIN,
+};
+
+byte_t romTrapIndex[RAM_SIZE];
+static bool romTrapReadOnly[ROM_TRAP_MAX];
+static pthread_once_t romTrapsOnce = PTHREAD_ONCE_INIT;
+
+static void fillRomTrapIndex(void) {
+  // Anything else called in the top page of the KERNAL is unsupported, but
+  // the rest of the ROMs run from RAM as before.
+  for (int addr=0xF000; addr < RAM_SIZE; addr++)
+    romTrapIndex[addr] = ROM_TRAP_UNSUPPORTED;
+  for (unsigned i=ROM_TRAP_UNSUPPORTED+1; i < ROM_TRAP_TABLE_SIZE; i++)
+    romTrapIndex[ROM_TRAPS[i].addr] = i;
+  for (unsigned i=0; i < sizeof(ROM_TRAPS_READ_ONLY) / sizeof(word_t); i++)
+    romTrapReadOnly[romTrapIndex[ROM_TRAPS_READ_ONLY[i]]] = true;
+}
+
+void initRomTraps(void) {
+  pthread_once(&romTrapsOnce, fillRomTrapIndex);
+}
+
+void emulateC64ROM(emu_t* m, word_t callAddr) {
+  unsigned trap = romTrapIndex[callAddr];
+  if (trap == ROM_TRAP_NONE)
+    trap = ROM_TRAP_UNSUPPORTED;
+  m->romCallEmbeddingLevel++;
+  m->romTrapCalls[trap]++;
+  if (!romTrapReadOnly[trap])
+    m->memWrites++;
+  ROM_TRAPS[trap].handler(m, callAddr);
   assert(m->romCallEmbeddingLevel > 0);
   m->romCallEmbeddingLevel--;
 }
 
+bool writeRomCallCounts(Emu* m, const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    setFault(m, FAULT_ERROR, "Unable to write ROM call counts: %s", path);
+    return false;
+  }
+  fprintf(f, "address,name,calls\n");
+  for (unsigned i=ROM_TRAP_UNSUPPORTED+1; i < ROM_TRAP_TABLE_SIZE; i++) {
+    if (m->romTrapCalls[i])
+      fprintf(f, "%04X,%s,%" PRIu64 "\n", ROM_TRAPS[i].addr, ROM_TRAPS[i].name,
+          m->romTrapCalls[i]);
+  }
+  if (fclose(f) != 0) {
+    setFault(m, FAULT_ERROR, "Unable to write ROM call counts: %s", path);
+    return false;
+  }
+  return true;
+}
+
 void romError(emu_t* m, int errorNumber) {
   romCLRCH(m);
   trace(m, true, "CBM I/O ERROR #%d: %s", errorNumber, c64RomErrors[errorNumber]);
+  A = errorNumber;
   setFlag(m, FLAG_C, true); // set carry to mark error condition
 }
 
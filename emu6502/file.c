@@ -1,4 +1,6 @@
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -7,6 +9,10 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "em.h"
 
@@ -27,15 +33,21 @@ buf_t* bufCreate() {
   }
   buf->cap = FILE_BLOCK_SIZE;
   buf->len = 0;
+  buf->mapped = false;
+  buf->fd = -1;
   buf->data = malloc(buf->cap);
   bufCheckAlloc(buf);
   return buf;
 }
 
+// Capacity doubles as needed, so appending is amortized constant time.
 void bufEnsureCap(buf_t* buf, unsigned cap) {
+  assert(!buf->mapped); // mapped buffers are read-only
   if (buf->cap < cap) {
-    while (buf->cap < cap)
-      buf->cap += FILE_BLOCK_SIZE;
+    unsigned newCap = buf->cap ? buf->cap : FILE_BLOCK_SIZE;
+    while (newCap < cap)
+      newCap *= 2;
+    buf->cap = newCap;
     buf->data = realloc(buf->data, buf->cap);
     bufCheckAlloc(buf);
   }
@@ -48,7 +60,13 @@ void bufEnsureExtraCap(buf_t* buf, unsigned extraCap) {
 void bufDestroy(buf_t* buf) {
   assert(buf);
   assert(buf->data);
-  free(buf->data);
+  if (buf->mapped)
+    munmap(buf->data, buf->cap);
+  else
+    free(buf->data);
+  if (buf->fd >= 0)
+    close(buf->fd);
+  free(buf);
 }
 
 void bufAppendChar(buf_t* buf, int c) {
@@ -58,50 +76,124 @@ void bufAppendChar(buf_t* buf, int c) {
 
 void bufAppend(buf_t* buf, const char* str) {
   while (*str)
-    bufAppendChar(buf, *str);
+    bufAppendChar(buf, *(str++));
 }
 
 // Load a ROM file, which should have the exact size specified.
-void loadROM(const char* path, byte_t* loadBuf, size_t size) {
+// Returns false if the file can't be loaded.
+bool loadROM(const char* path, byte_t* loadBuf, size_t size) {
   FILE* f = fopen(path, "rb");
   if (!f) {
     fprintf(stderr, "Unable to open ROM file: %s\n", path);
-    exit(1);
+    return false;
   }
+  bool ok = false;
   size_t nRead = fread(loadBuf, 1, size, f);
   if (nRead < size) {
     if (feof(f))
       fprintf(stderr, "ROM file is too small: %s\n", path);
     else
       fprintf(stderr, "Error reading ROM file: %s\n", path);
-    exit(1);
-  }
-  int finalRead = getc(f);
-  if (finalRead != EOF) {
+  } else if (getc(f) != EOF) {
     fprintf(stderr, "ROM file is too large: %s\n", path);
-    exit(1);
+  } else {
+    ok = true;
   }
+  fclose(f);
+  return ok;
 }
 
+// Read a file into a writable buffer.
+// Returns NULL if the file can't be read.
 buf_t* readFile(const char* path) {
   FILE* f = fopen(path, "rb");
   if (!f) {
     fprintf(stderr, "Unable to open file: %s\n", path);
-    exit(1);
+    return NULL;
   }
   buf_t* buf = bufCreate();
-  unsigned readSize = FILE_BLOCK_SIZE;
+  // Size the buffer from the file size up front so that it's normally filled
+  // by a single read. The loop still handles files that grow while we read.
+  struct stat st;
+  if (fstat(fileno(f), &st) == 0 && st.st_size > 0)
+    bufEnsureCap(buf, st.st_size + 1);
   for (;;) {
-    bufEnsureExtraCap(buf, readSize);
+    bufEnsureExtraCap(buf, FILE_BLOCK_SIZE);
+    unsigned readSize = buf->cap - buf->len;
     size_t nRead = fread(buf->data + buf->len, 1, readSize, f);
     buf->len += nRead;
     if (nRead < readSize) {
       if (feof(f))
         break;
       fprintf(stderr, "Error reading file: %s\n", path);
-      exit(1);
+      fclose(f);
+      bufDestroy(buf);
+      return NULL;
     }
   }
+  fclose(f);
+  return buf;
+}
+
+// Map a file into memory read-only. The data isn't copied; pages are read in
+// by the OS as they're touched. The buffer can't be grown or written to.
+// The file stays open so that copy-on-write views can be made of it.
+// Returns NULL if the file can't be mapped.
+buf_t* mapFile(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open file: %s\n", path);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "Unable to stat file: %s\n", path);
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size == 0) {
+    // Empty files can't be mapped, but an empty buffer is equivalent.
+    close(fd);
+    return bufCreate();
+  }
+  if ((unsigned long long)st.st_size > UINT32_MAX) {
+    fprintf(stderr, "File is too large: %s\n", path);
+    close(fd);
+    return NULL;
+  }
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Unable to map file: %s\n", path);
+    close(fd);
+    return NULL;
+  }
+  buf_t* buf = malloc(sizeof(buf_t));
+  if (!buf) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  buf->cap = st.st_size;
+  buf->len = st.st_size;
+  buf->data = data;
+  buf->mapped = true;
+  buf->fd = fd;
   return buf;
 }
 
+// Make a private, writable view of a mapped file. Its pages are shared with
+// the file (and every other view of it) until they're written, and only then
+// does the OS copy them, one page at a time. Returns NULL if the buffer isn't
+// a mapped file.
+byte_t* bufMapCopyOnWrite(const buf_t* buf) {
+  if (!buf->mapped || buf->fd < 0)
+    return NULL;
+  void* data = mmap(NULL, buf->len, PROT_READ|PROT_WRITE, MAP_PRIVATE, buf->fd, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+  return data;
+}
+
+void bufUnmapCopyOnWrite(byte_t* data, unsigned len) {
+  munmap(data, len);
+}
+
@@ -1,7 +1,13 @@
+#include <stdbool.h>
 typedef unsigned char byte_t;
 typedef struct {
   unsigned cap;
   unsigned len;
   byte_t* data;
+  bool mapped;
+  int fd;
 } buf_t;
 buf_t *readFile(const char *path);
+buf_t *mapFile(const char *path);
+byte_t *bufMapCopyOnWrite(const buf_t *buf);
+void bufUnmapCopyOnWrite(byte_t *data, unsigned len);
@@ -0,0 +1,184 @@
+
+// Serial bus test: a byte goes from drive code to the C64 and back, a bit at
+// a time over CIA 2 port A and the drive's VIA 1, with nothing else
+// involved. The drive sends a bit by putting it on DATA and toggling CLK, and
+// the C64 acknowledges it by toggling ATN. Then the C64 sends the byte plus
+// one the same way, and the drive acknowledges with CLK. In between, the C64
+// waits for DATA to be released, so the drive can't miss its last ATN. The
+// drive follows ATN with its ATN acknowledge bit, so the 1541's ATN logic
+// doesn't pull DATA. "make test" builds and runs it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "em.h"
+
+#define DRIVE_CODE_ADDR 0x0500
+#define DRIVE_BYTE_OUT 0x0600 // sent to the C64
+#define DRIVE_BYTE_IN 0x0601 // what the C64 sent back
+#define C64_CODE_ADDR 0xC000
+#define C64_BYTE_IN 0x22
+#define TEST_BYTE 0xA5
+
+// Drive side, at DRIVE_CODE_ADDR. $11 keeps what it puts on port B, $12 the
+// last ATN it saw.
+static const byte_t DRIVE_CODE[] = {
+  0xA9, 0x1A,          // LDA #$1A
+  0x8D, 0x02, 0x18,    // STA $1802
+  0xA9, 0x00,          // LDA #$00
+  0x85, 0x11,          // STA $11
+  0x8D, 0x00, 0x18,    // STA $1800
+  0x85, 0x12,          // STA $12
+  0xAD, 0x00, 0x06,    // LDA $0600
+  0x85, 0x10,          // STA $10
+  0xA2, 0x08,          // LDX #$08
+  // send:
+  0x06, 0x10,          // ASL $10
+  0xA5, 0x11,          // LDA $11
+  0x29, 0x18,          // AND #$18
+  0x90, 0x02,          // BCC send1
+  0x09, 0x02,          // ORA #$02
+  // send1:
+  0x49, 0x08,          // EOR #$08
+  0x85, 0x11,          // STA $11
+  0x8D, 0x00, 0x18,    // STA $1800
+  // sendack:
+  0xAD, 0x00, 0x18,    // LDA $1800
+  0x29, 0x80,          // AND #$80
+  0xC5, 0x12,          // CMP $12
+  0xF0, 0xF7,          // BEQ sendack
+  0x85, 0x12,          // STA $12
+  0xA5, 0x11,          // LDA $11
+  0x49, 0x10,          // EOR #$10
+  0x85, 0x11,          // STA $11
+  0x8D, 0x00, 0x18,    // STA $1800
+  0xCA,                // DEX
+  0xD0, 0xD8,          // BNE send
+  0xA5, 0x11,          // LDA $11
+  0x29, 0x18,          // AND #$18
+  0x85, 0x11,          // STA $11
+  0x8D, 0x00, 0x18,    // STA $1800
+  0xA2, 0x08,          // LDX #$08
+  // recv:
+  0xAD, 0x00, 0x18,    // LDA $1800
+  0x29, 0x80,          // AND #$80
+  0xC5, 0x12,          // CMP $12
+  0xF0, 0xF7,          // BEQ recv
+  0x85, 0x12,          // STA $12
+  0xA5, 0x11,          // LDA $11
+  0x49, 0x10,          // EOR #$10
+  0x85, 0x11,          // STA $11
+  0x8D, 0x00, 0x18,    // STA $1800
+  0xAD, 0x00, 0x18,    // LDA $1800
+  0x4A,                // LSR
+  0x26, 0x13,          // ROL $13
+  0xA5, 0x11,          // LDA $11
+  0x49, 0x08,          // EOR #$08
+  0x85, 0x11,          // STA $11
+  0x8D, 0x00, 0x18,    // STA $1800
+  0xCA,                // DEX
+  0xD0, 0xDA,          // BNE recv
+  0xA5, 0x13,          // LDA $13
+  0x8D, 0x01, 0x06,    // STA $0601
+  0x60,                // RTS
+};
+
+// C64 side, at C64_CODE_ADDR. $20 keeps what it puts on port A, $21 the
+// last CLK it saw.
+static const byte_t C64_CODE[] = {
+  0xA9, 0x37,          // LDA #$37
+  0x85, 0x01,          // STA $01
+  0xA9, 0x3F,          // LDA #$3F
+  0x8D, 0x02, 0xDD,    // STA $DD02
+  0xA9, 0x07,          // LDA #$07
+  0x85, 0x20,          // STA $20
+  0x8D, 0x00, 0xDD,    // STA $DD00
+  0xA9, 0x40,          // LDA #$40
+  0x85, 0x21,          // STA $21
+  0xA2, 0x08,          // LDX #$08
+  // recv:
+  0xAD, 0x00, 0xDD,    // LDA $DD00
+  0x29, 0x40,          // AND #$40
+  0xC5, 0x21,          // CMP $21
+  0xF0, 0xF7,          // BEQ recv
+  0x85, 0x21,          // STA $21
+  0xAD, 0x00, 0xDD,    // LDA $DD00
+  0x49, 0x80,          // EOR #$80
+  0x0A,                // ASL
+  0x26, 0x22,          // ROL $22
+  0xA5, 0x20,          // LDA $20
+  0x49, 0x08,          // EOR #$08
+  0x85, 0x20,          // STA $20
+  0x8D, 0x00, 0xDD,    // STA $DD00
+  0xCA,                // DEX
+  0xD0, 0xE1,          // BNE recv
+  // wait: the drive releases DATA once it has seen the last ATN
+  0xAD, 0x00, 0xDD,    // LDA $DD00
+  0x29, 0x80,          // AND #$80
+  0xF0, 0xF9,          // BEQ wait
+  0xA5, 0x22,          // LDA $22
+  0x18,                // CLC
+  0x69, 0x01,          // ADC #$01
+  0x85, 0x23,          // STA $23
+  0xA2, 0x08,          // LDX #$08
+  // send:
+  0x06, 0x23,          // ASL $23
+  0xA5, 0x20,          // LDA $20
+  0x29, 0xDF,          // AND #$DF
+  0x90, 0x02,          // BCC send1
+  0x09, 0x20,          // ORA #$20
+  // send1:
+  0x49, 0x08,          // EOR #$08
+  0x85, 0x20,          // STA $20
+  0x8D, 0x00, 0xDD,    // STA $DD00
+  // sendack:
+  0xAD, 0x00, 0xDD,    // LDA $DD00
+  0x29, 0x40,          // AND #$40
+  0xC5, 0x21,          // CMP $21
+  0xF0, 0xF7,          // BEQ sendack
+  0x85, 0x21,          // STA $21
+  0xCA,                // DEX
+  0xD0, 0xE1,          // BNE send
+  0xA9, 0x07,          // LDA #$07
+  0x8D, 0x00, 0xDD,    // STA $DD00
+  0x4C, 0x25, 0x09,    // JMP $0925
+};
+
+int main(void) {
+  Emu* m = createEmulator(NULL);
+  if (!m) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  // The drive ROM only needs a reset vector, to somewhere to wait.
+  static byte_t rom[DRIVE_ROM_SIZE];
+  rom[0] = 0x4C; // JMP $C000
+  rom[2] = 0xC0;
+  rom[DRIVE_ROM_SIZE - 3] = 0xC0; // reset vector
+  buf_t romFile = { .len = DRIVE_ROM_SIZE, .data = rom, .fd = -1 };
+  if (!attachDriveCPU(m, DISKDRIVE_FIRST_DEVICE, &romFile)) {
+    fprintf(stderr, "%s\n", m->fault.message);
+    return 1;
+  }
+  m->diskdrive = m->diskdrives[0];
+  byte_t out = TEST_BYTE;
+  driveWriteMemory(m, DRIVE_CODE_ADDR, DRIVE_CODE, sizeof(DRIVE_CODE));
+  driveWriteMemory(m, DRIVE_BYTE_OUT, &out, 1);
+  memcpy(m->ram + C64_CODE_ADDR, C64_CODE, sizeof(C64_CODE));
+  m->reg.pc = C64_CODE_ADDR;
+  m->icLimit = m->reg.ic + 1000000;
+  driveExecute(m, DRIVE_CODE_ADDR);
+  int faultCode = interp(m);
+  if (faultCode != FAULT_NONE) {
+    fprintf(stderr, "Fault: %s\n", m->fault.message);
+    return 1;
+  }
+  byte_t c64In = m->ram[C64_BYTE_IN];
+  byte_t driveIn = driveReadMemory(m, DRIVE_BYTE_IN);
+  bool ok = m->reg.pc == 0x0925 && c64In == TEST_BYTE && driveIn == (byte_t)(TEST_BYTE + 1);
+  printf("Serial bus: C64 got %02X, drive got %02X: %s\n", c64In, driveIn, ok ? "ok" : "FAILED");
+  destroyEmulator(m);
+  return ok ? 0 : 1;
+}
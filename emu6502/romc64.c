@@ -0,0 +1,18 @@
+
+// C64 ROM images compiled into the executable.
+// The .inc files are generated by codegen from the ROM files in ROM_DIR (see
+// the Makefile), so the emulator doesn't need to find ROM files at runtime.
+
+#include "em.h"
+
+const RomC64 ROM_C64_BUILTIN = {
+  .chargen = {
+#include "rom_chargen.inc"
+  },
+  .basic = {
+#include "rom_basic.inc"
+  },
+  .kernal = {
+#include "rom_kernal.inc"
+  },
+};
@@ -60,3 +60,187 @@ trackinfo_t TRACK_INFO[] = {
 
 };
 
+
+// Commodore 1571 (D71): two sides of 35 tracks each. Tracks 36-70 are the
+// second side, with the same layout as tracks 1-35.
+// Source: https://ist.uwaterloo.ca/~schepers/formats/D71.TXT
+
+trackinfo_t D71_TRACK_INFO[] = {
+
+    { 0, 0, 0, 0}, // There is no track 0.
+
+    {  1, 21,    0, 0x00000 },
+    {  2, 21,   21, 0x01500 },
+    {  3, 21,   42, 0x02A00 },
+    {  4, 21,   63, 0x03F00 },
+    {  5, 21,   84, 0x05400 },
+    {  6, 21,  105, 0x06900 },
+    {  7, 21,  126, 0x07E00 },
+    {  8, 21,  147, 0x09300 },
+    {  9, 21,  168, 0x0A800 },
+    { 10, 21,  189, 0x0BD00 },
+
+    { 11, 21,  210, 0x0D200 },
+    { 12, 21,  231, 0x0E700 },
+    { 13, 21,  252, 0x0FC00 },
+    { 14, 21,  273, 0x11100 },
+    { 15, 21,  294, 0x12600 },
+    { 16, 21,  315, 0x13B00 },
+    { 17, 21,  336, 0x15000 },
+    { 18, 19,  357, 0x16500 },
+    { 19, 19,  376, 0x17800 },
+    { 20, 19,  395, 0x18B00 },
+
+    { 21, 19,  414, 0x19E00 },
+    { 22, 19,  433, 0x1B100 },
+    { 23, 19,  452, 0x1C400 },
+    { 24, 19,  471, 0x1D700 },
+    { 25, 18,  490, 0x1EA00 },
+    { 26, 18,  508, 0x1FC00 },
+    { 27, 18,  526, 0x20E00 },
+    { 28, 18,  544, 0x22000 },
+    { 29, 18,  562, 0x23200 },
+    { 30, 18,  580, 0x24400 },
+
+    { 31, 17,  598, 0x25600 },
+    { 32, 17,  615, 0x26700 },
+    { 33, 17,  632, 0x27800 },
+    { 34, 17,  649, 0x28900 },
+    { 35, 17,  666, 0x29A00 },
+    { 36, 21,  683, 0x2AB00 },
+    { 37, 21,  704, 0x2C000 },
+    { 38, 21,  725, 0x2D500 },
+    { 39, 21,  746, 0x2EA00 },
+    { 40, 21,  767, 0x2FF00 },
+
+    { 41, 21,  788, 0x31400 },
+    { 42, 21,  809, 0x32900 },
+    { 43, 21,  830, 0x33E00 },
+    { 44, 21,  851, 0x35300 },
+    { 45, 21,  872, 0x36800 },
+    { 46, 21,  893, 0x37D00 },
+    { 47, 21,  914, 0x39200 },
+    { 48, 21,  935, 0x3A700 },
+    { 49, 21,  956, 0x3BC00 },
+    { 50, 21,  977, 0x3D100 },
+
+    { 51, 21,  998, 0x3E600 },
+    { 52, 21, 1019, 0x3FB00 },
+    { 53, 19, 1040, 0x41000 },
+    { 54, 19, 1059, 0x42300 },
+    { 55, 19, 1078, 0x43600 },
+    { 56, 19, 1097, 0x44900 },
+    { 57, 19, 1116, 0x45C00 },
+    { 58, 19, 1135, 0x46F00 },
+    { 59, 19, 1154, 0x48200 },
+    { 60, 18, 1173, 0x49500 },
+
+    { 61, 18, 1191, 0x4A700 },
+    { 62, 18, 1209, 0x4B900 },
+    { 63, 18, 1227, 0x4CB00 },
+    { 64, 18, 1245, 0x4DD00 },
+    { 65, 18, 1263, 0x4EF00 },
+    { 66, 17, 1281, 0x50100 },
+    { 67, 17, 1298, 0x51200 },
+    { 68, 17, 1315, 0x52300 },
+    { 69, 17, 1332, 0x53400 },
+    { 70, 17, 1349, 0x54500 },
+
+};
+
+// Commodore 1581 (D81): 80 tracks of 40 sectors.
+// Source: https://ist.uwaterloo.ca/~schepers/formats/D81.TXT
+
+trackinfo_t D81_TRACK_INFO[] = {
+
+    { 0, 0, 0, 0}, // There is no track 0.
+
+    {  1, 40,    0, 0x00000 },
+    {  2, 40,   40, 0x02800 },
+    {  3, 40,   80, 0x05000 },
+    {  4, 40,  120, 0x07800 },
+    {  5, 40,  160, 0x0A000 },
+    {  6, 40,  200, 0x0C800 },
+    {  7, 40,  240, 0x0F000 },
+    {  8, 40,  280, 0x11800 },
+    {  9, 40,  320, 0x14000 },
+    { 10, 40,  360, 0x16800 },
+
+    { 11, 40,  400, 0x19000 },
+    { 12, 40,  440, 0x1B800 },
+    { 13, 40,  480, 0x1E000 },
+    { 14, 40,  520, 0x20800 },
+    { 15, 40,  560, 0x23000 },
+    { 16, 40,  600, 0x25800 },
+    { 17, 40,  640, 0x28000 },
+    { 18, 40,  680, 0x2A800 },
+    { 19, 40,  720, 0x2D000 },
+    { 20, 40,  760, 0x2F800 },
+
+    { 21, 40,  800, 0x32000 },
+    { 22, 40,  840, 0x34800 },
+    { 23, 40,  880, 0x37000 },
+    { 24, 40,  920, 0x39800 },
+    { 25, 40,  960, 0x3C000 },
+    { 26, 40, 1000, 0x3E800 },
+    { 27, 40, 1040, 0x41000 },
+    { 28, 40, 1080, 0x43800 },
+    { 29, 40, 1120, 0x46000 },
+    { 30, 40, 1160, 0x48800 },
+
+    { 31, 40, 1200, 0x4B000 },
+    { 32, 40, 1240, 0x4D800 },
+    { 33, 40, 1280, 0x50000 },
+    { 34, 40, 1320, 0x52800 },
+    { 35, 40, 1360, 0x55000 },
+    { 36, 40, 1400, 0x57800 },
+    { 37, 40, 1440, 0x5A000 },
+    { 38, 40, 1480, 0x5C800 },
+    { 39, 40, 1520, 0x5F000 },
+    { 40, 40, 1560, 0x61800 },
+
+    { 41, 40, 1600, 0x64000 },
+    { 42, 40, 1640, 0x66800 },
+    { 43, 40, 1680, 0x69000 },
+    { 44, 40, 1720, 0x6B800 },
+    { 45, 40, 1760, 0x6E000 },
+    { 46, 40, 1800, 0x70800 },
+    { 47, 40, 1840, 0x73000 },
+    { 48, 40, 1880, 0x75800 },
+    { 49, 40, 1920, 0x78000 },
+    { 50, 40, 1960, 0x7A800 },
+
+    { 51, 40, 2000, 0x7D000 },
+    { 52, 40, 2040, 0x7F800 },
+    { 53, 40, 2080, 0x82000 },
+    { 54, 40, 2120, 0x84800 },
+    { 55, 40, 2160, 0x87000 },
+    { 56, 40, 2200, 0x89800 },
+    { 57, 40, 2240, 0x8C000 },
+    { 58, 40, 2280, 0x8E800 },
+    { 59, 40, 2320, 0x91000 },
+    { 60, 40, 2360, 0x93800 },
+
+    { 61, 40, 2400, 0x96000 },
+    { 62, 40, 2440, 0x98800 },
+    { 63, 40, 2480, 0x9B000 },
+    { 64, 40, 2520, 0x9D800 },
+    { 65, 40, 2560, 0xA0000 },
+    { 66, 40, 2600, 0xA2800 },
+    { 67, 40, 2640, 0xA5000 },
+    { 68, 40, 2680, 0xA7800 },
+    { 69, 40, 2720, 0xAA000 },
+    { 70, 40, 2760, 0xAC800 },
+
+    { 71, 40, 2800, 0xAF000 },
+    { 72, 40, 2840, 0xB1800 },
+    { 73, 40, 2880, 0xB4000 },
+    { 74, 40, 2920, 0xB6800 },
+    { 75, 40, 2960, 0xB9000 },
+    { 76, 40, 3000, 0xBB800 },
+    { 77, 40, 3040, 0xBE000 },
+    { 78, 40, 3080, 0xC0800 },
+    { 79, 40, 3120, 0xC3000 },
+    { 80, 40, 3160, 0xC5800 },
+
+};